@@ -8,10 +8,16 @@
 #ifndef GUI_SERVICE_HPP
 #define GUI_SERVICE_HPP
 
+#include <optional>
 #include "soa.hpp"  
 #include "functions.hpp"
+#include "timerwheel.hpp"
+#include "guisnapshot.hpp"
 #include "pricingservice.hpp"
 
+// Where the GUI connector writes throttled prices
+enum GUIOutputMode { GUI_FILE, GUI_SHARED_MEMORY, GUI_FILE_AND_SHARED_MEMORY };
+
 // forward declaration of Connector and Listener
 template<typename T>
 class GUIConnector;
@@ -19,7 +25,9 @@ template<typename T>
 class GUIServiceListener;
 
 /**
-* Service for outputing GUI with a certain throttle.
+* Service for outputing GUI with a certain throttle per product.
+* The latest price of a product is conflated while its throttle interval runs and
+* flushed by a timer wheel when the interval expires.
 * Keyed on product identifier.
 * Type T is the product type.
 */
@@ -29,12 +37,15 @@ class GUIService : public Service<string, Price<T>>
 
 public:
 	// ctor and dtor
-	GUIService() 
+	GUIService() : timers(NUM_PRODUCTS)
 	{
 		connector = new GUIConnector<T>(this);
 		guilistener = new GUIServiceListener<T>(this);
 		throttle = 300;
-		cur_time = std::chrono::system_clock::now();
+		timers.Reset(getSteadyNanos());
+		for (int i = 0; i < NUM_PRODUCTS; ++i) {
+			nextPublish[i] = 0;
+		}
 	};
 	~GUIService() = default;
 
@@ -42,7 +53,7 @@ public:
 	Price<T>& GetData(string _key) override { return guis[_key]; };
 
 	// The callback that a Connector should invoke for any new or updated data
-	void OnMessage(Price<T>& _data) override {};
+	void OnMessage(Price<T>& _data) override { PublishThrottledPrice(_data); };
 
 	// Add a listener to the Service for callbacks on add, remove, and update events for data to the Service
 	void AddListener(ServiceListener<Price<T>>* _listener) override { listeners.push_back(_listener); };
@@ -59,26 +70,64 @@ public:
 	// Get the throttle
 	int GetThrottle() const { return throttle; };
 
+	// Set the throttle in milliseconds
+	void SetThrottle(int _throttle) { throttle = _throttle; };
+
 	// Publish the throttled price
 	void PublishThrottledPrice(Price<T>& _price)
 	{
-		// publish price to GUI if time is larger than throttle
-		auto now = std::chrono::system_clock::now();
-		auto diff = std::chrono::duration_cast<std::chrono::milliseconds>(now - cur_time);
-		if (diff.count() > throttle) {
-			cur_time = now;
-			connector -> Publish(_price);
+		long long now = getSteadyNanos();
+		Poll(now);
+
+		// conflate: always keep the latest price of the product
+		int index = getProductIndex(_price.GetProduct().GetProductId());
+		latest[index] = _price;
+
+		// publish now if the product's interval has expired, otherwise flush when it does
+		if (timers.IsScheduled(index)) return;
+		if (now >= nextPublish[index]) {
+			Flush(index, now);
+		} else {
+			timers.Schedule(index, nextPublish[index]);
+		}
+	};
+
+	// Flush the conflated prices whose throttle interval has expired
+	void Poll() { Poll(getSteadyNanos()); };
+	void Poll(long long _now)
+	{
+		timers.Advance(_now, [&](int _index) { Flush(_index, _now); });
+	};
+
+	// Flush every pending conflated price immediately (e.g. on shutdown)
+	void FlushPending()
+	{
+		long long now = getSteadyNanos();
+		for (int i = 0; i < NUM_PRODUCTS; ++i) {
+			if (timers.IsScheduled(i)) {
+				timers.Cancel(i);
+				Flush(i, now);
+			}
 		}
 	};
 
 private:
+	// publish the latest price of a product and restart its throttle interval
+	void Flush(int _index, long long _now)
+	{
+		nextPublish[_index] = _now + (long long) throttle * 1000000;
+		guis.insert_or_assign(latest[_index] -> GetProduct().GetProductId(), *latest[_index]);
+		connector -> Publish(*latest[_index]);
+	};
 
 	map<string, Price<T>> guis;
 	vector<ServiceListener<Price<T>>*> listeners;
 	GUIConnector<T>* connector;
 	GUIServiceListener<T>* guilistener;
 	int throttle;
-	std::chrono::system_clock::time_point cur_time;
+	TimerWheel timers;
+	optional<Price<T>> latest[NUM_PRODUCTS];
+	long long nextPublish[NUM_PRODUCTS];
 
 };
 
@@ -93,22 +142,51 @@ class GUIConnector : public Connector<Price<T>>
 
 public:
 	// ctor and dtor
-	GUIConnector(GUIService<T>* _service) : service(_service) {};
+	GUIConnector(GUIService<T>* _service) : service(_service), mode(GUI_FILE) {};
 	~GUIConnector() = default;
 
 	// Publish data to the Connector
 	void Publish(Price<T>& _data) override 
 	{
-		ofstream file;
-		file.open("../data/gui.txt", ios::app);
-		file << getTimeStamp() << "," << _data << endl;
-		file.close();
+		if (mode != GUI_SHARED_MEMORY) {
+			ofstream file;
+			file.open("../data/gui.txt", ios::app);
+			file << getTimeStamp() << "," << _data << endl;
+			file.close();
+		}
+		if (mode != GUI_FILE) {
+			// overwrite the product's slot in shared memory, no syscall
+			const string& productId = _data.GetProduct().GetProductId();
+			int index = getProductIndex(productId);
+			GUIPriceSlot slot{};
+			strncpy(slot.productId, productId.c_str(), sizeof(slot.productId) - 1);
+			slot.mid = _data.GetMid();
+			slot.bidOfferSpread = _data.GetBidOfferSpread();
+			slot.timestampNanos = chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+			slot.updates = ++updates[index];
+			segment.Write(index, slot);
+		}
 	};
 
 	void Subscribe(ifstream &data) override {};
 
+	// Set the output mode, creating the shared-memory segment if needed, or removing it when going back to file only
+	bool SetOutputMode(GUIOutputMode _mode, const string& _segmentName = GUI_SNAPSHOT_NAME)
+	{
+		if (_mode != GUI_FILE && !segment.IsOpen() && !segment.Create(_segmentName, NUM_PRODUCTS)) {
+			logger(LogType::ERROR, "Failed to create GUI shared-memory segment " + _segmentName);
+			return false;
+		}
+		if (_mode == GUI_FILE) segment.Close();
+		mode = _mode;
+		return true;
+	};
+
 private:
 	GUIService<T>* service;
+	GUIOutputMode mode;
+	GUISnapshotSegment segment;
+	uint64_t updates[NUM_PRODUCTS] = {};
 
 };
 
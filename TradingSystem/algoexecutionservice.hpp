@@ -8,14 +8,28 @@
 #define ALGOEXECUTION_SERVICE_HPP
 
 #include <string>
+#include <optional>
+#include <unordered_map>
 #include "soa.hpp"  
 #include "marketdataservice.hpp"
+#include "slicingengine.hpp"
+#include "idgenerator.hpp"
 #include "functions.hpp"
 
 enum OrderType { FOK, IOC, MARKET, LIMIT, STOP };
 
 enum Market { BROKERTEC, ESPEED, CME };
 
+/**
+ * Order the algo decided to send on a book update.
+ */
+struct AlgoDecision
+{
+  PricingSide side;
+  double price;
+  long quantity;
+};
+
 /**
  * An execution order that can be placed on an exchange.
  * Type T is the product type.
@@ -28,7 +42,7 @@ public:
 
   // ctor for an order
   ExecutionOrder() = default;
-  ExecutionOrder(const T &_product, PricingSide _side, string _orderId, OrderType _orderType, double _price, double _visibleQuantity, double _hiddenQuantity, string _parentOrderId, bool _isChildOrder) :
+  ExecutionOrder(const T &_product, PricingSide _side, const FixedId& _orderId, OrderType _orderType, double _price, long _visibleQuantity, long _hiddenQuantity, const FixedId& _parentOrderId, bool _isChildOrder) :
     product(_product), side(_side), orderId(_orderId), orderType(_orderType), price(_price), 
     visibleQuantity(_visibleQuantity), hiddenQuantity(_hiddenQuantity), parentOrderId(_parentOrderId), isChildOrder(_isChildOrder) {};
 
@@ -39,7 +53,7 @@ public:
   PricingSide GetSide() const { return side; };
 
   // Get the order ID
-  const string& GetOrderId() const { return orderId; };
+  const FixedId& GetOrderId() const { return orderId; };
 
   // Get the order type on this order
   OrderType GetOrderType() const { return orderType; };
@@ -54,7 +68,7 @@ public:
   long GetHiddenQuantity() const { return hiddenQuantity; };
 
   // Get the parent order ID
-  const string& GetParentOrderId() const { return parentOrderId; };
+  const FixedId& GetParentOrderId() const { return parentOrderId; };
 
   // Is child order?
   bool IsChildOrder() const { return isChildOrder; };
@@ -64,7 +78,7 @@ public:
   friend ostream& operator<<(ostream& os, const ExecutionOrder<U>& order) {
     T product = order.GetProduct();
     string _product = product.GetProductId();
-    string _orderId = order.GetOrderId();
+    string _orderId = order.GetOrderId().ToString();
     string _side = (order.GetSide() == BID ? "Bid" : "Ask");
     string _orderType;
 
@@ -84,7 +98,7 @@ public:
     string _price = convertPrice(order.GetPrice());
     string _visibleQuantity = to_string(order.GetVisibleQuantity());
     string _hiddenQuantity = to_string(order.GetHiddenQuantity());
-    string _parentOrderId = order.GetParentOrderId();
+    string _parentOrderId = order.GetParentOrderId().ToString();
     string _isChildOrder = (order.IsChildOrder() ? "True" : "False");
 
     vector<string> components = {_product, _orderId, _side, _orderType, _price, _visibleQuantity, _hiddenQuantity, _parentOrderId, _isChildOrder};
@@ -96,12 +110,12 @@ public:
 private:
   T product;
   PricingSide side;
-  string orderId;
+  FixedId orderId;
   OrderType orderType;
   double price;
   long visibleQuantity;
   long hiddenQuantity;
-  string parentOrderId;
+  FixedId parentOrderId;
   bool isChildOrder;
 
 };
@@ -154,6 +168,11 @@ public:
     {
       algoexecservicelistener = new AlgoExecutionServiceListener<T>(this);
       count = 0;
+      slicing = false;
+      parentOrderIds.resize(slicer.GetCapacity());
+      slicer.SetChildHandler([this](int _childIndex, const ChildSlice& _child, const ParentOrder& _parent) {
+        ReleaseChildOrder(_childIndex, _child, _parent);
+      });
     };
     ~AlgoExecutionService() = default;
     
@@ -172,46 +191,92 @@ public:
     // Get the special listener for algo execution service
     AlgoExecutionServiceListener<T>* GetAlgoExecutionServiceListener() { return algoexecservicelistener; };
 
+    // Submit a parent order to the slicing engine, child orders are released on its schedule
+    // TWAP/VWAP: _slices slices over _durationMs; ICEBERG: _displayQuantity per clip on each top-of-book change
+    ParentHandle SubmitParentOrder(const T& _product, PricingSide _side, long _quantity, SliceStrategy _strategy, long _durationMs, int _slices, long _displayQuantity = 0, double _limitPrice = 0.0)
+    {
+      int index = getProductIndex(_product.GetProductId());
+      products[index] = _product;
+      ParentHandle handle = slicer.Submit(index, _side, _quantity, _strategy, _durationMs * 1000000LL, _slices, _displayQuantity, _limitPrice, getSteadyNanos());
+      if (handle.IsValid()) parentOrderIds[handle.index] = IdGenerator::Next("AP");
+      return handle;
+    };
+
+    // Cancel a parent order, the reports of its children still out are ignored
+    bool CancelParentOrder(ParentHandle _handle) { return slicer.Cancel(_handle); };
+
+    // Release child slices whose timers are due
+    void PollSlicing()
+    {
+      slicing = true;
+      slicer.Poll(getSteadyNanos());
+      slicing = false;
+      ApplyChildReports();
+    };
+
+    // The callback that Execution Service invokes when an order fills or is cancelled, or never goes out
+    // _orderId is a child slice, or an order routed from one with _parentOrderId the slice
+    void OnChildReport(const FixedId& _orderId, const FixedId& _parentOrderId, long _filledQuantity, long _cancelledQuantity)
+    {
+      if (childOrders.empty()) return;
+      childReports.push_back(ChildReport{_orderId, _parentOrderId, _filledQuantity, _cancelledQuantity});
+      // a report heard while the slicing engine releases a slice waits until it is done
+      if (!slicing) ApplyChildReports();
+    };
+
+    // Get the slicing engine
+    const SlicingEngine& GetSlicingEngine() const { return slicer; };
+
+    // Decide on the top of book of a product, true with the order to send if the market is tight
+    // Also lets the slicing engine release due slices of parents on this product
+    bool Decide(int _index, double _bidPrice, long _bidQuantity, double _offerPrice, long _offerQuantity, AlgoDecision& _decision)
+    {
+      long long now = getSteadyNanos();
+      slicing = true;
+      slicer.Poll(now);
+      slicer.OnMarketData(_index, _bidPrice, _bidQuantity, _offerPrice, _offerQuantity, now);
+      slicing = false;
+      ApplyChildReports();
+
+      // alternate sides, only cross a tight market
+      bool tight = _offerPrice - _bidPrice <= 1.0 / 128.0;
+      if (tight) {
+          _decision.side = (count % 2 == 0) ? BID : OFFER;
+          _decision.price = (_decision.side == BID) ? _offerPrice : _bidPrice;
+          _decision.quantity = (_decision.side == BID) ? _bidQuantity : _offerQuantity;
+      }
+      count++;
+      return tight;
+    };
+
     // Execute an algo order on a market, called by AlgoExecutionServiceListener to subscribe data from Algo Market Data Service to Algo Execution Service
     void AlgoExecuteOrder(OrderBook<T>& _orderBook) {
       // Initialize order data
       T product = _orderBook.GetProduct();
       string key = product.GetProductId();
-      string orderId = "A" + GenerateRandomId(11);
-      string parentOrderId = "AP" + GenerateRandomId(10);
 
       // Retrieve best bid and offer
       BidOffer bidOffer = _orderBook.GetBestBidOffer();
       Order bid = bidOffer.GetBidOrder();
       Order offer = bidOffer.GetOfferOrder();
-      double bidPrice = bid.GetPrice();
-      double offerPrice = offer.GetPrice();
-      long bidQuantity = bid.GetQuantity();
-      long offerQuantity = offer.GetQuantity();
-
-      // Determine trading side and quantities based on price spread
-      PricingSide side;
-      double price;
-      long quantity;
-      if (offerPrice - bidPrice <= 1.0 / 128.0) {
-          side = (count % 2 == 0) ? BID : OFFER;
-          price = (side == BID) ? offerPrice : bidPrice;
-          quantity = (side == BID) ? bidQuantity : offerQuantity;
-      }
-      count++;
+
+      int index = getProductIndex(key);
+      products[index] = product;
+      AlgoDecision decision;
+      if (!Decide(index, bid.GetPrice(), bid.GetQuantity(), offer.GetPrice(), offer.GetQuantity(), decision)) return;
+
+      FixedId orderId = IdGenerator::Next("A");
+      FixedId parentOrderId = IdGenerator::Next("AP");
 
       // Construct execution order
-      long visibleQuantity = quantity;
+      long visibleQuantity = decision.quantity;
       long hiddenQuantity = 0;
       bool isChildOrder = false;
-      ExecutionOrder<T> executionOrder(product, side, orderId, MARKET, price, visibleQuantity, hiddenQuantity, parentOrderId, isChildOrder);
+      ExecutionOrder<T> executionOrder(product, decision.side, orderId, MARKET, decision.price, visibleQuantity, hiddenQuantity, parentOrderId, isChildOrder);
       AlgoExecution<T> algoExecution(executionOrder, BROKERTEC);
 
       // Update algo execution map
-      if (algoExecutions.find(key) != algoExecutions.end()) {
-          algoExecutions.erase(key);
-      }
-      algoExecutions.insert({key, algoExecution});
+      RecordExecution(algoExecution);
 
       // Notify listeners
       for (auto& listener : listeners) {
@@ -219,12 +284,74 @@ public:
       }
     };
 
+    // Keep an algo execution as the latest of its product, without notifying listeners
+    void RecordExecution(const AlgoExecution<T>& _algoExecution)
+    {
+      algoExecutions.insert_or_assign(_algoExecution.GetExecutionOrder().GetProduct().GetProductId(), _algoExecution);
+    };
+
 private:
+    // child slice an order ID belongs to
+    struct ChildRef
+    {
+      ParentHandle parent;
+      int childIndex;
+    };
+
+    // fill or cancel of a child order waiting to reach the slicing engine
+    struct ChildReport
+    {
+      FixedId orderId;
+      FixedId parentOrderId;
+      long filledQuantity;
+      long cancelledQuantity;
+    };
+
+    // hand the reports of child orders to the slicing engine, forgetting children that are done
+    void ApplyChildReports()
+    {
+      slicing = true;
+      for (size_t r = 0; r < childReports.size(); ++r) {
+        ChildReport report = childReports[r];
+        auto found = childOrders.find(report.orderId);
+        if (found == childOrders.end()) found = childOrders.find(report.parentOrderId);
+        if (found == childOrders.end()) continue;
+        const ChildRef& child = found -> second;
+        bool done = false;
+        if (report.filledQuantity > 0) done = slicer.OnChildFill(child.parent, child.childIndex, report.filledQuantity);
+        if (report.cancelledQuantity > 0) done = slicer.OnChildCancel(child.parent, child.childIndex, report.cancelledQuantity);
+        if (done) childOrders.erase(found);
+      }
+      childReports.clear();
+      slicing = false;
+    };
+
+    // build a child execution order from a released slice and flow it to listeners
+    void ReleaseChildOrder(int _childIndex, const ChildSlice& _child, const ParentOrder& _parent)
+    {
+      const T& product = *products[_child.productIndex];
+      const FixedId& parentOrderId = parentOrderIds[_child.parentIndex];
+      FixedId orderId = IdGenerator::Next("A");
+      childOrders[orderId] = ChildRef{ParentHandle{_child.parentIndex, _parent.generation}, _childIndex};
+      ExecutionOrder<T> executionOrder(product, _child.side, orderId, MARKET, _child.price, _child.quantity, 0, parentOrderId, true);
+      AlgoExecution<T> algoExecution(executionOrder, BROKERTEC);
+      algoExecutions.insert_or_assign(product.GetProductId(), algoExecution);
+      for (auto& listener : listeners) {
+          listener->ProcessAdd(algoExecution);
+      }
+    };
+
     map<string, AlgoExecution<T>> algoExecutions;
     vector<ServiceListener<AlgoExecution<T>>*> listeners;
     AlgoExecutionServiceListener<T>* algoexecservicelistener;
     double spread;
     long count;
+    SlicingEngine slicer;
+    bool slicing; // inside the slicing engine, which must not hear reports
+    optional<T> products[NUM_PRODUCTS];
+    vector<FixedId> parentOrderIds;
+    unordered_map<FixedId, ChildRef> childOrders; // child orders still out
+    vector<ChildReport> childReports;
     
 };
 
@@ -11,6 +11,7 @@
 #include "soa.hpp"
 #include "pricingservice.hpp"
 #include "marketdataservice.hpp"
+#include "inventoryskew.hpp"
 #include "functions.hpp"
 
 /**
@@ -71,8 +72,8 @@ public:
 
   // ctor
   PriceStream() = default; // needed for map data structure later
-  PriceStream(const T &_product, const PriceStreamOrder &_bidOrder, const PriceStreamOrder &_offerOrder) :
-    product(_product), bidOrder(_bidOrder), offerOrder(_offerOrder) {};
+  PriceStream(const T &_product, const PriceStreamOrder &_bidOrder, const PriceStreamOrder &_offerOrder, int _productIndex = -1) :
+    product(_product), bidOrder(_bidOrder), offerOrder(_offerOrder), productIndex(_productIndex) {};
 
   // Get the product
   const T& GetProduct() const { return product; };
@@ -83,6 +84,9 @@ public:
   // Get the offer order
   const PriceStreamOrder& GetOfferOrder() const { return offerOrder; };
 
+  // Get the dense product index, carried from the price the stream was made from
+  int GetProductIndex() const { return productIndex >= 0 ? productIndex : getProductIndex(product.GetProductId()); };
+
   // object printer
   template<typename U>
   friend ostream& operator<<(ostream& os, const PriceStream<U>& priceStream) {
@@ -98,6 +102,7 @@ private:
   T product;
   PriceStreamOrder bidOrder;
   PriceStreamOrder offerOrder;
+  int productIndex = -1;
 
 };
 
@@ -142,6 +147,8 @@ public:
     // ctor and dtor
     AlgoStreamingService() {
       algostreamlistener = new AlgoStreamingServiceListener<T>(this);
+      inventory = nullptr;
+      count = 0;
     };
     ~AlgoStreamingService() = default;
     
@@ -160,6 +167,9 @@ public:
     // Get the special listener for algo streaming service
     AlgoStreamingServiceListener<T>* GetAlgoStreamingListener() { return algostreamlistener; };
 
+    // Skew quotes by inventory using the precomputed snapshot of _inventory (nullptr turns skewing off)
+    void SetInventorySkew(const InventoryBook* _inventory) { inventory = _inventory; };
+
     // Publish algo streams (called by algo streaming service listener to subscribe data from pricing service)
     void PublishAlgoStream(const Price<T>& price) {
       // Retrieve necessary data from price and initialize order parameters
@@ -173,12 +183,25 @@ public:
       // Set quantities based on count
       long visibleQuantity = (count % 2 == 0) ? 1000000 : 2000000;
       long hiddenQuantity = visibleQuantity * 2;
+      long bidVisibleQuantity = visibleQuantity, offerVisibleQuantity = visibleQuantity;
+      long bidHiddenQuantity = hiddenQuantity, offerHiddenQuantity = hiddenQuantity;
       count++;
 
+      // Shift the two-way price and sizes by the product's precomputed inventory skew
+      if (inventory) {
+        QuoteSkew skew = inventory -> GetSkew(price.GetProductIndex());
+        bidPrice += skew.priceShift;
+        offerPrice += skew.priceShift;
+        bidVisibleQuantity = (long) (visibleQuantity * skew.bidSizeScale);
+        offerVisibleQuantity = (long) (visibleQuantity * skew.offerSizeScale);
+        bidHiddenQuantity = bidVisibleQuantity * 2;
+        offerHiddenQuantity = offerVisibleQuantity * 2;
+      }
+
       // Create orders and stream objects
-      PriceStreamOrder bidOrder(bidPrice, visibleQuantity, hiddenQuantity, BID);
-      PriceStreamOrder offerOrder(offerPrice, visibleQuantity, hiddenQuantity, OFFER);
-      PriceStream<T> priceStream(product, bidOrder, offerOrder);
+      PriceStreamOrder bidOrder(bidPrice, bidVisibleQuantity, bidHiddenQuantity, BID);
+      PriceStreamOrder offerOrder(offerPrice, offerVisibleQuantity, offerHiddenQuantity, OFFER);
+      PriceStream<T> priceStream(product, bidOrder, offerOrder, price.GetProductIndex());
       AlgoStream<T> algoStream(priceStream);
 
       // Update and notify
@@ -195,6 +218,7 @@ private:
     map<string, AlgoStream<T>> algoStreams;
     vector<ServiceListener<AlgoStream<T>>*> listeners;
     AlgoStreamingServiceListener<T>* algostreamlistener;
+    const InventoryBook* inventory;
     long count;
 
 };
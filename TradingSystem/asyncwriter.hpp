@@ -0,0 +1,231 @@
+/**
+ * asyncwriter.hpp
+ * Asynchronous batched writer of fixed-size records to a file, pipe, local socket or stdout.
+ *
+ * @author Yicheng Sun
+ */
+
+#ifndef ASYNC_WRITER_HPP
+#define ASYNC_WRITER_HPP
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "spscring.hpp"
+#include "functions.hpp"
+
+using namespace std;
+
+// Destination of an async writer
+enum WriterTarget { STDOUT_TARGET, FILE_TARGET, PIPE_TARGET, SOCKET_TARGET };
+
+/**
+ * Async writer: the producer thread copies records into a preallocated SPSC ring,
+ * a writer thread drains the ring in batches, formats the records into a batch
+ * buffer and hands each batch to the target with a single write().
+ * The formatter runs on the writer thread, so the producer only pays for the enqueue.
+ * Type R is the record type, it must be trivially copyable.
+ */
+template<typename R>
+class AsyncRecordWriter
+{
+
+public:
+  // formats a record into buffer (at least maxRecordBytes free), returns the number of bytes written
+  typedef size_t (*Formatter)(const R& record, char* buffer);
+
+  // ctor and dtor
+  AsyncRecordWriter(Formatter _formatter, size_t _capacity = 1 << 16, size_t _batchBytes = 1 << 16, size_t _maxRecordBytes = 512) :
+    ring(_capacity), formatter(_formatter), batchBytes(_batchBytes), maxRecordBytes(_maxRecordBytes)
+  {
+    fd = -1;
+    ownsFd = false;
+    running = false;
+    stopping = false;
+    writtenCount = 0;
+    stallCount = 0;
+    droppedCount = 0;
+    batchCount = 0;
+    errorCount = 0;
+    batch.resize(batchBytes + maxRecordBytes);
+  };
+  ~AsyncRecordWriter()
+  {
+    Stop();
+    if (ownsFd && fd >= 0) close(fd);
+  };
+
+  // Open the target, _path is the file, fifo or unix socket path (ignored for stdout)
+  bool Open(WriterTarget _target, const string& _path = "")
+  {
+    switch (_target) {
+      case STDOUT_TARGET:
+        fd = STDOUT_FILENO;
+        ownsFd = false;
+        return true;
+      case FILE_TARGET:
+        fd = open(_path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        break;
+      case PIPE_TARGET:
+        // fails with ENXIO instead of blocking when no reader has the fifo open
+        if (mkfifo(_path.c_str(), 0644) != 0 && errno != EEXIST) {
+          fd = -1;
+          break;
+        }
+        signal(SIGPIPE, SIG_IGN);
+        fd = open(_path.c_str(), O_WRONLY | O_NONBLOCK);
+        if (fd < 0 && errno == ENXIO) {
+          logger(LogType::ERROR, "AsyncRecordWriter found no reader on fifo " + _path);
+          return false;
+        }
+        // back to blocking writes, the writer thread absorbs a slow reader
+        if (fd >= 0) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        break;
+      case SOCKET_TARGET:
+      {
+        signal(SIGPIPE, SIG_IGN);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, _path.c_str(), sizeof(addr.sun_path) - 1);
+        if (fd >= 0 && connect(fd, (sockaddr*) &addr, sizeof(addr)) != 0) {
+          close(fd);
+          fd = -1;
+        }
+        break;
+      }
+    }
+    if (fd < 0) {
+      logger(LogType::ERROR, "AsyncRecordWriter failed to open " + _path + ": " + strerror(errno));
+      return false;
+    }
+    ownsFd = true;
+    return true;
+  };
+
+  // Start the writer thread
+  void Start()
+  {
+    if (running) return;
+    stopping = false;
+    running = true;
+    writer = thread(&AsyncRecordWriter<R>::Run, this);
+  };
+
+  // Drain everything enqueued so far and stop the writer thread
+  void Stop()
+  {
+    if (!running) return;
+    stopping.store(true, memory_order_release);
+    writer.join();
+    running = false;
+  };
+
+  // Enqueue a record from the producer thread, spins only if the ring is full
+  // Returns false and drops the record once stopped, or if the ring is full and no writer thread drains it
+  bool Enqueue(const R& _record)
+  {
+    if (stopping.load(memory_order_relaxed)) {
+      droppedCount++;
+      return false;
+    }
+    while (!ring.TryPush(_record)) {
+      if (!running) {
+        droppedCount++;
+        return false;
+      }
+      stallCount++;
+      this_thread::yield();
+    }
+    return true;
+  };
+
+  // Get writer statistics
+  long GetWrittenCount() const { return writtenCount.load(memory_order_relaxed); };
+  long GetStallCount() const { return stallCount; };
+  long GetDroppedCount() const { return droppedCount; };
+  long GetBatchCount() const { return batchCount.load(memory_order_relaxed); };
+  long GetErrorCount() const { return errorCount.load(memory_order_relaxed); };
+
+private:
+  // writer thread loop
+  void Run()
+  {
+    size_t used = 0;
+    int idle = 0;
+    while (true) {
+      size_t n = ring.ConsumeBatch([&](const R& _record) {
+        used += formatter(_record, batch.data() + used);
+        if (used >= batchBytes) {
+          Flush(used);
+          used = 0;
+        }
+      }, ring.GetCapacity());
+
+      if (n > 0) {
+        writtenCount.fetch_add(n, memory_order_relaxed);
+        idle = 0;
+        continue;
+      }
+
+      // ring is empty: write out the partial batch, then back off
+      if (used > 0) {
+        Flush(used);
+        used = 0;
+      }
+      if (stopping.load(memory_order_acquire) && ring.Empty()) break;
+      if (++idle < 64) {
+        this_thread::yield();
+      } else {
+        this_thread::sleep_for(chrono::microseconds(50));
+      }
+    }
+  };
+
+  // write the batch buffer to the target
+  void Flush(size_t _bytes)
+  {
+    batchCount.fetch_add(1, memory_order_relaxed);
+    const char* p = batch.data();
+    while (_bytes > 0) {
+      ssize_t n = write(fd, p, _bytes);
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        errorCount.fetch_add(1, memory_order_relaxed);
+        return;
+      }
+      p += n;
+      _bytes -= n;
+    }
+  };
+
+  SpscRing<R> ring;
+  Formatter formatter;
+  size_t batchBytes;
+  size_t maxRecordBytes;
+  vector<char> batch;
+  int fd;
+  bool ownsFd;
+  thread writer;
+  bool running;
+  atomic<bool> stopping;
+  atomic<long> writtenCount;
+  long stallCount;
+  long droppedCount;
+  atomic<long> batchCount;
+  atomic<long> errorCount;
+
+};
+
+#endif
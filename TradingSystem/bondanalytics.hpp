@@ -0,0 +1,277 @@
+/**
+ * bondanalytics.hpp
+ * Yield, PV01 and duration of the treasuries from their coupon, maturity and price.
+ *
+ * @author Yicheng Sun
+ */
+
+#ifndef BOND_ANALYTICS_HPP
+#define BOND_ANALYTICS_HPP
+
+#include <cmath>
+#include <vector>
+#include <cstdint>
+#include <stdexcept>
+#include <algorithm>
+#include "products.hpp"
+#include "latencyhistogram.hpp"
+#include "functions.hpp"
+
+using namespace std;
+
+// the products are the treasuries issued on 2023/12/30, valued for settlement on the first business day after
+const date VALUATION_DATE(2024, Jan, 2);
+
+// products solved side by side, padded so the lanes fill whole vector registers
+const int ANALYTICS_LANES = 8;
+
+static_assert(NUM_PRODUCTS <= ANALYTICS_LANES, "analytics lanes must hold every product");
+
+/**
+ * Analytics of the products as semi-annual treasuries, ACT/ACT within a coupon period.
+ * The cashflow schedule of every product is built once for the valuation date and kept
+ * cashflow by cashflow across the products, zero padded to the longest, so one Newton
+ * iteration prices all products at once with loops over the lanes the compiler vectorizes:
+ * the dirty price and its derivative in the yield come from Horner's rule on the discount
+ * factor of one period. A price equal to the last one solved for is skipped, and a new one
+ * starts from the last yield, which converges in two or three iterations at tick rates.
+ * PV01 is the change of the dirty price of 100 face for a 1bp fall of the yield.
+ * Until a product gets a price it is valued at par. A price that is not positive, that the
+ * yield does not converge for or that solves to a yield that is not finite is counted and
+ * logged, and the product keeps its last price, yield and PV01.
+ */
+class BondAnalytics
+{
+
+public:
+  // ctor
+  BondAnalytics(const date& _valuationDate = VALUATION_DATE) : solveCount(0), skippedCount(0), failedCount(0) { SetValuationDate(_valuationDate); };
+
+  // Value the products for settlement on _valuationDate, rebuilding the schedules and solving at the last prices
+  void SetValuationDate(const date& _valuationDate)
+  {
+    valuationDate = _valuationDate;
+    BuildSchedules();
+    for (int lane = 0; lane < ANALYTICS_LANES; ++lane) {
+      if (lane >= NUM_PRODUCTS || !priced[lane]) prices[lane] = 100.0;
+      yields[lane] = lane < NUM_PRODUCTS ? coupons[lane] : 0.0;
+    }
+    Solve((1u << NUM_PRODUCTS) - 1);
+  };
+
+  // Update the clean price of a product, returns false if it did not move or failed to solve
+  bool UpdatePrice(int _productIndex, double _price)
+  {
+    if (priced[_productIndex] && prices[_productIndex] == _price) {
+      skippedCount++;
+      return false;
+    }
+    double lastPrice = prices[_productIndex];
+    bool lastPriced = priced[_productIndex];
+    prices[_productIndex] = _price;
+    priced[_productIndex] = true;
+    if (Solve(1u << _productIndex)) {
+      prices[_productIndex] = lastPrice;
+      priced[_productIndex] = lastPriced;
+      return false;
+    }
+    return true;
+  };
+
+  // Update the clean prices of every product at once, returns the bitmask of products that moved and solved
+  uint32_t UpdatePrices(const double* _prices)
+  {
+    uint32_t moved = 0;
+    double lastPrices[NUM_PRODUCTS];
+    bool lastPriced[NUM_PRODUCTS];
+    for (int i = 0; i < NUM_PRODUCTS; ++i) {
+      if (priced[i] && prices[i] == _prices[i]) continue;
+      lastPrices[i] = prices[i];
+      lastPriced[i] = priced[i];
+      prices[i] = _prices[i];
+      priced[i] = true;
+      moved |= 1u << i;
+    }
+    if (!moved) return 0;
+    uint32_t failed = Solve(moved);
+    for (uint32_t remaining = failed; remaining; remaining &= remaining - 1) {
+      int i = __builtin_ctz(remaining);
+      prices[i] = lastPrices[i];
+      priced[i] = lastPriced[i];
+    }
+    return moved & ~failed;
+  };
+
+  // Get the yield to maturity of a product, semi-annual compounding
+  double GetYield(int _productIndex) const { return yields[_productIndex]; };
+
+  // Get the PV01 of a product, per 100 face
+  double GetPV01(int _productIndex) const { return pv01s[_productIndex]; };
+
+  // Get the modified duration of a product, in years
+  double GetModifiedDuration(int _productIndex) const { return pv01s[_productIndex] * 10000.0 / dirtyPrices[_productIndex]; };
+
+  // Get the Macaulay duration of a product, in years
+  double GetMacaulayDuration(int _productIndex) const { return GetModifiedDuration(_productIndex) * (1.0 + yields[_productIndex] / 2.0); };
+
+  // Get the clean price a product was last solved at
+  double GetPrice(int _productIndex) const { return prices[_productIndex]; };
+
+  // Get the dirty price of a product, per 100 face
+  double GetDirtyPrice(int _productIndex) const { return dirtyPrices[_productIndex]; };
+
+  // Get the accrued interest of a product, per 100 face
+  double GetAccruedInterest(int _productIndex) const { return accrued[_productIndex]; };
+
+  // Get the number of coupons a product has left to pay
+  int GetCashflowCount(int _productIndex) const { return cashflowCounts[_productIndex]; };
+
+  // Get the valuation date
+  const date& GetValuationDate() const { return valuationDate; };
+
+  // Get the number of solves, of prices skipped as unchanged and of prices that failed to solve
+  long GetSolveCount() const { return solveCount; };
+  long GetSkippedCount() const { return skippedCount; };
+  long GetFailedCount() const { return failedCount; };
+
+  // Get the time taken by each solve
+  const LatencyHistogram& GetLatency() const { return latency; };
+
+private:
+  static const int MAX_ITERATIONS = 50;
+
+  // coupon dates back from maturity, cashflow amounts and the fraction of a period to the next coupon
+  void BuildSchedules()
+  {
+    vector<vector<double>> schedules(ANALYTICS_LANES);
+    size_t longest = 1;
+    for (int i = 0; i < NUM_PRODUCTS; ++i) {
+      Bond bond = getProductObject<Bond>(PRODUCT_CUSIPS[i]);
+      const date& maturity = bond.GetMaturityDate();
+      if (maturity <= valuationDate) throw invalid_argument("bond " + PRODUCT_CUSIPS[i] + " matured before the valuation date");
+      coupons[i] = bond.GetCoupon();
+
+      // stepping each date from maturity keeps the day of month, months(6) applied repeatedly would drift to month ends
+      int periods = 0;
+      while (maturity - months(6 * (periods + 1)) > valuationDate) periods++;
+      date next = maturity - months(6 * periods);
+      date previous = maturity - months(6 * (periods + 1));
+      double fraction = (double) (next - valuationDate).days() / (next - previous).days();
+
+      double coupon = 100.0 * coupons[i] / 2.0;
+      schedules[i].assign(periods + 1, coupon);
+      schedules[i].back() += 100.0;
+      firstPeriods[i] = fraction;
+      accrued[i] = coupon * (1.0 - fraction);
+      cashflowCounts[i] = periods + 1;
+      longest = max(longest, schedules[i].size());
+    }
+    for (int lane = NUM_PRODUCTS; lane < ANALYTICS_LANES; ++lane) {
+      schedules[lane].assign(1, 100.0);
+      coupons[lane] = 0.0;
+      firstPeriods[lane] = 0.0;
+      accrued[lane] = 0.0;
+      cashflowCounts[lane] = 0;
+    }
+
+    maxCashflows = (int) longest;
+    cashflows.assign(maxCashflows * ANALYTICS_LANES, 0.0);
+    for (int lane = 0; lane < ANALYTICS_LANES; ++lane) {
+      for (size_t k = 0; k < schedules[lane].size(); ++k) cashflows[k * ANALYTICS_LANES + lane] = schedules[lane][k];
+    }
+  };
+
+  // Newton on the yield of every lane until the lanes in _mask price to within 1e-10
+  // Returns the lanes that did not converge or left finite values, which keep their last yield and PV01
+  uint32_t Solve(uint32_t _mask)
+  {
+    long long start = getSteadyNanos();
+    double lastYields[ANALYTICS_LANES];
+    copy(yields, yields + ANALYTICS_LANES, lastYields);
+    double dirty[ANALYTICS_LANES], slope[ANALYTICS_LANES];
+    uint32_t failed = 0;
+    for (int lane = 0; lane < NUM_PRODUCTS; ++lane) {
+      if (((_mask >> lane) & 1) && !(prices[lane] > 0.0)) failed |= 1u << lane;
+    }
+    uint32_t remaining = _mask & ~failed;
+    for (int iteration = 0; iteration < MAX_ITERATIONS && remaining; ++iteration) {
+      Evaluate(dirty, slope);
+      for (int lane = 0; lane < NUM_PRODUCTS; ++lane) {
+        if (!((remaining >> lane) & 1)) continue;
+        double error = dirty[lane] - accrued[lane] - prices[lane];
+        if (fabs(error) < 1e-10) {
+          remaining &= ~(1u << lane);
+          continue;
+        }
+        yields[lane] -= error / slope[lane];
+        if (!isfinite(yields[lane])) {
+          failed |= 1u << lane;
+          remaining &= ~(1u << lane);
+        }
+      }
+    }
+    failed |= remaining;
+    Evaluate(dirty, slope);
+    for (int lane = 0; lane < NUM_PRODUCTS; ++lane) {
+      if (!((_mask >> lane) & 1)) continue;
+      if (!((failed >> lane) & 1) && isfinite(dirty[lane]) && isfinite(slope[lane])) {
+        dirtyPrices[lane] = dirty[lane];
+        pv01s[lane] = -slope[lane] * 0.0001;
+        continue;
+      }
+      failed |= 1u << lane;
+      yields[lane] = lastYields[lane];
+      failedCount++;
+      logger(LogType::ERROR, "Bond analytics failed to solve the yield of " + PRODUCT_CUSIPS[lane] + " at price " + to_string(prices[lane]) + ", keeping the last yield and PV01.");
+    }
+    solveCount++;
+    latency.Record(getSteadyNanos() - start);
+    return failed;
+  };
+
+  // dirty price of every lane at its yield and the derivative in the yield
+  void Evaluate(double* _dirty, double* _slope) const
+  {
+    // with v the discount factor of one period, dirty = v^f * sum_k cf_k v^k
+    double v[ANALYTICS_LANES], sum[ANALYTICS_LANES], derivative[ANALYTICS_LANES];
+    for (int lane = 0; lane < ANALYTICS_LANES; ++lane) {
+      v[lane] = 1.0 / (1.0 + yields[lane] / 2.0);
+      sum[lane] = 0.0;
+      derivative[lane] = 0.0;
+    }
+    for (int k = maxCashflows - 1; k >= 0; --k) {
+      const double* row = cashflows.data() + k * ANALYTICS_LANES;
+      for (int lane = 0; lane < ANALYTICS_LANES; ++lane) {
+        derivative[lane] = derivative[lane] * v[lane] + sum[lane];
+        sum[lane] = sum[lane] * v[lane] + row[lane];
+      }
+    }
+    for (int lane = 0; lane < ANALYTICS_LANES; ++lane) {
+      double vf = pow(v[lane], firstPeriods[lane]);
+      _dirty[lane] = vf * sum[lane];
+      // d dirty / dv, times dv / dy = -v^2 / 2
+      double dDirty = firstPeriods[lane] * vf / v[lane] * sum[lane] + vf * derivative[lane];
+      _slope[lane] = -dDirty * v[lane] * v[lane] / 2.0;
+    }
+  };
+
+  date valuationDate;
+  int maxCashflows;
+  vector<double> cashflows; // cashflow by cashflow, ANALYTICS_LANES apart
+  double coupons[ANALYTICS_LANES];
+  double firstPeriods[ANALYTICS_LANES]; // fraction of a period to the next coupon
+  double accrued[ANALYTICS_LANES];
+  int cashflowCounts[ANALYTICS_LANES];
+  double prices[ANALYTICS_LANES] = {};
+  bool priced[ANALYTICS_LANES] = {};
+  double yields[ANALYTICS_LANES];
+  double dirtyPrices[ANALYTICS_LANES] = {};
+  double pv01s[ANALYTICS_LANES] = {};
+  long solveCount;
+  long skippedCount;
+  long failedCount;
+  LatencyHistogram latency;
+
+};
+
+#endif
@@ -0,0 +1,247 @@
+/**
+ * checkpoint.hpp
+ * Versioned binary snapshot of the services' state, written in one file and restored through mmap.
+ *
+ * @author Yicheng Sun
+ */
+
+#ifndef CHECKPOINT_HPP
+#define CHECKPOINT_HPP
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+#include <type_traits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "functions.hpp"
+
+using namespace std;
+
+const uint32_t CHECKPOINT_MAGIC = 0x54504B43; // "CKPT"
+const uint32_t CHECKPOINT_VERSION = 1;
+
+// Sections of a checkpoint, one or more per service
+enum CheckpointSection : uint32_t
+{
+  CHECKPOINT_PRICES = 1,
+  CHECKPOINT_ORDER_BOOKS,
+  CHECKPOINT_POSITIONS,
+  CHECKPOINT_BOOK_NAMES,
+  CHECKPOINT_RISK,
+  CHECKPOINT_ORDERS,
+  CHECKPOINT_TRADES,
+  CHECKPOINT_TRADE_JOURNAL,
+  CHECKPOINT_INQUIRIES
+};
+
+/**
+ * File header of a checkpoint, followed by the section table and the sections.
+ */
+struct CheckpointHeader
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t stage; // set by the caller, e.g. the number of data flows completed
+  uint32_t sectionCount;
+  uint64_t fileBytes;
+  int64_t timestampNanos; // system clock, when written
+};
+
+/**
+ * Entry of the section table: an array of count records of recordBytes each, at offset.
+ */
+struct CheckpointSectionEntry
+{
+  uint32_t id;
+  uint32_t recordBytes;
+  uint64_t offset;
+  uint64_t count;
+};
+
+static_assert(sizeof(CheckpointHeader) == 32 && sizeof(CheckpointSectionEntry) == 24, "checkpoint header layout changed");
+
+
+/**
+ * Writer of a checkpoint. Services add their state as arrays of trivially copyable records,
+ * which are copied when added; Write lays them out 64-byte aligned behind the header and
+ * the section table, writes a temporary file and renames it over the old checkpoint, so a
+ * crash while writing leaves the previous checkpoint in place.
+ */
+class CheckpointWriter
+{
+
+public:
+  // ctor
+  CheckpointWriter(uint32_t _stage = 0) : stage(_stage) {};
+
+  // Add a section of _count records
+  template<typename R>
+  void AddSection(uint32_t _id, const R* _records, size_t _count)
+  {
+    static_assert(is_trivially_copyable<R>::value, "checkpoint records must be trivially copyable");
+    entries.push_back(CheckpointSectionEntry{_id, (uint32_t) sizeof(R), 0, _count});
+    data.emplace_back((const char*) _records, (const char*) (_records + _count));
+  };
+
+  // Write the checkpoint to _path, replacing any previous one
+  bool Write(const string& _path)
+  {
+    // lay out the sections
+    uint64_t offset = Align(sizeof(CheckpointHeader) + entries.size() * sizeof(CheckpointSectionEntry));
+    for (auto& entry : entries) {
+      entry.offset = offset;
+      offset = Align(offset + entry.count * entry.recordBytes);
+    }
+    CheckpointHeader header{CHECKPOINT_MAGIC, CHECKPOINT_VERSION, stage, (uint32_t) entries.size(), offset,
+      chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count()};
+
+    vector<char> file(offset, 0);
+    memcpy(file.data(), &header, sizeof(header));
+    if (!entries.empty()) memcpy(file.data() + sizeof(header), entries.data(), entries.size() * sizeof(CheckpointSectionEntry));
+    for (size_t s = 0; s < entries.size(); ++s) {
+      if (!data[s].empty()) memcpy(file.data() + entries[s].offset, data[s].data(), data[s].size());
+    }
+
+    string temporary = _path + ".tmp";
+    int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      logger(LogType::ERROR, "Checkpoint failed to open " + temporary + ": " + strerror(errno));
+      return false;
+    }
+    size_t written = 0;
+    while (written < file.size()) {
+      ssize_t n = write(fd, file.data() + written, file.size() - written);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) break;
+      written += n;
+    }
+    bool ok = written == file.size() && fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(temporary.c_str(), _path.c_str()) != 0) {
+      logger(LogType::ERROR, "Checkpoint failed to write " + _path + ": " + strerror(errno));
+      unlink(temporary.c_str());
+      return false;
+    }
+    return true;
+  };
+
+  // Get the number of bytes the sections hold
+  size_t GetBytes() const
+  {
+    size_t bytes = 0;
+    for (auto& section : data) bytes += section.size();
+    return bytes;
+  };
+
+private:
+  static uint64_t Align(uint64_t _offset) { return (_offset + 63) & ~(uint64_t) 63; };
+
+  uint32_t stage;
+  vector<CheckpointSectionEntry> entries;
+  vector<vector<char>> data;
+
+};
+
+
+/**
+ * Reader of a checkpoint. Open maps the file read-only and checks the header and section
+ * table; sections are then read in place as arrays of records, without parsing or copying.
+ * Records stay valid until Close.
+ */
+class CheckpointReader
+{
+
+public:
+  // ctor and dtor
+  CheckpointReader() : base(nullptr), bytes(0) {};
+  ~CheckpointReader() { Close(); };
+
+  // Map the checkpoint at _path, false if there is none or it is not a valid checkpoint
+  bool Open(const string& _path)
+  {
+    Close();
+    int fd = open(_path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat info;
+    fstat(fd, &info);
+    bytes = (size_t) info.st_size;
+    void* mapped = bytes >= sizeof(CheckpointHeader) ? mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (mapped == MAP_FAILED) {
+      logger(LogType::ERROR, "Checkpoint " + _path + " could not be mapped");
+      bytes = 0;
+      return false;
+    }
+    base = (const char*) mapped;
+
+    const CheckpointHeader& header = GetHeader();
+    bool valid = header.magic == CHECKPOINT_MAGIC && header.version == CHECKPOINT_VERSION && header.fileBytes == bytes
+      && sizeof(CheckpointHeader) + header.sectionCount * sizeof(CheckpointSectionEntry) <= bytes;
+    for (uint32_t s = 0; valid && s < header.sectionCount; ++s) {
+      const CheckpointSectionEntry& entry = Entries()[s];
+      valid = entry.offset % 64 == 0 && entry.offset + entry.count * entry.recordBytes <= bytes;
+    }
+    if (!valid) {
+      logger(LogType::ERROR, "Checkpoint " + _path + " is not a valid version " + to_string(CHECKPOINT_VERSION) + " checkpoint");
+      Close();
+      return false;
+    }
+    return true;
+  };
+
+  // Unmap the checkpoint
+  void Close()
+  {
+    if (base) munmap((void*) base, bytes);
+    base = nullptr;
+    bytes = 0;
+  };
+
+  // Check if a checkpoint is mapped
+  bool IsOpen() const { return base != nullptr; };
+
+  // Get the records of a section, nullptr if the section is missing or holds records of another size
+  template<typename R>
+  const R* GetSection(uint32_t _id, size_t& _count) const
+  {
+    static_assert(is_trivially_copyable<R>::value, "checkpoint records must be trivially copyable");
+    _count = 0;
+    for (uint32_t s = 0; base && s < GetHeader().sectionCount; ++s) {
+      const CheckpointSectionEntry& entry = Entries()[s];
+      if (entry.id != _id) continue;
+      if (entry.recordBytes != sizeof(R)) {
+        logger(LogType::ERROR, "Checkpoint section " + to_string(_id) + " holds records of " + to_string(entry.recordBytes) + " bytes, expected " + to_string(sizeof(R)));
+        return nullptr;
+      }
+      _count = entry.count;
+      return (const R*) (base + entry.offset);
+    }
+    return nullptr;
+  };
+
+  // Get the stage the checkpoint was written at
+  uint32_t GetStage() const { return base ? GetHeader().stage : 0; };
+
+  // Get the time the checkpoint was written, in nanoseconds of the system clock
+  int64_t GetTimestampNanos() const { return base ? GetHeader().timestampNanos : 0; };
+
+  // Get the size of the checkpoint
+  size_t GetBytes() const { return bytes; };
+
+private:
+  const CheckpointHeader& GetHeader() const { return *(const CheckpointHeader*) base; };
+
+  const CheckpointSectionEntry* Entries() const { return (const CheckpointSectionEntry*) (base + sizeof(CheckpointHeader)); };
+
+  const char* base;
+  size_t bytes;
+
+};
+
+#endif
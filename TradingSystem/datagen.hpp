@@ -14,6 +14,7 @@
 #include <iomanip>
 #include <random>
 #include "functions.hpp"
+#include "idgenerator.hpp"
 
 // generate prices data
 void genPrices(const vector<string>& products, const string& priceFile, long long seed, const int numDataPoints) {
@@ -96,7 +97,7 @@ void genTrades(const vector<string>& products, const string& tradeFile, long lon
     for (const auto& product : products) {
         for (int i = 0; i < 10; ++i) {
             string side = (i % 2 == 0) ? "BUY" : "SELL";
-            string tradeId = GenerateRandomId(12);
+            FixedId tradeId = IdGenerator::Next("T");
 
             // Generate random price based on the side (BUY or SELL)
             uniform_real_distribution<double> priceDist(side == "BUY" ? 99.0 : 100.0, side == "BUY" ? 100.0 : 101.0);
@@ -124,7 +125,7 @@ void genInquiries(const vector<string>& products, const string& inquiryFile, lon
     for (const auto& product : products) {
         for (int i = 0; i < 10; ++i) {
             string side = (i % 2 == 0) ? "BUY" : "SELL";
-            string inquiryId = GenerateRandomId(12);
+            FixedId inquiryId = IdGenerator::Next("Q");
 
             // Generate random price based on the side (BUY or SELL)
             uniform_real_distribution<double> priceDist(side == "BUY" ? 99.0 : 100.0, side == "BUY" ? 100.0 : 101.0);
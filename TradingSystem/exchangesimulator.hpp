@@ -0,0 +1,313 @@
+/**
+ * exchangesimulator.hpp
+ * Local simulated exchange gateway and matching engine for one market.
+ *
+ * @author Yicheng Sun
+ */
+
+#ifndef EXCHANGE_SIMULATOR_HPP
+#define EXCHANGE_SIMULATOR_HPP
+
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include "soa.hpp"
+#include "seqlock.hpp"
+#include "spscring.hpp"
+#include "idgenerator.hpp"
+#include "marketdataservice.hpp"
+#include "algoexecutionservice.hpp"
+#include "functions.hpp"
+
+// How orders and reports travel between the gateway and the matching thread
+enum ExchangeTransport { IN_PROCESS, LOCAL_SOCKET };
+
+// Outcome of sending an order: taken, transport full for now, or transport failed
+enum SendStatus { SEND_OK, SEND_BUSY, SEND_FAILED };
+
+// Type of an exchange report
+enum ReportType { REPORT_ACK, REPORT_FILL, REPORT_CANCELLED, REPORT_REJECTED };
+
+const int EXCHANGE_BOOK_DEPTH = 5;
+
+/**
+ * Top levels of a product's book as seen by the exchange, best price first.
+ */
+struct BookSnapshot
+{
+  double bidPrices[EXCHANGE_BOOK_DEPTH];
+  long bidQuantities[EXCHANGE_BOOK_DEPTH];
+  double offerPrices[EXCHANGE_BOOK_DEPTH];
+  long offerQuantities[EXCHANGE_BOOK_DEPTH];
+  int bidLevels;
+  int offerLevels;
+};
+
+/**
+ * Order sent to the exchange.
+ */
+struct OrderRequest
+{
+  FixedId orderId;
+  int productIndex;
+  PricingSide side;
+  OrderType orderType;
+  double price;
+  long quantity;
+  long long sendNanos;
+};
+
+/**
+ * Ack, fill or cancel of an order, sent back by the exchange.
+ */
+struct ExchangeReport
+{
+  FixedId orderId;
+  FixedId execId;
+  ReportType type;
+  Market market;
+  int productIndex;
+  PricingSide side;
+  double price;
+  long quantity; // filled quantity of a fill
+  long leavesQuantity; // quantity still open after this report
+  long long sendNanos;
+  long long reportNanos;
+
+  // Check if the order is done after this report
+  bool IsTerminal() const { return type == REPORT_CANCELLED || type == REPORT_REJECTED || (type == REPORT_FILL && leavesQuantity == 0); };
+};
+
+
+/**
+ * Simulated exchange for one market. A matching thread receives orders, holds each
+ * one for the configured one-way latency, then matches it against the latest book
+ * snapshot of its product: the order sweeps the opposite side up to its limit (market
+ * and stop orders have none), FOK orders fill completely or not at all, and whatever is
+ * left is cancelled since the simulator does not rest orders. Fills consume the snapshot's
+ * liquidity until the next market data update replaces it.
+ * Book snapshots are published through a seqlock per product. Orders and reports go through
+ * a pair of SPSC rings in process, or through a unix socket pair to exercise a real
+ * socket hop. The gateway side (SendOrder, PollReports) must stay on one thread.
+ */
+class ExchangeSimulator
+{
+
+public:
+  // ctor and dtor
+  ExchangeSimulator(Market _market, long long _latencyNanos = 20000, ExchangeTransport _transport = IN_PROCESS, size_t _capacity = 65536) :
+    market(_market), latencyNanos(_latencyNanos), transport(_transport), requests(_capacity), reports(_capacity),
+    running(false), matchedCount(0), fillCount(0)
+  {
+    sockets[0] = sockets[1] = -1;
+    for (int i = 0; i < NUM_PRODUCTS; ++i) {
+      books[i] = BookSnapshot{};
+      bookVersions[i] = 0;
+    }
+  };
+  ~ExchangeSimulator() { Stop(); };
+
+  // Start the matching thread
+  bool Start()
+  {
+    if (running) return true;
+    if (transport == LOCAL_SOCKET) {
+      if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sockets) != 0) {
+        logger(LogType::ERROR, "Exchange simulator socket pair failed: errno " + to_string(errno));
+        return false;
+      }
+    }
+    running = true;
+    matcher = thread(&ExchangeSimulator::Run, this);
+    return true;
+  };
+
+  // Stop the matching thread, orders not yet matched are dropped
+  void Stop()
+  {
+    if (!running) return;
+    running = false;
+    matcher.join();
+    for (int& fd : sockets) {
+      if (fd >= 0) close(fd);
+      fd = -1;
+    }
+  };
+
+  // Publish the latest book of a product (market data thread)
+  void UpdateBook(int _productIndex, const BookSnapshot& _book) { snapshots[_productIndex].Store(_book); };
+
+  // Send an order (gateway thread)
+  SendStatus SendOrder(const OrderRequest& _order)
+  {
+    if (transport == IN_PROCESS) return requests.TryPush(_order) ? SEND_OK : SEND_BUSY;
+    if (send(sockets[0], &_order, sizeof(OrderRequest), MSG_DONTWAIT | MSG_NOSIGNAL) == (ssize_t) sizeof(OrderRequest)) return SEND_OK;
+    if (errno == EAGAIN || errno == EINTR) return SEND_BUSY;
+    logger(LogType::ERROR, "Exchange simulator failed to send order " + _order.orderId.ToString() + ": " + strerror(errno));
+    return SEND_FAILED;
+  };
+
+  // Hand up to _max pending reports to _func (gateway thread), returns the number handled
+  template<typename F>
+  size_t PollReports(F&& _func, size_t _max = 256)
+  {
+    // reports the socket refused come in process
+    size_t handled = reports.ConsumeBatch(_func, _max);
+    if (transport == IN_PROCESS) return handled;
+    ExchangeReport report;
+    while (handled < _max && recv(sockets[0], &report, sizeof(ExchangeReport), MSG_DONTWAIT) == (ssize_t) sizeof(ExchangeReport)) {
+      _func(report);
+      handled++;
+    }
+    return handled;
+  };
+
+  // Get the market
+  Market GetMarket() const { return market; };
+
+  // Get the one-way latency
+  long long GetLatencyNanos() const { return latencyNanos; };
+
+  // Get the number of orders matched and fills sent
+  uint64_t GetMatchedCount() const { return matchedCount.load(memory_order_relaxed); };
+  uint64_t GetFillCount() const { return fillCount.load(memory_order_relaxed); };
+
+private:
+  // matching thread
+  void Run()
+  {
+    // sleeps wake within a microsecond or two of their deadline rather than the default 50us
+    prctl(PR_SET_TIMERSLACK, 1000UL);
+    OrderRequest order;
+    int idle = 0;
+    while (running) {
+      if (!ReceiveOrder(order)) {
+        // no order: back off, so an idle venue does not hold a core
+        if (++idle < 64) this_thread::yield();
+        else this_thread::sleep_for(chrono::microseconds(50));
+        continue;
+      }
+      idle = 0;
+      // hold the order until it has crossed the simulated wire; latency is constant, so
+      // holding the oldest order never delays a later one
+      WaitUntil(order.sendNanos + latencyNanos);
+      Match(order);
+    }
+  };
+
+  // sleep until _due, spinning only the last few microseconds a sleep cannot hit
+  static void WaitUntil(long long _due)
+  {
+    const long long spinNanos = 5000;
+    long long remaining = _due - getSteadyNanos();
+    if (remaining > spinNanos) this_thread::sleep_for(chrono::nanoseconds(remaining - spinNanos));
+    while (getSteadyNanos() < _due) this_thread::yield();
+  };
+
+  // take the next order, waiting up to 1ms for one on a socket, false if none arrived
+  bool ReceiveOrder(OrderRequest& _order)
+  {
+    if (transport == IN_PROCESS) return requests.TryPop(_order);
+    pollfd pfd{sockets[1], POLLIN, 0};
+    if (poll(&pfd, 1, 1) <= 0) return false;
+    return recv(sockets[1], &_order, sizeof(OrderRequest), 0) == (ssize_t) sizeof(OrderRequest);
+  };
+
+  // match an order against the product's book
+  void Match(const OrderRequest& _order)
+  {
+    int index = _order.productIndex;
+    if (index < 0 || index >= NUM_PRODUCTS || _order.quantity <= 0) {
+      Report(_order, REPORT_REJECTED, 0.0, 0, _order.quantity);
+      return;
+    }
+
+    // pick up a newer snapshot, otherwise keep the liquidity left by earlier fills
+    uint64_t version = snapshots[index].GetVersion();
+    if (version != bookVersions[index]) {
+      books[index] = snapshots[index].Load();
+      bookVersions[index] = version;
+    }
+    BookSnapshot& book = books[index];
+    matchedCount.fetch_add(1, memory_order_relaxed);
+    Report(_order, REPORT_ACK, 0.0, 0, _order.quantity);
+
+    bool buy = _order.side == BID;
+    double* prices = buy ? book.offerPrices : book.bidPrices;
+    long* quantities = buy ? book.offerQuantities : book.bidQuantities;
+    int levels = buy ? book.offerLevels : book.bidLevels;
+    bool limited = _order.orderType == LIMIT || _order.orderType == IOC || _order.orderType == FOK;
+    auto reachable = [&](double _price) { return !limited || (buy ? _price <= _order.price : _price >= _order.price); };
+
+    if (_order.orderType == FOK) {
+      long available = 0;
+      for (int l = 0; l < levels && reachable(prices[l]); ++l) available += quantities[l];
+      if (available < _order.quantity) {
+        Report(_order, REPORT_CANCELLED, 0.0, 0, _order.quantity);
+        return;
+      }
+    }
+
+    long leaves = _order.quantity;
+    for (int l = 0; l < levels && leaves > 0 && reachable(prices[l]); ++l) {
+      long quantity = min(leaves, quantities[l]);
+      if (quantity <= 0) continue;
+      quantities[l] -= quantity;
+      leaves -= quantity;
+      fillCount.fetch_add(1, memory_order_relaxed);
+      Report(_order, REPORT_FILL, prices[l], quantity, leaves);
+    }
+    if (leaves > 0) Report(_order, REPORT_CANCELLED, 0.0, 0, leaves);
+  };
+
+  // send a report back to the gateway, waiting while the transport is full
+  // A report the socket failed to take goes in process instead, so the gateway still hears the order is done
+  void Report(const OrderRequest& _order, ReportType _type, double _price, long _quantity, long _leaves)
+  {
+    ExchangeReport report{_order.orderId, _type == REPORT_FILL ? IdGenerator::Next("X") : FixedId(), _type, market,
+      _order.productIndex, _order.side, _price, _quantity, _leaves, _order.sendNanos, getSteadyNanos()};
+    if (transport == LOCAL_SOCKET && SendReport(report)) return;
+    while (!reports.TryPush(report) && running) this_thread::yield();
+  };
+
+  // send a report over the socket, waiting while it is full, false if the socket failed
+  bool SendReport(const ExchangeReport& _report)
+  {
+    while (send(sockets[1], &_report, sizeof(ExchangeReport), MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+      if (errno != EAGAIN && errno != EINTR) {
+        logger(LogType::ERROR, "Exchange simulator failed to send a report of order " + _report.orderId.ToString() + ": " + strerror(errno));
+        return false;
+      }
+      // stopping: the report is dropped with the orders not yet matched
+      if (!running) return true;
+      this_thread::yield();
+    }
+    return true;
+  };
+
+  Market market;
+  long long latencyNanos;
+  ExchangeTransport transport;
+  SpscRing<OrderRequest> requests;
+  SpscRing<ExchangeReport> reports;
+  int sockets[2];
+  atomic<bool> running;
+  thread matcher;
+  SeqLock<BookSnapshot> snapshots[NUM_PRODUCTS];
+  // matching thread's working copy of each book and the snapshot version it came from
+  BookSnapshot books[NUM_PRODUCTS];
+  uint64_t bookVersions[NUM_PRODUCTS];
+  atomic<uint64_t> matchedCount;
+  atomic<uint64_t> fillCount;
+
+};
+
+#endif
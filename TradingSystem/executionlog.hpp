@@ -0,0 +1,130 @@
+/**
+ * executionlog.hpp
+ * Fixed-size binary records of the execution log and their text rendering.
+ *
+ * @author Yicheng Sun
+ */
+
+#ifndef EXECUTION_LOG_HPP
+#define EXECUTION_LOG_HPP
+
+#include <string>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <type_traits>
+#include "idgenerator.hpp"
+#include "orderstore.hpp"
+#include "algoexecutionservice.hpp"
+#include "exchangesimulator.hpp"
+#include "functions.hpp"
+
+using namespace std;
+
+const uint16_t EXECUTION_LOG_MAGIC = 0xE10C;
+const uint8_t EXECUTION_LOG_VERSION = 1;
+
+// Type of an execution log record: an order sent, or one of the report types
+enum ExecutionLogType : uint8_t { LOG_ORDER, LOG_ACK, LOG_FILL, LOG_CANCELLED, LOG_REJECTED };
+
+/**
+ * One entry of the binary execution log, written as is. Every record carries the magic
+ * and version so a reader can check any offset of the file.
+ * For an order, refId is its parent order and quantities are visible and hidden; for a
+ * report, refId is the exec ID and quantities are filled and leaves.
+ */
+struct ExecutionLogRecord
+{
+  uint16_t magic;
+  uint8_t version;
+  uint8_t type; // ExecutionLogType
+  uint8_t side; // PricingSide
+  uint8_t orderType; // OrderType, orders only
+  uint8_t market; // Market
+  uint8_t isChildOrder;
+  int32_t productIndex;
+  uint32_t reserved;
+  int64_t timestampNanos; // system clock
+  FixedId orderId;
+  FixedId refId;
+  double price;
+  int64_t quantity;
+  int64_t secondQuantity;
+};
+
+static_assert(is_trivially_copyable<ExecutionLogRecord>::value && sizeof(ExecutionLogRecord) == 80, "ExecutionLogRecord must be a trivially copyable 80 bytes");
+
+// log record of an order sent to a market
+ExecutionLogRecord makeExecutionLogRecord(const OrderRecord& _order)
+{
+  ExecutionLogRecord record{};
+  record.magic = EXECUTION_LOG_MAGIC;
+  record.version = EXECUTION_LOG_VERSION;
+  record.type = LOG_ORDER;
+  record.side = _order.side;
+  record.orderType = _order.orderType;
+  record.market = _order.market;
+  record.isChildOrder = _order.isChildOrder;
+  record.productIndex = _order.productIndex;
+  record.timestampNanos = chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+  record.orderId = _order.orderId;
+  record.refId = _order.parentOrderId;
+  record.price = fromPriceTicks(_order.priceTicks);
+  record.quantity = _order.visibleQuantity;
+  record.secondQuantity = _order.hiddenQuantity;
+  return record;
+}
+
+// log record of an exchange report
+ExecutionLogRecord makeExecutionLogRecord(const ExchangeReport& _report)
+{
+  ExecutionLogRecord record{};
+  record.magic = EXECUTION_LOG_MAGIC;
+  record.version = EXECUTION_LOG_VERSION;
+  record.type = (uint8_t) (LOG_ACK + _report.type);
+  record.side = (uint8_t) _report.side;
+  record.market = (uint8_t) _report.market;
+  record.productIndex = _report.productIndex;
+  record.timestampNanos = chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+  record.orderId = _report.orderId;
+  record.refId = _report.execId;
+  record.price = _report.price;
+  record.quantity = _report.quantity;
+  record.secondQuantity = _report.leavesQuantity;
+  return record;
+}
+
+// writer formatter copying a record as is, for AsyncRecordWriter
+size_t WriteExecutionLogRecord(const ExecutionLogRecord& _record, char* _buffer)
+{
+  memcpy(_buffer, &_record, sizeof(ExecutionLogRecord));
+  return sizeof(ExecutionLogRecord);
+}
+
+// render a record in the text format the execution connector used to print, returns the number of bytes written
+size_t FormatExecutionLogRecord(const ExecutionLogRecord& _record, char* _buffer)
+{
+  static const char* MARKETS[] = {"BROKERTEC", "ESPEED", "CME"};
+  static const char* ORDER_TYPES[] = {"FOK", "IOC", "MARKET", "LIMIT", "STOP"};
+  static const char* REPORTS[] = {"", "ACK", "FILL", "CANCELLED", "REJECTED"};
+  const char* product = isProductIndex(_record.productIndex) ? PRODUCT_CUSIPS[_record.productIndex].c_str() : "?";
+  const char* market = _record.market <= CME ? MARKETS[_record.market] : "?";
+  char orderId[FixedId::CAPACITY + 1];
+  char refId[FixedId::CAPACITY + 1];
+  snprintf(orderId, sizeof(orderId), "%.*s", (int) _record.orderId.Size(), _record.orderId.Data());
+  snprintf(refId, sizeof(refId), "%.*s", (int) _record.refId.Size(), _record.refId.Data());
+
+  if (_record.type == LOG_ORDER) {
+    const char* orderType = _record.orderType <= STOP ? ORDER_TYPES[_record.orderType] : "?";
+    return sprintf(_buffer, "ExecutionOrder: Product: %s, OrderId: %s, Trade Market: %s, PricingSide: %s, OrderType: %s, IsChildOrder: %s, "
+      "Price: %.6f, VisibleQuantity: %lld, HiddenQuantity: %lld\n\n", product, orderId, market, _record.side == BID ? "Bid" : "Offer",
+      orderType, _record.isChildOrder ? "True" : "False", _record.price, (long long) _record.quantity, (long long) _record.secondQuantity);
+  }
+  const char* report = _record.type <= LOG_REJECTED ? REPORTS[_record.type] : "?";
+  return sprintf(_buffer, "ExecutionReport: Product: %s, OrderId: %s, ExecId: %s, Trade Market: %s, PricingSide: %s, Report: %s, "
+    "Price: %.6f, Quantity: %lld, LeavesQuantity: %lld\n", product, orderId, refId, market, _record.side == BID ? "Bid" : "Offer",
+    report, _record.price, (long long) _record.quantity, (long long) _record.secondQuantity);
+}
+
+#endif
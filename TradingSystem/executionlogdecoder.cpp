@@ -0,0 +1,69 @@
+/**
+ * executionlogdecoder.cpp
+ * Offline decoder rendering the binary execution log as text.
+ *
+ * usage: executionlogdecoder <log file> [--orders] [--timestamps]
+ *
+ * @author Yicheng Sun
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdio>
+
+#include "functions.hpp"
+#include "executionlog.hpp"
+
+using namespace std;
+
+int main(int argc, char* argv[]) {
+    string path;
+    bool ordersOnly = false;
+    bool timestamps = false;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--orders") ordersOnly = true;
+        else if (arg == "--timestamps") timestamps = true;
+        else if (path.empty() && arg[0] != '-') path = arg;
+        else {
+            cerr << "usage: executionlogdecoder <log file> [--orders] [--timestamps]" << endl;
+            return 1;
+        }
+    }
+    if (path.empty()) {
+        cerr << "usage: executionlogdecoder <log file> [--orders] [--timestamps]" << endl;
+        return 1;
+    }
+
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == nullptr) {
+        cerr << "cannot open execution log " << path << endl;
+        return 1;
+    }
+
+    // read in blocks of records, render each into a reusable line buffer
+    vector<ExecutionLogRecord> records(4096);
+    char line[512];
+    long offset = 0;
+    size_t n;
+    while ((n = fread(records.data(), sizeof(ExecutionLogRecord), records.size(), file)) > 0) {
+        for (size_t r = 0; r < n; ++r, ++offset) {
+            const ExecutionLogRecord& record = records[r];
+            if (record.magic != EXECUTION_LOG_MAGIC || record.version != EXECUTION_LOG_VERSION) {
+                cerr << "bad record " << offset << " in " << path << ", not an execution log of version " << (int) EXECUTION_LOG_VERSION << endl;
+                fclose(file);
+                return 1;
+            }
+            if (ordersOnly && record.type != LOG_ORDER) continue;
+            if (timestamps) {
+                chrono::system_clock::time_point timestamp(chrono::duration_cast<chrono::system_clock::duration>(chrono::nanoseconds(record.timestampNanos)));
+                fputs((getTimeStamp(timestamp) + " ").c_str(), stdout);
+            }
+            fwrite(line, 1, FormatExecutionLogRecord(record, line), stdout);
+        }
+    }
+    if (ferror(file)) cerr << "error reading " << path << endl;
+    fclose(file);
+    return 0;
+}
@@ -10,6 +10,14 @@
 #include <string>
 #include "soa.hpp"
 #include "algoexecutionservice.hpp"
+#include "exchangesimulator.hpp"
+#include "latencyhistogram.hpp"
+#include "orderstore.hpp"
+#include "pretraderisk.hpp"
+#include "smartorderrouter.hpp"
+#include "executionlog.hpp"
+#include "asyncwriter.hpp"
+#include "checkpoint.hpp"
 
 // forward declaration of connector and executionservice listener
 template<typename T>
@@ -31,11 +39,22 @@ public:
   ExecutionService()
   {
     executionservicelistener = new ExecutionServiceListener<T>(this);
+    connector = new ExecutionServiceConnector<T>(this);
+    riskGate = nullptr;
+    router = nullptr;
+    executionLog = nullptr;
+    algoExecutionService = nullptr;
   };
   ~ExecutionService() = default;
 
-  // Get data on our service given a key
-  ExecutionOrder<T>& GetData(string _key) { return executionOrders[_key]; };
+  // Get data on our service given a key, a live order ID
+  // The returned order is rebuilt from the store and valid until the next call
+  ExecutionOrder<T>& GetData(string _key)
+  {
+    OrderRecord* record = _key.size() <= (size_t) FixedId::CAPACITY ? orders.Get(orders.Find(FixedId(_key))) : nullptr;
+    orderView = record ? ToExecutionOrder(*record) : ExecutionOrder<T>();
+    return orderView;
+  };
 
   // The callback that a Connector should invoke for any new or updated data
   void OnMessage(ExecutionOrder<T>& data) override {};
@@ -55,29 +74,184 @@ public:
   // Execute an order on a market
   void ExecuteOrder(const ExecutionOrder<T>& order, Market market) { connector -> Publish(order, market); };
 
+  // Add a listener receiving the acks, fills and cancels sent back by the exchanges
+  void AddReportListener(ServiceListener<ExchangeReport>* _listener) { reportListeners.push_back(_listener); };
+
+  // The callback that the connector invokes for every exchange report
+  void OnExchangeReport(ExchangeReport& _report)
+  {
+    if (executionLog) executionLog -> Enqueue(makeExecutionLogRecord(_report));
+    // track the order's state, its slot is recycled once it is done
+    OrderHandle handle = orders.Find(_report.orderId);
+    if (OrderRecord* record = orders.Get(handle)) {
+      if (_report.type == REPORT_ACK) record -> state = ORDER_ACKED;
+      else if (_report.type == REPORT_FILL) {
+        record -> filledQuantity += _report.quantity;
+        record -> state = _report.leavesQuantity == 0 ? ORDER_FILLED : ORDER_PARTIALLY_FILLED;
+      }
+      else record -> state = _report.type == REPORT_CANCELLED ? ORDER_CANCELLED : ORDER_REJECTED;
+      // child slices hear how much of them filled or will not fill
+      if (algoExecutionService && record -> isChildOrder && _report.type != REPORT_ACK) {
+        bool filled = _report.type == REPORT_FILL;
+        algoExecutionService -> OnChildReport(record -> orderId, record -> parentOrderId, filled ? _report.quantity : 0, filled ? 0 : _report.leavesQuantity);
+      }
+      if (record -> IsTerminal()) orders.Release(handle);
+    }
+
+    for (auto& listener : reportListeners) {
+      listener -> ProcessAdd(_report);
+    }
+  };
+
+  // Handle the exchange reports received so far
+  void PollExchanges() { connector -> PollReports(); };
+
+  // Wait until every order sent to an exchange is done
+  void FlushExchanges() { connector -> Flush(); };
+
+  // Check orders against a pre-trade risk gate before they are stored and executed
+  void SetRiskGate(PreTradeRiskGate* _gate) { riskGate = _gate; };
+
+  // Check an order against the risk gate, true if it may go out
+  bool PassesRiskGate(const ExecutionOrder<T>& _order)
+  {
+    if (!riskGate) return true;
+    long quantity = _order.GetVisibleQuantity() + _order.GetHiddenQuantity();
+    return riskGate -> Check(getProductIndex(_order.GetProduct().GetProductId()), _order.GetSide(), quantity, _order.GetPrice()) == 0;
+  };
+
+  // Split orders across venues with a smart order router instead of sending them to their market
+  void SetRouter(SmartOrderRouter* _router) { router = _router; };
+
+  // Get the smart order router, nullptr if orders go to their market
+  SmartOrderRouter* GetRouter() { return router; };
+
+  // Route an order across the venues: each child order is stored, flowed to the listeners and executed
+  void RouteOrder(const ExecutionOrder<T>& _order)
+  {
+    RouteSlice slices[ROUTER_MAX_VENUES];
+    long quantity = _order.GetVisibleQuantity() + _order.GetHiddenQuantity();
+    int count = router -> Route(getProductIndex(_order.GetProduct().GetProductId()), _order.GetSide(), quantity, slices);
+    long routed = 0;
+    for (int c = 0; c < count; ++c) {
+      ExecutionOrder<T> child(_order.GetProduct(), _order.GetSide(), IdGenerator::Next("R"), _order.GetOrderType(), slices[c].price,
+        slices[c].quantity, 0, _order.GetOrderId(), true);
+      TrackOrder(ToRecord(child, slices[c].market));
+      NotifyOrder(child);
+      ExecuteOrder(child, slices[c].market);
+      routed += slices[c].quantity;
+    }
+    // the gate reserved the whole order
+    if (riskGate && quantity > routed) riskGate -> Release(getProductIndex(_order.GetProduct().GetProductId()), _order.GetSide(), quantity - routed);
+    ReportUnsent(_order, quantity - routed);
+  };
+
+  // Give the quantity of an order that never reached an exchange back to the slice it came from
+  void ReportUnsent(const ExecutionOrder<T>& _order, long _quantity)
+  {
+    if (algoExecutionService && _order.IsChildOrder() && _quantity > 0) {
+      algoExecutionService -> OnChildReport(_order.GetOrderId(), _order.GetParentOrderId(), 0, _quantity);
+    }
+  };
+
+  // Report the fills and cancels of child slices back to the algo execution service that sliced them
+  void SetAlgoExecutionService(AlgoExecutionService<T>* _algoExecutionService) { algoExecutionService = _algoExecutionService; };
+
+  // Get the store of live orders
+  const OrderStore& GetOrderStore() const { return orders; };
+
+  // Add the live orders to a checkpoint
+  void SaveCheckpoint(CheckpointWriter& _writer)
+  {
+    vector<OrderRecord> records;
+    records.reserve(orders.GetLiveCount());
+    orders.ForEach([&records](const OrderRecord& _record) { records.push_back(_record); });
+    _writer.AddSection(CHECKPOINT_ORDERS, records.data(), records.size());
+  };
+
+  // Restore from a checkpoint, false if it has no order section
+  // The exchanges that held the live orders died with the process, so they are cancelled rather than restored:
+  // kept in the store they would never be sent again nor get a report, and hold their slots forever
+  bool RestoreCheckpoint(const CheckpointReader& _reader)
+  {
+    size_t count;
+    const OrderRecord* records = _reader.GetSection<OrderRecord>(CHECKPOINT_ORDERS, count);
+    if (!records) return false;
+    if (count > 0) logger(LogType::INFO, "Cancelled " + to_string(count) + " orders that were live at the checkpoint.");
+    return true;
+  };
+
   // called by ExecutionServiceListener to subscribe data from Algo Execution Service to Execution Service
   void AddExecutionOrder(const AlgoExecution<T>& _algoExecution)
   {
     ExecutionOrder<T> executionOrder = _algoExecution.GetExecutionOrder();
-    string orderId = executionOrder.GetOrderId();
-    // delete orderId if already exist
-    if (executionOrders.find(orderId) != executionOrders.end()) 
-    {
-      executionOrders.erase(orderId);
-    }
-    executionOrders.insert(pair<string, ExecutionOrder<T>> (orderId, executionOrder));
-    
-    // flow data to the service
+    // store the order until it is done, replacing a live order with the same ID
+    TrackOrder(ToRecord(executionOrder, _algoExecution.GetMarket()));
+    NotifyOrder(executionOrder);
+  };
+
+  // Store an order until it is done, replacing a live order with the same ID
+  // Must happen before the order is sent, so its reports find it
+  OrderHandle TrackOrder(const OrderRecord& _record)
+  {
+    if (executionLog) executionLog -> Enqueue(makeExecutionLogRecord(_record));
+    return orders.Insert(_record);
+  };
+
+  // Write every order and exchange report to a binary execution log instead of printing orders
+  void SetExecutionLog(AsyncRecordWriter<ExecutionLogRecord>* _executionLog) { executionLog = _executionLog; };
+
+  // Get the binary execution log, nullptr if orders are printed
+  AsyncRecordWriter<ExecutionLogRecord>* GetExecutionLog() { return executionLog; };
+
+  // Flow an order to the listeners, e.g. for persistence
+  void NotifyOrder(ExecutionOrder<T>& _order)
+  {
     for (auto& listener : listeners) {
-      listener -> ProcessAdd(executionOrder);
+      listener -> ProcessAdd(_order);
     }
   };
 
+  // Rebuild a full order from its compact record
+  ExecutionOrder<T> ToExecutionOrder(const OrderRecord& _record)
+  {
+    optional<T>& product = products[_record.productIndex];
+    if (!product) product = getProductObject<T>(PRODUCT_CUSIPS[_record.productIndex]);
+    return ExecutionOrder<T>(*product, (PricingSide) _record.side, _record.orderId, (OrderType) _record.orderType, fromPriceTicks(_record.priceTicks),
+      _record.visibleQuantity, _record.hiddenQuantity, _record.parentOrderId, _record.isChildOrder);
+  };
+
 private:
-  map<string, ExecutionOrder<T>> executionOrders;
+  // compact copy of an order
+  static OrderRecord ToRecord(const ExecutionOrder<T>& _order, Market _market)
+  {
+    OrderRecord record;
+    record.orderId = _order.GetOrderId();
+    record.parentOrderId = _order.GetParentOrderId();
+    record.priceTicks = toPriceTicks(_order.GetPrice());
+    record.visibleQuantity = _order.GetVisibleQuantity();
+    record.hiddenQuantity = _order.GetHiddenQuantity();
+    record.filledQuantity = 0;
+    record.productIndex = getProductIndex(_order.GetProduct().GetProductId());
+    record.side = (uint8_t) _order.GetSide();
+    record.orderType = (uint8_t) _order.GetOrderType();
+    record.market = (uint8_t) _market;
+    record.state = ORDER_NEW;
+    record.isChildOrder = _order.IsChildOrder();
+    return record;
+  };
+
+  OrderStore orders;
+  ExecutionOrder<T> orderView;
+  optional<T> products[NUM_PRODUCTS];
   vector<ServiceListener<ExecutionOrder<T>>*> listeners;
+  vector<ServiceListener<ExchangeReport>*> reportListeners;
   ExecutionServiceConnector<T>* connector;
   ExecutionServiceListener<T>* executionservicelistener;
+  PreTradeRiskGate* riskGate;
+  SmartOrderRouter* router;
+  AsyncRecordWriter<ExecutionLogRecord>* executionLog;
+  AlgoExecutionService<T>* algoExecutionService;
 
 };
 
@@ -91,14 +265,47 @@ class ExecutionServiceConnector : public Connector<ExecutionOrder<T>>
 {
 private:
   ExecutionService<T>* service; // execution service related to this connector
+  ExchangeSimulator* exchanges[CME + 1]; // gateway of each market, null to print orders instead
+  long outstanding; // orders sent and not yet done
+  LatencyHistogram ackLatency;
+  LatencyHistogram fillLatency;
 
 public:
   // ctor and dtor
-  ExecutionServiceConnector(ExecutionService<T>* _service) : service(_service) {};
+  ExecutionServiceConnector(ExecutionService<T>* _service) : service(_service), exchanges(), outstanding(0) {};
   ~ExecutionServiceConnector() = default;
 
-  // Publish data to the Connector and print
+  // Route the orders of a market to an exchange
+  void SetExchange(Market _market, ExchangeSimulator* _exchange) { exchanges[_market] = _exchange; };
+
+  // Publish data to the Connector on the default market
+  void Publish(ExecutionOrder<T>& _order) override
+  {
+    Market market = BROKERTEC;
+    Publish(_order, market);
+  };
+
+  // Publish data to the Connector, sent to the market's exchange if one is set
+  // Otherwise printed, unless the service writes the binary execution log, and taken as filled
   void Publish(const ExecutionOrder<T>& _order, Market& _market)
+  {
+    if (exchanges[_market]) {
+      SendOrder(_order, _market);
+      return;
+    }
+
+    auto product = _order.GetProduct();
+    if (!service -> GetExecutionLog()) Print(_order, _market);
+
+    // no venue to hear back from: the order is taken as filled in full at its price
+    long long now = getSteadyNanos();
+    ExchangeReport fill{_order.GetOrderId(), _order.GetOrderId(), REPORT_FILL, _market, getProductIndex(product.GetProductId()), _order.GetSide(),
+      _order.GetPrice(), _order.GetVisibleQuantity() + _order.GetHiddenQuantity(), 0, now, now};
+    service -> OnExchangeReport(fill);
+  };
+
+  // Print an order in the text format of the execution log decoder
+  void Print(const ExecutionOrder<T>& _order, Market _market)
   {
     auto product = _order.GetProduct();
     string orderType;
@@ -134,6 +341,75 @@ public:
   };
 
   void Subscribe(ifstream& _data) {};
+
+  // Publish the book of a product to every exchange, whole: without a router no venue gets a share
+  void UpdateBook(int _productIndex, const BookSnapshot& _book)
+  {
+    for (auto& exchange : exchanges) {
+      if (exchange) exchange -> UpdateBook(_productIndex, _book);
+    }
+  };
+
+  // Hand the reports received from every exchange to the service
+  void PollReports()
+  {
+    for (auto& exchange : exchanges) {
+      if (!exchange) continue;
+      exchange -> PollReports([this](ExchangeReport& _report) { OnReport(_report); });
+    }
+  };
+
+  // Poll until every order sent is done
+  void Flush()
+  {
+    while (outstanding > 0) {
+      PollReports();
+      this_thread::yield();
+    }
+  };
+
+  // Get the latency from sending an order to the exchange emitting its ack, and each of its fills
+  const LatencyHistogram& GetAckLatency() const { return ackLatency; };
+  const LatencyHistogram& GetFillLatency() const { return fillLatency; };
+
+  // Send an order request straight to a market's exchange, without first handling pending reports
+  // False if no exchange is set for the market or its transport failed, the order is then not outstanding
+  bool SendRequest(Market _market, const OrderRequest& _request)
+  {
+    ExchangeSimulator* exchange = exchanges[_market];
+    if (!exchange) return false;
+    SendStatus status;
+    // the exchange is backed up: drain its reports so it can make progress
+    while ((status = exchange -> SendOrder(_request)) == SEND_BUSY) {
+      PollReports();
+      this_thread::yield();
+    }
+    if (status == SEND_FAILED) return false;
+    outstanding++;
+    return true;
+  };
+
+private:
+  void SendOrder(const ExecutionOrder<T>& _order, Market _market)
+  {
+    PollReports();
+    OrderRequest request{_order.GetOrderId(), getProductIndex(_order.GetProduct().GetProductId()), _order.GetSide(), _order.GetOrderType(),
+      _order.GetPrice(), _order.GetVisibleQuantity() + _order.GetHiddenQuantity(), getSteadyNanos()};
+    if (SendRequest(_market, request)) return;
+    // the order never left: reject it so its slot, its gate reservation and its slice are released
+    long long now = getSteadyNanos();
+    ExchangeReport rejected{request.orderId, FixedId(), REPORT_REJECTED, _market, request.productIndex, request.side, request.price, 0, request.quantity, now, now};
+    service -> OnExchangeReport(rejected);
+  };
+
+  void OnReport(ExchangeReport& _report)
+  {
+    // timed from sending to the exchange emitting the report, however late the gateway polls for it
+    if (_report.type == REPORT_ACK) ackLatency.Record(_report.reportNanos - _report.sendNanos);
+    else if (_report.type == REPORT_FILL) fillLatency.Record(_report.reportNanos - _report.sendNanos);
+    if (_report.IsTerminal()) outstanding--;
+    service -> OnExchangeReport(_report);
+  };
 };
 
 
@@ -155,6 +431,16 @@ public:
   // Listener callback to process an add event to the Service
   void ProcessAdd(AlgoExecution<T>& _data) override 
   {
+    // orders breaching a pre-trade limit go no further
+    if (!executionService -> PassesRiskGate(_data.GetExecutionOrder())) {
+      const ExecutionOrder<T>& order = _data.GetExecutionOrder();
+      executionService -> ReportUnsent(order, order.GetVisibleQuantity() + order.GetHiddenQuantity());
+      return;
+    }
+    if (executionService -> GetRouter()) {
+      executionService -> RouteOrder(_data.GetExecutionOrder());
+      return;
+    }
     executionService -> AddExecutionOrder(_data);
     ExecutionOrder<T> executionOrder = _data.GetExecutionOrder();
     Market market = _data.GetMarket();
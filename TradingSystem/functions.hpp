@@ -13,6 +13,7 @@
 #include <chrono>
 #include <random>
 #include <fstream>
+#include <cstring>
 #include "products.hpp"
 
 using namespace std;
@@ -41,6 +42,23 @@ double convertPrice(const string& priceStr)
     return price;
 }
 
+// convert a fractional price held in a character range, without allocating
+double convertPrice(const char* _price, size_t _length)
+{
+    const char* dash = (const char*) memchr(_price, '-', _length);
+    if (dash == nullptr || dash + 3 >= _price + _length) {
+        throw invalid_argument("Invalid price format");
+    }
+
+    long intpart = 0;
+    for (const char* c = _price; c < dash; ++c) {
+        intpart = intpart * 10 + (*c - '0');
+    }
+    int dec1 = (dash[1] - '0') * 10 + (dash[2] - '0');
+    int dec2 = dash[3] == '+' ? 4 : dash[3] - '0';
+    return intpart + dec1 * 1.0 / 32.0 + dec2 * 1.0 / 256.0;
+}
+
 // convert prices from decimal notations (double) to fractional noations (string)
 string convertPrice(double price) {
     int intPart = floor(price);
@@ -90,6 +108,11 @@ string getTimeStamp(chrono::system_clock::time_point _now) {
     return oss.str();
 }
 
+// get monotonic time in nanoseconds, for throttling and latency measurement
+long long getSteadyNanos() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 // join a vector of string with delimiter
 string join(const vector<string>& strings, const string& delimiter) {
     string result = strings[0];
@@ -137,28 +160,51 @@ T getProductObject(const string& cusip) {
     }
 }
 
-// define pv01 value for cusips
-double getPV01(const string& _cusip) {
-	double _pv01 = 0;
-	if (_cusip == "9128283H1") _pv01 = 0.01948992;
-	if (_cusip == "9128283L2") _pv01 = 0.02865304;
-	if (_cusip == "912828M80") _pv01 = 0.04581119;
-	if (_cusip == "9128283J7") _pv01 = 0.06127718;
-	if (_cusip == "9128283F5") _pv01 = 0.08161449;
-	if (_cusip == "912810RZ3") _pv01 = 0.15013155;
-	return _pv01;
+// number of products traded in the system
+const int NUM_PRODUCTS = 7;
+
+// cusips of the products, position in the array is the dense product index
+const string PRODUCT_CUSIPS[NUM_PRODUCTS] = {"9128283H1", "9128283L2", "912828M80", "9128283J7", "9128283F5", "912810TW8", "912810RZ3"};
+
+// get the dense product index (0 ... NUM_PRODUCTS-1) of a cusip
+int getProductIndex(const string& cusip) {
+    for (int i = 0; i < NUM_PRODUCTS; ++i) {
+        if (PRODUCT_CUSIPS[i] == cusip) return i;
+    }
+    throw invalid_argument("Unknown CUSIP: " + cusip);
 }
 
-// Generate random ID with numbers and letters
-string GenerateRandomId(long length) {
-    string characters = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
-    string id = "";
+// check a dense product index read back from a file or a socket
+bool isProductIndex(long index) {
+    return index >= 0 && index < NUM_PRODUCTS;
+}
 
-    for (int j = 0; j < length; ++j) {
-        int randomIdx = rand() % 36;
-        id += characters[randomIdx];
+// trading books, interned to dense IDs (0 ... MAX_BOOKS-1) in order of first use
+const int MAX_BOOKS = 8;
+
+vector<string>& getBookRegistry() {
+    static vector<string> books = {"TRSY1", "TRSY2", "TRSY3"};
+    return books;
+}
+
+// get the dense ID of a book, registering a book not seen before
+int internBook(const string& book) {
+    vector<string>& books = getBookRegistry();
+    for (int i = 0; i < (int) books.size(); ++i) {
+        if (books[i] == book) return i;
+    }
+    if ((int) books.size() == MAX_BOOKS) {
+        throw invalid_argument("Too many books, cannot register " + book);
     }
-    return id;
+    books.push_back(book);
+    return (int) books.size() - 1;
+}
+
+// get the name of a book ID, empty for an unknown ID
+const string& getBookName(int bookId) {
+    static const string unknown;
+    const vector<string>& books = getBookRegistry();
+    return bookId >= 0 && bookId < (int) books.size() ? books[bookId] : unknown;
 }
 
 // generate random spread between 1/128 and 1/64
@@ -0,0 +1,176 @@
+/**
+ * guisnapshot.hpp
+ * Shared-memory segment holding the latest GUI price of every product.
+ * Written by the trading system, polled by any number of local viewer processes.
+ *
+ * @author Yicheng Sun
+ */
+
+#ifndef GUI_SNAPSHOT_HPP
+#define GUI_SNAPSHOT_HPP
+
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "seqlock.hpp"
+
+using namespace std;
+
+// default name of the segment under /dev/shm
+const char* const GUI_SNAPSHOT_NAME = "/tradingsystem_gui";
+const uint64_t GUI_SNAPSHOT_MAGIC = 0x31304d4853495547ULL; // "GUISHM01"
+const uint32_t GUI_SNAPSHOT_LAYOUT_VERSION = 1;
+const int GUI_SNAPSHOT_MAX_SLOTS = 64;
+
+/**
+ * Latest GUI price of one product.
+ */
+struct GUIPriceSlot
+{
+  char productId[16];
+  double mid;
+  double bidOfferSpread;
+  long long timestampNanos; // system clock, nanoseconds since epoch
+  uint64_t updates;
+};
+
+/**
+ * Layout of the shared-memory segment. Each slot sits behind its own seqlock,
+ * whose version counter lets viewers detect changes and torn reads without
+ * any syscall or lock on the writer side.
+ */
+struct GUISnapshotLayout
+{
+  uint64_t magic;
+  uint32_t layoutVersion;
+  uint32_t slotCount;
+  SeqLock<GUIPriceSlot> slots[GUI_SNAPSHOT_MAX_SLOTS];
+};
+
+
+/**
+ * Handle on the GUI snapshot segment, either as the single writer or as a reader.
+ * The slot count is checked against GUI_SNAPSHOT_MAX_SLOTS on both sides and kept
+ * locally, so a corrupt segment cannot send a reader past the slots. The writer
+ * removes the segment when it closes.
+ */
+class GUISnapshotSegment
+{
+
+public:
+  // ctor and dtor
+  GUISnapshotSegment() : layout(nullptr), slotCount(0), writer(false), inode(0) {};
+  ~GUISnapshotSegment() { Close(); };
+
+  // Create the segment as the writer, false if it cannot hold _slotCount slots
+  // A segment left under the name is unlinked first, so viewers still mapping it are not reset mid-read
+  bool Create(const string& _name, int _slotCount)
+  {
+    if (_slotCount < 1 || _slotCount > GUI_SNAPSHOT_MAX_SLOTS) return false;
+    Close();
+    shm_unlink(_name.c_str());
+    int fd = shm_open(_name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0) return false;
+    if (ftruncate(fd, sizeof(GUISnapshotLayout)) != 0) {
+      close(fd);
+      return false;
+    }
+    struct stat info;
+    fstat(fd, &info);
+    void* addr = mmap(nullptr, sizeof(GUISnapshotLayout), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) return false;
+    inode = info.st_ino;
+
+    // initialise the slots before publishing the magic, so readers never see a half-built segment
+    layout = new (addr) GUISnapshotLayout();
+    layout -> layoutVersion = GUI_SNAPSHOT_LAYOUT_VERSION;
+    layout -> slotCount = _slotCount;
+    atomic_thread_fence(memory_order_release);
+    layout -> magic = GUI_SNAPSHOT_MAGIC;
+    name = _name;
+    slotCount = _slotCount;
+    writer = true;
+    return true;
+  };
+
+  // Attach to an existing segment as a read-only viewer
+  bool Attach(const string& _name)
+  {
+    Close();
+    int fd = shm_open(_name.c_str(), O_RDONLY, 0);
+    if (fd < 0) return false;
+    void* addr = mmap(nullptr, sizeof(GUISnapshotLayout), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) return false;
+
+    layout = (GUISnapshotLayout*) addr;
+    if (layout -> magic != GUI_SNAPSHOT_MAGIC || layout -> layoutVersion != GUI_SNAPSHOT_LAYOUT_VERSION || layout -> slotCount > (uint32_t) GUI_SNAPSHOT_MAX_SLOTS) {
+      munmap(addr, sizeof(GUISnapshotLayout));
+      layout = nullptr;
+      return false;
+    }
+    atomic_thread_fence(memory_order_acquire);
+    name = _name;
+    slotCount = (int) layout -> slotCount;
+    writer = false;
+    return true;
+  };
+
+  // Unmap the segment, removing it if this is the writer
+  void Close()
+  {
+    if (!layout) return;
+    munmap(layout, sizeof(GUISnapshotLayout));
+    layout = nullptr;
+    if (writer) {
+      // only if the name still holds this segment, a later writer may have replaced it
+      int fd = shm_open(name.c_str(), O_RDONLY, 0);
+      struct stat info;
+      if (fd >= 0 && fstat(fd, &info) == 0 && info.st_ino == inode) shm_unlink(name.c_str());
+      if (fd >= 0) close(fd);
+    }
+    slotCount = 0;
+    writer = false;
+  };
+
+  // Check if the segment is mapped
+  bool IsOpen() const { return layout != nullptr; };
+
+  // Get the number of product slots
+  int GetSlotCount() const { return slotCount; };
+
+  // Write the latest price of a product (writer only, never blocks)
+  void Write(int _slot, const GUIPriceSlot& _price) { layout -> slots[_slot].Store(_price); };
+
+  // Read a consistent copy of a slot
+  GUIPriceSlot Read(int _slot) const { return layout -> slots[_slot].Load(); };
+
+  // Read a consistent copy of a slot in at most _attempts tries, false if every one raced a write
+  // or found it unfinished, e.g. the writer died mid-write
+  bool TryRead(int _slot, GUIPriceSlot& _price, int _attempts = 1000) const
+  {
+    for (int attempt = 0; attempt < _attempts; ++attempt) {
+      if (layout -> slots[_slot].TryLoad(_price)) return true;
+    }
+    return false;
+  };
+
+  // Get the version counter of a slot, changes on every write
+  uint64_t GetVersion(int _slot) const { return layout -> slots[_slot].GetVersion(); };
+
+private:
+  GUISnapshotLayout* layout;
+  string name;
+  int slotCount; // as checked when the segment was opened
+  bool writer;
+  ino_t inode; // of the segment the writer created
+
+};
+
+#endif
@@ -0,0 +1,65 @@
+/**
+ * guiviewer.cpp
+ * Reference viewer polling the GUI shared-memory snapshot written by the trading system.
+ *
+ * usage: guiviewer [--once] [--interval <ms>] [--name <segment>]
+ *
+ * @author Yicheng Sun
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <sstream>
+#include <iomanip>
+
+#include "functions.hpp"
+#include "guisnapshot.hpp"
+
+using namespace std;
+
+int main(int argc, char* argv[]) {
+    bool once = false;
+    int interval = 100;
+    string name = GUI_SNAPSHOT_NAME;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--once") once = true;
+        else if (arg == "--interval" && i + 1 < argc) interval = stoi(argv[++i]);
+        else if (arg == "--name" && i + 1 < argc) name = argv[++i];
+        else {
+            cerr << "usage: guiviewer [--once] [--interval <ms>] [--name <segment>]" << endl;
+            return 1;
+        }
+    }
+
+    GUISnapshotSegment segment;
+    if (!segment.Attach(name)) {
+        cerr << "GUI snapshot segment " << name << " not found or not valid, is the trading system running?" << endl;
+        return 1;
+    }
+
+    // print a slot whenever its version counter moves
+    vector<uint64_t> seen(segment.GetSlotCount(), 0);
+    while (true) {
+        for (int i = 0; i < segment.GetSlotCount(); ++i) {
+            uint64_t version = segment.GetVersion(i);
+            if (version == 0 || version == seen[i]) continue;
+            // a slot left mid-write is skipped rather than waited on
+            GUIPriceSlot slot;
+            if (!segment.TryRead(i, slot)) continue;
+            seen[i] = version;
+
+            system_clock::time_point timestamp(duration_cast<system_clock::duration>(nanoseconds(slot.timestampNanos)));
+            cout << getTimeStamp(timestamp) << "," << slot.productId << ","
+                 << convertPrice(slot.mid) << "," << convertPrice(slot.bidOfferSpread)
+                 << " (update " << slot.updates << ")" << endl;
+        }
+        if (once) break;
+        this_thread::sleep_for(chrono::milliseconds(interval));
+    }
+
+    return 0;
+}
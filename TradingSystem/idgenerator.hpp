@@ -0,0 +1,189 @@
+/**
+ * idgenerator.hpp
+ * Fixed-width identifiers and a lock-free per-thread generator for order, trade and inquiry IDs.
+ *
+ * @author Yicheng Sun
+ */
+
+#ifndef ID_GENERATOR_HPP
+#define ID_GENERATOR_HPP
+
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <ostream>
+#include <stdexcept>
+#include <algorithm>
+#include <functional>
+#include <unistd.h>
+
+using namespace std;
+
+/**
+ * Identifier of up to 15 characters stored inline, 16 bytes in total.
+ * Copying one never allocates, and it can be written to binary records as is.
+ */
+struct FixedId
+{
+  static const int CAPACITY = 15;
+
+  char chars[CAPACITY];
+  uint8_t length;
+
+  // ctors
+  FixedId() : chars(), length(0) {};
+  FixedId(const char* _chars, size_t _length) : chars(), length(0) { Assign(_chars, _length); };
+  explicit FixedId(const string& _id) : chars(), length(0) { Assign(_id.data(), _id.size()); };
+
+  // Get the characters, not null terminated
+  const char* Data() const { return chars; };
+
+  // Get the number of characters
+  size_t Size() const { return length; };
+
+  // Check if the id is empty
+  bool Empty() const { return length == 0; };
+
+  // Copy into a string, for map keys and printing
+  string ToString() const { return string(chars, length); };
+
+  // FNV-1a hash of the characters
+  uint64_t Hash() const
+  {
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < length; ++i) {
+      hash = (hash ^ (unsigned char) chars[i]) * 1099511628211ULL;
+    }
+    return hash;
+  };
+
+  bool operator==(const FixedId& _other) const { return length == _other.length && memcmp(chars, _other.chars, length) == 0; };
+  bool operator!=(const FixedId& _other) const { return !(*this == _other); };
+  bool operator<(const FixedId& _other) const
+  {
+    int cmp = memcmp(chars, _other.chars, min(length, _other.length));
+    return cmp < 0 || (cmp == 0 && length < _other.length);
+  };
+
+  // object printer
+  friend ostream& operator<<(ostream& os, const FixedId& _id)
+  {
+    os.write(_id.chars, _id.length);
+    return os;
+  };
+
+private:
+  void Assign(const char* _chars, size_t _length)
+  {
+    if (_length > (size_t) CAPACITY) throw invalid_argument("id longer than " + to_string(CAPACITY) + " characters: " + string(_chars, _length));
+    memcpy(chars, _chars, _length);
+    length = (uint8_t) _length;
+  };
+
+};
+
+namespace std
+{
+  template<>
+  struct hash<FixedId>
+  {
+    size_t operator()(const FixedId& _id) const { return (size_t) _id.Hash(); };
+  };
+}
+
+
+/**
+ * Generator of unique IDs laid out as prefix + shard (2) + time base (6) + sequence (5), base 36.
+ * Each thread takes its own shard once and keeps its time base and sequence in thread-local
+ * state, so generating an ID copies the pre-encoded shard and time base and encodes the
+ * sequence, with no lock, atomic or allocation.
+ * The time base is the second (since 2020) at which the thread started; when a thread's
+ * sequence wraps after 36^5 IDs it moves to the next second, so IDs of a thread only
+ * increase. Shards are salted by the process id to keep concurrent processes apart.
+ */
+class IdGenerator
+{
+
+public:
+  static const int SHARD_DIGITS = 2;
+  static const int TIME_DIGITS = 6;
+  static const int SEQUENCE_DIGITS = 5;
+
+  // Generate the next ID of the calling thread, the prefix can be up to 2 characters
+  static FixedId Next(const char* _prefix)
+  {
+    ThreadState& state = GetThreadState();
+    if (state.sequence == SEQUENCE_LIMIT) {
+      // sequence exhausted: move to the next time base, never back in time
+      state.timeBase = max(state.timeBase + 1, SecondsSinceBase());
+      state.sequence = 0;
+      EncodeBase(state);
+    }
+
+    FixedId id;
+    size_t prefixLength = strlen(_prefix);
+    if (prefixLength > (size_t) (FixedId::CAPACITY - SHARD_DIGITS - TIME_DIGITS - SEQUENCE_DIGITS)) {
+      throw invalid_argument("id prefix too long: " + string(_prefix));
+    }
+    memcpy(id.chars, _prefix, prefixLength);
+    char* cursor = id.chars + prefixLength;
+    memcpy(cursor, state.base, SHARD_DIGITS + TIME_DIGITS);
+    Encode(cursor + SHARD_DIGITS + TIME_DIGITS, state.sequence++, SEQUENCE_DIGITS);
+    id.length = (uint8_t) (prefixLength + SHARD_DIGITS + TIME_DIGITS + SEQUENCE_DIGITS);
+    return id;
+  };
+
+private:
+  static const uint64_t SEQUENCE_LIMIT = 36ULL * 36 * 36 * 36 * 36;
+  static const uint64_t SHARD_LIMIT = 36 * 36;
+  static const long long EPOCH_SECONDS = 1577836800LL; // 2020-01-01 00:00:00 UTC
+
+  struct ThreadState
+  {
+    uint64_t shard;
+    uint64_t timeBase;
+    uint64_t sequence;
+    char base[SHARD_DIGITS + TIME_DIGITS]; // encoded shard and time base
+  };
+
+  static ThreadState& GetThreadState()
+  {
+    static atomic<uint64_t> nextShard((uint64_t) getpid() % SHARD_LIMIT);
+    thread_local ThreadState state = NewThreadState(nextShard.fetch_add(1, memory_order_relaxed) % SHARD_LIMIT);
+    return state;
+  };
+
+  static ThreadState NewThreadState(uint64_t _shard)
+  {
+    ThreadState state{_shard, SecondsSinceBase(), 0, {}};
+    EncodeBase(state);
+    return state;
+  };
+
+  static void EncodeBase(ThreadState& _state)
+  {
+    Encode(_state.base, _state.shard, SHARD_DIGITS);
+    Encode(_state.base + SHARD_DIGITS, _state.timeBase, TIME_DIGITS);
+  };
+
+  static uint64_t SecondsSinceBase()
+  {
+    long long seconds = chrono::duration_cast<chrono::seconds>(chrono::system_clock::now().time_since_epoch()).count();
+    return (uint64_t) (seconds - EPOCH_SECONDS);
+  };
+
+  // write _value as _digits base-36 characters, most significant first
+  static void Encode(char* _out, uint64_t _value, int _digits)
+  {
+    static const char DIGITS[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+    for (int i = _digits - 1; i >= 0; --i) {
+      _out[i] = DIGITS[_value % 36];
+      _value /= 36;
+    }
+  };
+
+};
+
+#endif
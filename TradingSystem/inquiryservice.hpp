@@ -10,6 +10,7 @@
 
 #include "soa.hpp"
 #include "tradebookingservice.hpp"
+#include "checkpoint.hpp"
 #include "functions.hpp"
 
 // Various inqyury states
@@ -27,11 +28,11 @@ public:
 
   // ctor for an inquiry
   Inquiry() = default;
-  Inquiry(string _inquiryId, const T& _product, Side _side, long _quantity, double _price, InquiryState _state) : 
+  Inquiry(const FixedId& _inquiryId, const T& _product, Side _side, long _quantity, double _price, InquiryState _state) : 
     inquiryId(_inquiryId), product(_product), side(_side), quantity(_quantity), price(_price), state(_state) {}
   
   // Get the inquiry ID
-  const string& GetInquiryId() const { return inquiryId; };
+  const FixedId& GetInquiryId() const { return inquiryId; };
 
   // Get the product
   const T& GetProduct() const { return product; };
@@ -57,7 +58,7 @@ public:
   // object printer
   template<typename U>
   friend ostream& operator<<(ostream& os, const Inquiry<U>& inquiry) {
-    string inquiryId = inquiry.GetInquiryId();
+    string inquiryId = inquiry.GetInquiryId().ToString();
     T product = inquiry.GetProduct();
     string productId = product.GetProductId();
     string side = inquiry.GetSide() == BID ? "BID" : "OFFER";
@@ -88,7 +89,7 @@ public:
   };
 
 private:
-  string inquiryId;
+  FixedId inquiryId;
   T product;
   Side side;
   long quantity;
@@ -98,6 +99,20 @@ private:
 };
 
 
+/**
+ * Checkpointed inquiry.
+ */
+struct InquiryRecord
+{
+  FixedId inquiryId;
+  int productIndex;
+  uint8_t side; // Side
+  uint8_t state; // InquiryState
+  long quantity;
+  double price;
+};
+
+
 // forward declaration of connector and inquiry listener
 template<typename T>
 class InquiryConnector;
@@ -128,7 +143,7 @@ public:
   // The callback that a Connector should invoke for any new or updated data
   void OnMessage(Inquiry<T>& data) {
     InquiryState state = data.GetState();
-    string inquiryId = data.GetInquiryId();
+    string inquiryId = data.GetInquiryId().ToString();
 
     if (state == RECEIVED) {
         // If inquiry is received, send back a quote to the connector via publish()
@@ -146,11 +161,11 @@ public:
 
     // If inquiry is done, remove it from the map
     if (data.GetState() == DONE) {
-        inquirys.erase(data.GetInquiryId());
+        inquirys.erase(inquiryId);
     }
     // Otherwise, update the inquiry
     else {
-        inquirys[data.GetInquiryId()] = data;
+        inquirys[inquiryId] = data;
     }
 
     for (auto& listener : listeners) {
@@ -182,6 +197,39 @@ public:
     }
   };
 
+  // Add the open inquiries to a checkpoint
+  void SaveCheckpoint(CheckpointWriter& _writer)
+  {
+    vector<InquiryRecord> records;
+    for (auto& item : inquirys) {
+      const Inquiry<T>& inquiry = item.second;
+      records.push_back(InquiryRecord{inquiry.GetInquiryId(), getProductIndex(inquiry.GetProduct().GetProductId()), (uint8_t) inquiry.GetSide(),
+        (uint8_t) inquiry.GetState(), inquiry.GetQuantity(), inquiry.GetPrice()});
+    }
+    _writer.AddSection(CHECKPOINT_INQUIRIES, records.data(), records.size());
+  };
+
+  // Restore the open inquiries from a checkpoint without flowing them to the listeners, false if it has none
+  bool RestoreCheckpoint(const CheckpointReader& _reader)
+  {
+    size_t count;
+    const InquiryRecord* records = _reader.GetSection<InquiryRecord>(CHECKPOINT_INQUIRIES, count);
+    if (!records) return false;
+    for (size_t r = 0; r < count; ++r) {
+      if (!isProductIndex(records[r].productIndex)) {
+        logger(LogType::ERROR, "Inquiry checkpoint holds an unknown product index " + to_string(records[r].productIndex));
+        return false;
+      }
+    }
+    for (size_t r = 0; r < count; ++r) {
+      const InquiryRecord& record = records[r];
+      Inquiry<T> inquiry(record.inquiryId, getProductObject<T>(PRODUCT_CUSIPS[record.productIndex]), (Side) record.side, record.quantity,
+        record.price, (InquiryState) record.state);
+      inquirys.insert_or_assign(record.inquiryId.ToString(), inquiry);
+    }
+    return true;
+  };
+
   // Reject an inquiry from the client
   void RejectInquiry(const string &inquiryId) {
     Inquiry<T>& inquiry = inquirys[inquiryId];
@@ -226,6 +274,7 @@ public:
   // Subscribe data from connector
   void Subscribe(ifstream& _data) override {
     string line;
+    size_t badLines = 0;
     while (getline(_data, line)) {
       // Parse the line into attributes
       vector<string> lineVec;
@@ -234,9 +283,14 @@ public:
       while (getline(ss, attribute, ',')) {
           lineVec.push_back(attribute);
       }
+      // inquiry IDs are fixed-size IDs
+      if (lineVec.size() != 6 || lineVec[0].empty() || lineVec[0].size() > (size_t) FixedId::CAPACITY) {
+        badLines++;
+        continue;
+      }
 
       // Create and populate an Inquiry object
-      string inquiryId = lineVec[0];
+      FixedId inquiryId(lineVec[0]);
       string productId = lineVec[1];
       T product = getProductObject<T>(productId);
       Side side = lineVec[2] == "BUY" ? BUY : SELL;
@@ -252,6 +306,7 @@ public:
       // Pass the inquiry object to the service
       service->OnMessage(inquiry);
     }
+    if (badLines > 0) logger(LogType::ERROR, "Skipped " + to_string(badLines) + " malformed inquiry lines");
   };
 };
 
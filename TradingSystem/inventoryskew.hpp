@@ -0,0 +1,148 @@
+/**
+ * inventoryskew.hpp
+ * Precomputed per-product inventory snapshot used to skew streamed quotes.
+ *
+ * @author Yicheng Sun
+ */
+
+#ifndef INVENTORY_SKEW_HPP
+#define INVENTORY_SKEW_HPP
+
+#include <algorithm>
+#include "soa.hpp"
+#include "seqlock.hpp"
+#include "riskservice.hpp"
+#include "functions.hpp"
+
+/**
+ * Quote skew of one product, precomputed from its aggregate position and PV01.
+ * A long position lowers both sides of the two-way price and shows more size on the offer.
+ */
+struct QuoteSkew
+{
+  long position;
+  double pv01;
+  double priceShift;
+  double bidSizeScale;
+  double offerSizeScale;
+};
+
+
+/**
+ * Inventory snapshot for every product.
+ * The position/risk thread recomputes a product's skew whenever its position or PV01
+ * changes and publishes it through a seqlock slot, so the quote path reads it by
+ * product index without map lookups, aggregation or locks.
+ */
+class InventoryBook
+{
+
+public:
+  // ctor
+  // _skewPerDollarPV01: price shift per dollar of position PV01
+  // _maxPriceSkew: cap of the price shift
+  // _sizeRiskScale: dollar PV01 at which the size skew reaches its cap
+  // _maxSizeSkew: cap of the size scale adjustment (0.5 means 50% more/less size)
+  InventoryBook(double _skewPerDollarPV01 = 1.0 / 256.0 / 1000.0, double _maxPriceSkew = 1.0 / 64.0, double _sizeRiskScale = 10000.0, double _maxSizeSkew = 0.5) :
+    skewPerDollarPV01(_skewPerDollarPV01), maxPriceSkew(_maxPriceSkew), sizeRiskScale(_sizeRiskScale), maxSizeSkew(_maxSizeSkew)
+  {
+    for (int i = 0; i < NUM_PRODUCTS; ++i) {
+      positions[i] = 0;
+      pv01s[i] = 0.0;
+      Recompute(i);
+    }
+  };
+
+  // Update the aggregate position of a product (writer thread)
+  void UpdatePosition(int _index, long _position)
+  {
+    positions[_index] = _position;
+    Recompute(_index);
+  };
+
+  // Update the PV01 of a product (writer thread)
+  void UpdatePV01(int _index, double _pv01)
+  {
+    pv01s[_index] = _pv01;
+    Recompute(_index);
+  };
+
+  // Get the current skew of a product, safe from any thread
+  QuoteSkew GetSkew(int _index) const { return skews[_index].Load(); };
+
+private:
+  // recompute and publish the skew of a product
+  void Recompute(int _index)
+  {
+    // pv01 is quoted per 100 face
+    double dollarPV01 = positions[_index] / 100.0 * pv01s[_index];
+    double priceShift = clamp(-dollarPV01 * skewPerDollarPV01, -maxPriceSkew, maxPriceSkew);
+    double sizeSkew = clamp(dollarPV01 / sizeRiskScale, -maxSizeSkew, maxSizeSkew);
+    skews[_index].Store(QuoteSkew{positions[_index], pv01s[_index], priceShift, 1.0 - sizeSkew, 1.0 + sizeSkew});
+  };
+
+  double skewPerDollarPV01;
+  double maxPriceSkew;
+  double sizeRiskScale;
+  double maxSizeSkew;
+  long positions[NUM_PRODUCTS];
+  double pv01s[NUM_PRODUCTS];
+  SeqLock<QuoteSkew> skews[NUM_PRODUCTS];
+
+};
+
+
+/**
+* Inventory Position Listener subscribing positions from Position Service to the inventory book.
+* Type T is the product type.
+*/
+template<typename T>
+class InventoryPositionListener : public ServiceListener<Position<T>>
+{
+
+public:
+  // ctor
+  InventoryPositionListener(InventoryBook* _book) : book(_book) {};
+
+  // Listener callback to process an add event to the Service
+  void ProcessAdd(Position<T>& _data) override { book -> UpdatePosition(_data.GetProductIndex(), _data.GetAggregatePosition()); };
+
+  // Listener callback to process a remove event to the Service
+  void ProcessRemove(Position<T>& _data) override {};
+
+  // Listener callback to process an update event to the Service
+  void ProcessUpdate(Position<T>& _data) override {};
+
+private:
+  InventoryBook* book;
+
+};
+
+
+/**
+* Inventory Risk Listener subscribing PV01 from Risk Service to the inventory book.
+* Type T is the product type.
+*/
+template<typename T>
+class InventoryRiskListener : public ServiceListener<PV01<T>>
+{
+
+public:
+  // ctor
+  InventoryRiskListener(InventoryBook* _book) : book(_book) {};
+
+  // Listener callback to process an add event to the Service
+  void ProcessAdd(PV01<T>& _data) override { book -> UpdatePV01(_data.GetProductIndex(), _data.GetPV01()); };
+
+  // Listener callback to process a remove event to the Service
+  void ProcessRemove(PV01<T>& _data) override {};
+
+  // Listener callback to process an update event to the Service
+  void ProcessUpdate(PV01<T>& _data) override {};
+
+private:
+  InventoryBook* book;
+
+};
+
+#endif
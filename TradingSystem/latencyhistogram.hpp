@@ -0,0 +1,116 @@
+/**
+ * latencyhistogram.hpp
+ * Fixed-size log-linear latency histogram.
+ *
+ * @author Yicheng Sun
+ */
+
+#ifndef LATENCY_HISTOGRAM_HPP
+#define LATENCY_HISTOGRAM_HPP
+
+#include <string>
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+
+using namespace std;
+
+/**
+ * Histogram of latencies in nanoseconds with 16 linear sub-buckets per power of two,
+ * so any recorded value is reported within about 6% of its true value.
+ * Recording is O(1) and never allocates; percentiles scan the buckets.
+ * Single writer, not thread-safe.
+ */
+class LatencyHistogram
+{
+
+public:
+  // ctor
+  LatencyHistogram() { Reset(); };
+
+  // Clear all recorded values
+  void Reset()
+  {
+    fill(counts, counts + BUCKETS, 0);
+    count = 0;
+    sum = 0;
+    minimum = UINT64_MAX;
+    maximum = 0;
+  };
+
+  // Record one latency, negative values count as zero
+  void Record(int64_t _nanos)
+  {
+    uint64_t value = _nanos > 0 ? (uint64_t) _nanos : 0;
+    counts[BucketOf(value)]++;
+    count++;
+    sum += value;
+    minimum = min(minimum, value);
+    maximum = max(maximum, value);
+  };
+
+  // Get the number of recorded values
+  uint64_t GetCount() const { return count; };
+
+  // Get the mean in nanoseconds
+  double GetMean() const { return count ? (double) sum / count : 0.0; };
+
+  // Get the smallest and largest recorded values
+  uint64_t GetMin() const { return count ? minimum : 0; };
+  uint64_t GetMax() const { return maximum; };
+
+  // Get the value at percentile _p (0 to 100), reported as the upper edge of its bucket
+  uint64_t GetPercentile(double _p) const
+  {
+    if (count == 0) return 0;
+    uint64_t rank = (uint64_t) (_p / 100.0 * count + 0.5);
+    rank = max<uint64_t>(1, min(rank, count));
+    uint64_t seen = 0;
+    for (int b = 0; b < BUCKETS; ++b) {
+      seen += counts[b];
+      if (seen >= rank) return min(UpperEdge(b), maximum);
+    }
+    return maximum;
+  };
+
+  // One-line summary in microseconds, for the logs
+  string Summary() const
+  {
+    char line[160];
+    snprintf(line, sizeof(line), "count %llu, mean %.2fus, p50 %.2fus, p99 %.2fus, p99.9 %.2fus, max %.2fus",
+      (unsigned long long) count, GetMean() / 1000.0, GetPercentile(50) / 1000.0, GetPercentile(99) / 1000.0,
+      GetPercentile(99.9) / 1000.0, GetMax() / 1000.0);
+    return string(line);
+  };
+
+private:
+  static const int SUB_BITS = 4;
+  static const int SUB_BUCKETS = 1 << SUB_BITS;
+  static const int BUCKETS = 64 * SUB_BUCKETS;
+
+  // values below 16 get a bucket each; above, the top 4 bits after the leading one pick the sub-bucket
+  static int BucketOf(uint64_t _value)
+  {
+    if (_value < (uint64_t) SUB_BUCKETS) return (int) _value;
+    int exponent = 63 - __builtin_clzll(_value);
+    int sub = (int) ((_value >> (exponent - SUB_BITS)) & (SUB_BUCKETS - 1));
+    return (exponent - SUB_BITS + 1) * SUB_BUCKETS + sub;
+  };
+
+  static uint64_t UpperEdge(int _bucket)
+  {
+    if (_bucket < SUB_BUCKETS) return (uint64_t) _bucket;
+    int exponent = _bucket / SUB_BUCKETS + SUB_BITS - 1;
+    uint64_t sub = (uint64_t) (_bucket % SUB_BUCKETS);
+    return ((SUB_BUCKETS + sub + 1) << (exponent - SUB_BITS)) - 1;
+  };
+
+  uint64_t counts[BUCKETS];
+  uint64_t count;
+  uint64_t sum;
+  uint64_t minimum;
+  uint64_t maximum;
+
+};
+
+#endif
@@ -24,7 +24,10 @@
 #include "algostreamingservice.hpp"
 #include "tradebookingservice.hpp"
 #include "algoexecutionservice.hpp"
+#include "ticktotrade.hpp"
 #include "guiservice.hpp"
+#include "checkpoint.hpp"
+#include "scenarioengine.hpp"
 #include "datagen.hpp"
 #include "functions.hpp"
 
@@ -34,28 +37,37 @@ int main(){
 
 	// 1. generate data files for tradingsystem
 	string dataDir = "../data";
-	if (filesystem::exists(dataDir)) {
-		filesystem::remove_all(dataDir);
-	}
-	filesystem::create_directory(dataDir);
-
 	const string pricePath = dataDir + "/prices.txt";
 	const string marketdataPath = dataDir + "/marketdata.txt";
 	const string tradePath = dataDir + "/trades.txt";
 	const string inquiryPath = dataDir + "/inquiries.txt";
-	
-    // bonds tickers
-    vector<string> bonds = {"9128283H1", "9128283L2", "912828M80", "9128283J7", "9128283F5", "912810TW8", "912810RZ3"};
-	
-	logger(LogType::INFO, "Generating price data...");
-    genPrices(bonds, pricePath, 42, 1000);
-	logger(LogType::INFO, "Generating orderbook data...");
-	genOrderBooks(bonds, marketdataPath, 42, 10000);
-    logger(LogType::INFO, "Generating trade data...");
-	genTrades(bonds, tradePath, 42);
-    logger(LogType::INFO, "Generating inquiry data...");
-	genInquiries(bonds, inquiryPath, 42);
-    logger(LogType::INFO, "All data generated.");
+	const string checkpointPath = dataDir + "/checkpoint.bin";
+
+	// a checkpoint is only left behind by a run that did not finish: recover it instead of starting over
+	CheckpointReader checkpoint;
+	bool recovering = checkpoint.Open(checkpointPath);
+	if (recovering) {
+		logger(LogType::INFO, "Found checkpoint of an unfinished run after " + to_string(checkpoint.GetStage()) + " data flows, keeping data files.");
+	}
+	else {
+		if (filesystem::exists(dataDir)) {
+			filesystem::remove_all(dataDir);
+		}
+		filesystem::create_directory(dataDir);
+
+		// bonds tickers
+		vector<string> bonds = {"9128283H1", "9128283L2", "912828M80", "9128283J7", "9128283F5", "912810TW8", "912810RZ3"};
+
+		logger(LogType::INFO, "Generating price data...");
+		genPrices(bonds, pricePath, 42, 1000);
+		logger(LogType::INFO, "Generating orderbook data...");
+		genOrderBooks(bonds, marketdataPath, 42, 10000);
+		logger(LogType::INFO, "Generating trade data...");
+		genTrades(bonds, tradePath, 42);
+		logger(LogType::INFO, "Generating inquiry data...");
+		genInquiries(bonds, inquiryPath, 42);
+		logger(LogType::INFO, "All data generated.");
+	}
 
 
     // 2. start trading service
@@ -79,47 +91,265 @@ int main(){
 	HistoricalDataService<Inquiry<Bond>> historicalInquiryService(INQUIRY);
 	logger(LogType::INFO, "Trading system services initialized.");
 
+	// pre-trade risk gate, fat-finger band of one point around the book mid
+	RiskLimits riskLimits;
+	riskLimits.priceBand = 1.0;
+	PreTradeRiskGate riskGate(riskLimits);
+	PreTradeRiskPositionListener riskPositionListener(&riskGate);
+	PreTradeRiskPV01Listener<Bond> riskPV01Listener(&riskGate);
+	PreTradeRiskReportListener riskReportListener(&riskGate);
+
+	// scenario risk of the positions, rerun on every change of risk
+	// parallel shifts of -100bp to +100bp, 2Y/30Y twists of -50bp to +50bp and key-rate bumps of -100bp to +100bp
+	ScenarioEngine scenarioEngine(&positionService.GetPositionMatrix());
+	for (int bp = -100; bp <= 100; ++bp) scenarioEngine.AddParallelShift(bp);
+	for (int shortBp = -50; shortBp <= 50; shortBp += 5) {
+		for (int longBp = -50; longBp <= 50; longBp += 5) {
+			if (shortBp != longBp) scenarioEngine.AddTwist(shortBp, longBp);
+		}
+	}
+	for (int p = 0; p < NUM_PRODUCTS; ++p) {
+		for (int bp = -100; bp <= 100; ++bp) {
+			if (bp != 0) scenarioEngine.AddKeyRate(p, bp);
+		}
+	}
+	ScenarioRiskListener<Bond> scenarioRiskListener(&scenarioEngine);
+
 	logger(LogType::INFO, "Linking service listeners...");
 	pricingService.AddListener(algoStreamingService.GetAlgoStreamingListener());
 	pricingService.AddListener(guiService.GetGUIServiceListener());
+	// PV01 is recomputed from the live mid whenever it moves
+	pricingService.AddListener(riskService.GetRiskPricingListener());
 	algoStreamingService.AddListener(streamingService.GetStreamingServiceListener());
-	marketDataService.AddListener(algoExecutionService.GetAlgoExecutionServiceListener());
+	marketDataService.AddListener(pricingService.GetCompositePricingListener());
+	// books go from the market data connector to the exchanges, the risk gate, the algo and out as orders in one call
+	TickToTradePath<Bond> tickToTrade(&algoExecutionService, &executionService, &riskGate);
+	marketDataService.GetConnector() -> SetTickHandler(&tickToTrade);
 	algoExecutionService.AddListener(executionService.GetExecutionServiceListener());
-	executionService.AddListener(tradeBookingService.GetTradeBookingServiceListener());
+	// child slices of parent orders hear back their fills and cancels
+	executionService.SetAlgoExecutionService(&algoExecutionService);
+	// trades are booked from exchange fills
+	executionService.AddReportListener(tradeBookingService.GetTradeBookingFillListener());
 	tradeBookingService.AddListener(positionService.GetPositionListener());
-	positionService.AddListener(riskService.GetRiskServiceListener());
+	tradeBookingService.AddBatchListener(positionService.GetPositionBatchListener());
+	positionService.AddDeltaListener(riskService.GetRiskServiceListener());
+	// recompute risk from the positions now and then to check the deltas kept it in line
+	riskService.SetReconciliation(&positionService.GetPositionMatrix(), 1000);
+	// fills and trades move positions in bursts: publish once per product every 100 trades or 1ms
+	positionService.SetEpoch(100, 1000000);
 	// link to historicaldata service
 	positionService.AddListener(historicalPositionService.GetHistoricalDataServiceListener());
 	executionService.AddListener(historicalExecutionService.GetHistoricalDataServiceListener());
 	streamingService.AddListener(historicalStreamingService.GetHistoricalDataServiceListener());
 	riskService.AddListener(historicalRiskService.GetHistoricalDataServiceListener());
 	inquiryService.AddListener(historicalInquiryService.GetHistoricalDataServiceListener());
+	// skew streamed quotes by inventory
+	InventoryBook inventoryBook;
+	InventoryPositionListener<Bond> inventoryPositionListener(&inventoryBook);
+	InventoryRiskListener<Bond> inventoryRiskListener(&inventoryBook);
+	positionService.AddListener(&inventoryPositionListener);
+	riskService.AddListener(&inventoryRiskListener);
+	algoStreamingService.SetInventorySkew(&inventoryBook);
+	// pre-trade risk gate between algo execution and execution
+	positionService.AddTradeDeltaListener(&riskPositionListener);
+	riskService.AddListener(&riskPV01Listener);
+	riskService.AddListener(&scenarioRiskListener);
+	executionService.AddReportListener(&riskReportListener);
+	executionService.SetRiskGate(&riskGate);
 	logger(LogType::INFO, "Service listeners linked.");
 
+	// GUI prices also go to shared memory for external viewers (see guiviewer)
+	guiService.GetConnector() -> SetOutputMode(GUI_FILE_AND_SHARED_MEMORY);
+
+	// execute orders on local simulated exchanges, split across them by the smart order router
+	// venue: share of the displayed depth, fee per 100 face, one-way latency
+	VenueConfig venues[] = {{BROKERTEC, 0.5, 0.0005, 20000}, {ESPEED, 0.3, 0.0004, 35000}, {CME, 0.2, 0.0008, 50000}};
+	ExchangeSimulator brokertec(BROKERTEC, venues[0].latencyNanos), espeed(ESPEED, venues[1].latencyNanos), cme(CME, venues[2].latencyNanos);
+	SmartOrderRouter router(0.00001);
+	int venue = 0;
+	for (ExchangeSimulator* exchange : {&brokertec, &espeed, &cme}) {
+		if (exchange -> Start()) {
+			router.AddVenue(venues[venue], exchange);
+			executionService.GetConnector() -> SetExchange(exchange -> GetMarket(), exchange);
+		}
+		venue++;
+	}
+	tickToTrade.SetRouter(&router);
+	executionService.SetRouter(&router);
+
+	// publish quotes through an async batched writer instead of stdout
+	AsyncRecordWriter<PriceStreamUpdate> quotePublisher(FormatPriceStreamUpdate);
+	if (quotePublisher.Open(FILE_TARGET, dataDir + "/quotes.txt")) {
+		quotePublisher.Start();
+		streamingService.GetConnector() -> SetPublisher(&quotePublisher);
+	}
 
-	// 3. start trading system data flows
+	// orders and exchange reports go to a binary execution log, read it with executionlogdecoder
+	AsyncRecordWriter<ExecutionLogRecord> executionLog(WriteExecutionLogRecord, 1 << 16, 1 << 16, sizeof(ExecutionLogRecord));
+	if (executionLog.Open(FILE_TARGET, dataDir + "/executions.bin")) {
+		executionLog.Start();
+		executionService.SetExecutionLog(&executionLog);
+	}
+
+	// booked trades go to a memory-mapped journal instead of an in-memory map
+	TradeJournal tradeJournal;
+	if (tradeJournal.Open(dataDir + "/tradejournal")) {
+		tradeBookingService.SetJournal(&tradeJournal);
+	}
+	// a trade ID booked twice, e.g. a replayed fill or trades file, is only booked once
+	TradeIdFilter tradeIds(1 << 16);
+	tradeBookingService.SetTradeIdFilter(&tradeIds);
+
+
+	// 3. restore the services from the checkpoint, skipping the data flows it covers
+	uint32_t completedFlows = 0;
+	if (recovering) {
+		long long start = getSteadyNanos();
+		bool restored = pricingService.RestoreCheckpoint(checkpoint) && marketDataService.RestoreCheckpoint(checkpoint)
+			&& positionService.RestoreCheckpoint(checkpoint) && riskService.RestoreCheckpoint(checkpoint) && executionService.RestoreCheckpoint(checkpoint)
+			&& tradeBookingService.RestoreCheckpoint(checkpoint) && inquiryService.RestoreCheckpoint(checkpoint);
+		if (!restored) {
+			logger(LogType::ERROR, "Checkpoint is incomplete, remove " + checkpointPath + " to start over.");
+			return 1;
+		}
+		// the risk consumers start cold: value the products at the restored mids, then give them the positions and PV01
+		double mids[NUM_PRODUCTS];
+		for (int p = 0; p < NUM_PRODUCTS; ++p) {
+			PriceSnapshot price;
+			mids[p] = pricingService.GetLatestPrice(p, price) ? price.mid : 0.0;
+		}
+		riskService.RestorePrices(mids);
+		const PositionMatrix& positions = positionService.GetPositionMatrix();
+		for (int p = 0; p < NUM_PRODUCTS; ++p) {
+			double pv01 = riskService.GetData(PRODUCT_CUSIPS[p]).GetPV01();
+			for (int b = 0; b < MAX_BOOKS; ++b) {
+				if (positions.IsBookUsed(p, b)) riskGate.UpdateBookPosition(p, b, positions.Get(p, b), positions.GetProductTotal(p));
+			}
+			riskGate.UpdatePV01(p, pv01);
+			if (mids[p] > 0.0) riskGate.UpdateBook(p, mids[p], mids[p]);
+			inventoryBook.UpdatePosition(p, positions.GetProductTotal(p));
+			inventoryBook.UpdatePV01(p, pv01);
+			scenarioEngine.SetPV01(p, pv01);
+		}
+		scenarioEngine.Run();
+		completedFlows = checkpoint.GetStage();
+		logger(LogType::INFO, "Restored " + to_string(checkpoint.GetBytes()) + " bytes of checkpoint in " + to_string((getSteadyNanos() - start) / 1000) + "us.");
+		checkpoint.Close();
+	}
+
+	// checkpoint every service after each data flow
+	auto writeCheckpoint = [&](uint32_t _flows) {
+		long long start = getSteadyNanos();
+		CheckpointWriter writer(_flows);
+		pricingService.SaveCheckpoint(writer);
+		marketDataService.SaveCheckpoint(writer);
+		positionService.SaveCheckpoint(writer);
+		riskService.SaveCheckpoint(writer);
+		executionService.SaveCheckpoint(writer);
+		tradeBookingService.SaveCheckpoint(writer);
+		inquiryService.SaveCheckpoint(writer);
+		if (tradeBookingService.GetJournal()) tradeBookingService.GetJournal() -> Sync();
+		if (writer.Write(checkpointPath)) {
+			logger(LogType::INFO, "Checkpoint of " + to_string(writer.GetBytes()) + " bytes written in " + to_string((getSteadyNanos() - start) / 1000) + "us.");
+		}
+	};
+
+
+	// 4. start trading system data flows
 	cout << fixed << setprecision(6);
-    logger(LogType::INFO, "Processing price data...");
-	ifstream priceData(pricePath);
-	pricingService.GetConnector() -> Subscribe(priceData);
-	logger(LogType::INFO, "Price data completed.");
-
-	logger(LogType::INFO, "Processing market data...");
-	ifstream marketData(marketdataPath);
-	marketDataService.GetConnector() -> Subscribe(marketData);
-	logger(LogType::INFO, "Market data completed.");
-
-	logger(LogType::INFO, "Processing trade data...");
-	ifstream tradeData(tradePath);
-	tradeBookingService.GetConnector() -> Subscribe(tradeData);
-	logger(LogType::INFO, "Trade data completed.");
-
-	logger(LogType::INFO, "Processing inquiry data...");
-	ifstream inquiryData(inquiryPath);
-	inquiryService.GetConnector() -> Subscribe(inquiryData);
-	logger(LogType::INFO, "Inquiry data completed.");
+	if (completedFlows < 1) {
+		logger(LogType::INFO, "Processing price data...");
+		ifstream priceData(pricePath);
+		pricingService.GetConnector() -> Subscribe(priceData);
+		guiService.FlushPending();
+		// detach the publisher before stopping it, nothing may be enqueued once its thread is gone
+		streamingService.GetConnector() -> SetPublisher(nullptr);
+		quotePublisher.Stop();
+		logger(LogType::INFO, "Price data completed.");
+		logger(LogType::INFO, "Quotes written: " + to_string(quotePublisher.GetWrittenCount()) + " in " + to_string(quotePublisher.GetBatchCount()) + " batches.");
+		logger(LogType::INFO, "Price streams published: " + to_string(streamingService.GetPublishedCount()) + ", suppressed as unchanged: " + to_string(streamingService.GetSuppressedCount()) + " (ratio " + to_string(streamingService.GetSuppressionRatio()) + ").");
+		const BondAnalytics& analytics = riskService.GetAnalytics();
+		logger(LogType::INFO, "Bond analytics solves: " + to_string(analytics.GetSolveCount()) + ", unchanged prices skipped: " + to_string(analytics.GetSkippedCount()) + ", failed: " + to_string(analytics.GetFailedCount()) + ", solve latency: " + analytics.GetLatency().Summary());
+		for (int p = 0; p < NUM_PRODUCTS; ++p) {
+			logger(LogType::INFO, "Bond " + PRODUCT_CUSIPS[p] + ": yield " + to_string(analytics.GetYield(p)) + ", PV01 " + to_string(analytics.GetPV01(p)) + ", modified duration " + to_string(analytics.GetModifiedDuration(p)));
+		}
+		writeCheckpoint(1);
+	}
+
+	if (completedFlows < 2) {
+		logger(LogType::INFO, "Processing market data...");
+		// parent orders sliced along the market data: TWAP and VWAP over 100ms, iceberg in 1M clips
+		vector<ParentHandle> parentOrders = {
+			algoExecutionService.SubmitParentOrder(getProductObject<Bond>("9128283H1"), BID, 10000000, TWAP, 100, 10),
+			algoExecutionService.SubmitParentOrder(getProductObject<Bond>("912828M80"), OFFER, 10000000, VWAP, 100, 10),
+			algoExecutionService.SubmitParentOrder(getProductObject<Bond>("912810RZ3"), BID, 10000000, ICEBERG, 0, 1, 1000000)};
+		ifstream marketData(marketdataPath);
+		marketDataService.GetConnector() -> Subscribe(marketData);
+		// release the slices still due on the last books, then give up on what the market left
+		long long slicingDeadline = getSteadyNanos() + 200000000;
+		while (algoExecutionService.GetSlicingEngine().GetActiveCount() > 0 && getSteadyNanos() < slicingDeadline) {
+			algoExecutionService.PollSlicing();
+			executionService.PollExchanges();
+		}
+		executionService.FlushExchanges();
+		for (ParentHandle parentOrder : parentOrders) algoExecutionService.CancelParentOrder(parentOrder);
+		positionService.FlushEpoch();
+		executionService.SetExecutionLog(nullptr);
+		executionLog.Stop();
+		logger(LogType::INFO, "Market data completed.");
+		logger(LogType::INFO, "Execution log records written: " + to_string(executionLog.GetWrittenCount()) + " in " + to_string(executionLog.GetBatchCount()) + " batches.");
+		logger(LogType::INFO, "Exchange fills: " + to_string(brokertec.GetFillCount() + espeed.GetFillCount() + cme.GetFillCount()) + " for " + to_string(brokertec.GetMatchedCount() + espeed.GetMatchedCount() + cme.GetMatchedCount()) + " orders.");
+		logger(LogType::INFO, "Live orders: " + to_string(executionService.GetOrderStore().GetLiveCount()) + " in " + to_string(executionService.GetOrderStore().GetCapacity()) + " slots.");
+		logger(LogType::INFO, "Pre-trade risk checks: " + to_string(riskGate.GetCheckedCount()) + ", rejected: " + to_string(riskGate.GetRejectedCount()) + ", check latency: " + riskGate.GetLatency().Summary());
+		logger(LogType::INFO, "Tick to trade latency: " + tickToTrade.GetLatency().Summary());
+		logger(LogType::INFO, "Routed orders: " + to_string(router.GetRoutedCount()) + ", routing latency: " + router.GetLatency().Summary());
+		const string marketNames[] = {"BROKERTEC", "ESPEED", "CME"};
+		for (int v = 0; v < router.GetVenueCount(); ++v) {
+			logger(LogType::INFO, "Routed to " + marketNames[router.GetVenue(v).market] + ": " + to_string(router.GetRoutedQuantity(v)));
+		}
+		const SlicingEngine& slicer = algoExecutionService.GetSlicingEngine();
+		logger(LogType::INFO, "Parent orders filled: " + to_string(slicer.GetCompletedCount()) + " of " + to_string(parentOrders.size()) + ", child slices: " + to_string(slicer.GetChildCount()) + ", filled quantity: " + to_string(slicer.GetFilledQuantity()));
+		logger(LogType::INFO, "Order to ack latency: " + executionService.GetConnector() -> GetAckLatency().Summary());
+		logger(LogType::INFO, "Order to fill latency: " + executionService.GetConnector() -> GetFillLatency().Summary());
+		writeCheckpoint(2);
+	}
+
+	if (completedFlows < 3) {
+		// the trades file is loaded in bulk: parsed in parallel, positions and risk published once per product
+		logger(LogType::INFO, "Processing trade data...");
+		long long tradeStart = getSteadyNanos();
+		size_t tradeCount = tradeBookingService.GetConnector() -> BulkLoad(tradePath);
+		logger(LogType::INFO, "Trade data completed.");
+		logger(LogType::INFO, "Trades bulk loaded: " + to_string(tradeCount) + " in " + to_string((getSteadyNanos() - tradeStart) / 1000) + "us.");
+		tradeJournal.Sync();
+		riskService.Reconcile();
+		logger(LogType::INFO, "Trades coalesced into position epochs: " + to_string(positionService.GetCoalescedCount()));
+		logger(LogType::INFO, "Risk reconciliations: " + to_string(riskService.GetReconcileCount()) + ", mismatches: " + to_string(riskService.GetMismatchCount()));
+		for (int sector = 0; sector < riskService.GetSectorCount(); ++sector) {
+			const PV01<BucketedSector<Bond>>& bucket = riskService.GetBucketedRisk(sector);
+			logger(LogType::INFO, "Bucketed risk " + bucket.GetProduct().GetName() + ": PV01 " + to_string(bucket.GetPV01()) + ", quantity " + to_string(bucket.GetQuantity()));
+		}
+		int worst = scenarioEngine.GetWorstScenario();
+		logger(LogType::INFO, "Risk scenarios: " + to_string(scenarioEngine.GetScenarioCount()) + (scenarioEngine.UsesAvx2() ? " (AVX2)" : "") + ", run latency: " + scenarioEngine.GetLatency().Summary());
+		if (worst >= 0) logger(LogType::INFO, "Worst scenario " + scenarioEngine.GetScenarioName(worst) + ": P&L " + to_string(scenarioEngine.GetPnL(worst)));
+		logger(LogType::INFO, "Duplicate trades rejected: " + to_string(tradeIds.GetDuplicateCount()) + ", trade ID filter: " + to_string(tradeIds.GetMemoryBytes()) + " bytes.");
+		logger(LogType::INFO, "Trades journaled: " + to_string(tradeJournal.GetCount()) + " in " + to_string(tradeJournal.GetSegmentCount()) + " segments.");
+		writeCheckpoint(3);
+	}
+
+	if (completedFlows < 4) {
+		logger(LogType::INFO, "Processing inquiry data...");
+		ifstream inquiryData(inquiryPath);
+		inquiryService.GetConnector() -> Subscribe(inquiryData);
+		logger(LogType::INFO, "Inquiry data completed.");
+	}
 
 	logger(LogType::INFO, "All data flow completed.");
+	// remove the GUI shared-memory segment, viewers keep the prices they have mapped
+	guiService.FlushPending();
+	guiService.GetConnector() -> SetOutputMode(GUI_FILE);
+	// the run finished: the next one starts over
+	filesystem::remove(checkpointPath);
 	logger(LogType::INFO, "Trading system ended.");
 
 	return 0;
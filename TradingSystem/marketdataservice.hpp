@@ -12,6 +12,7 @@
 #include <vector>
 #include <algorithm>
 #include "soa.hpp"
+#include "checkpoint.hpp"
 #include "functions.hpp"
 
 using namespace std;
@@ -19,6 +20,37 @@ using namespace std;
 // Side for market data
 enum PricingSide { BID, OFFER };
 
+const int BOOK_TICK_DEPTH = 5;
+
+/**
+ * Levels of one market data line as decoded, best first, before any book is built.
+ */
+struct BookTick
+{
+  int productIndex;
+  int depth; // number of levels on each side
+  long long receiveNanos; // steady clock, when the line was read
+  double bidPrices[BOOK_TICK_DEPTH];
+  long bidQuantities[BOOK_TICK_DEPTH];
+  double offerPrices[BOOK_TICK_DEPTH];
+  long offerQuantities[BOOK_TICK_DEPTH];
+};
+
+/**
+ * Handler of decoded market data lines, called by the connector ahead of the service.
+ */
+class BookTickHandler
+{
+
+public:
+  // Called with each decoded line before the book is built and published
+  virtual void OnBookTick(const BookTick& _tick) = 0;
+
+  // Called once the service has published the book of the line
+  virtual void OnTickDone() = 0;
+
+};
+
 /**
  * A market data order with price, quantity, and side.
  */
@@ -115,6 +147,21 @@ private:
 };
 
 
+/**
+ * Checkpointed order book of a product, up to BOOK_TICK_DEPTH levels a side in book order.
+ */
+struct OrderBookRecord
+{
+  int productIndex;
+  int bidLevels;
+  int offerLevels;
+  double bidPrices[BOOK_TICK_DEPTH];
+  long bidQuantities[BOOK_TICK_DEPTH];
+  double offerPrices[BOOK_TICK_DEPTH];
+  long offerQuantities[BOOK_TICK_DEPTH];
+};
+
+
 // forward declaration of MarketDataConnector
 template<typename T>
 class MarketDataConnector;
@@ -213,6 +260,56 @@ public:
     return orderBook;
 }
 
+  // Add the order books to a checkpoint
+  void SaveCheckpoint(CheckpointWriter& _writer)
+  {
+    vector<OrderBookRecord> records;
+    for (auto& item : orderBooks) {
+      OrderBookRecord record{};
+      record.productIndex = getProductIndex(item.first);
+      vector<Order>& bidStack = item.second.GetBidStack();
+      vector<Order>& offerStack = item.second.GetOfferStack();
+      record.bidLevels = min((int) bidStack.size(), BOOK_TICK_DEPTH);
+      record.offerLevels = min((int) offerStack.size(), BOOK_TICK_DEPTH);
+      for (int l = 0; l < record.bidLevels; ++l) {
+        record.bidPrices[l] = bidStack[l].GetPrice();
+        record.bidQuantities[l] = bidStack[l].GetQuantity();
+      }
+      for (int l = 0; l < record.offerLevels; ++l) {
+        record.offerPrices[l] = offerStack[l].GetPrice();
+        record.offerQuantities[l] = offerStack[l].GetQuantity();
+      }
+      records.push_back(record);
+    }
+    _writer.AddSection(CHECKPOINT_ORDER_BOOKS, records.data(), records.size());
+  };
+
+  // Restore the order books from a checkpoint without flowing them to the listeners, false if it has none
+  bool RestoreCheckpoint(const CheckpointReader& _reader)
+  {
+    size_t count;
+    const OrderBookRecord* records = _reader.GetSection<OrderBookRecord>(CHECKPOINT_ORDER_BOOKS, count);
+    if (!records) return false;
+    for (size_t r = 0; r < count; ++r) {
+      const OrderBookRecord& record = records[r];
+      if (!isProductIndex(record.productIndex) || record.bidLevels < 0 || record.bidLevels > BOOK_TICK_DEPTH ||
+          record.offerLevels < 0 || record.offerLevels > BOOK_TICK_DEPTH) {
+        logger(LogType::ERROR, "Order book checkpoint holds an unknown product index or too many levels");
+        return false;
+      }
+    }
+    for (size_t r = 0; r < count; ++r) {
+      const OrderBookRecord& record = records[r];
+      vector<Order> bidStack;
+      vector<Order> offerStack;
+      for (int l = 0; l < record.bidLevels; ++l) bidStack.push_back(Order(record.bidPrices[l], record.bidQuantities[l], BID));
+      for (int l = 0; l < record.offerLevels; ++l) offerStack.push_back(Order(record.offerPrices[l], record.offerQuantities[l], OFFER));
+      const string& productId = PRODUCT_CUSIPS[record.productIndex];
+      orderBooks.insert_or_assign(productId, OrderBook<T>(getProductObject<T>(productId), bidStack, offerStack));
+    }
+    return true;
+  };
+
 
 
 private:
@@ -234,11 +331,16 @@ class MarketDataConnector : public Connector<OrderBook<T>>
 private:
   MarketDataService<T>* service;
 
+  BookTickHandler* tickHandler;
+
 public:
   // ctor and dtor
-  MarketDataConnector(MarketDataService<T>* _service) : service(_service) {};
+  MarketDataConnector(MarketDataService<T>* _service) : service(_service), tickHandler(nullptr) {};
   ~MarketDataConnector() = default;
 
+  // Hand every decoded line to _handler ahead of the service
+  void SetTickHandler(BookTickHandler* _handler) { tickHandler = _handler; };
+
   // Publish data to the Connector
   void Publish(OrderBook<T>& _data) override {};
 
@@ -254,39 +356,55 @@ void MarketDataConnector<T>::Subscribe(ifstream& _data)
   string _line;
   getline(_data, _line);
 
+  const int fieldCount = 2 + 4 * BOOK_TICK_DEPTH;
+  const char* fields[fieldCount];
+  size_t lengths[fieldCount];
+  int depth = min(service -> GetBookDepth(), BOOK_TICK_DEPTH);
+  BookTick tick;
   while (getline(_data, _line))
   {
-    vector<string> lineVec;
-    stringstream ss(_line); 
-    string attribute;
-    while (getline(ss, attribute, ','))
+    tick.receiveNanos = getSteadyNanos();
+
+    // split the line in place: timestamp, cusip, then bid, bid size, offer, offer size per level
+    int count = 0;
+    size_t start = 0;
+    while (count < fieldCount && start <= _line.size())
     {
-      lineVec.push_back(attribute);
+      size_t end = _line.find(',', start);
+      if (end == string::npos) end = _line.size();
+      fields[count] = _line.data() + start;
+      lengths[count++] = end - start;
+      start = end + 1;
     }
-    string timestamp = lineVec[0];
-    string productId = lineVec[1];
-    OrderBook<T>& orderBook = service -> GetData(productId);
+    if (count < 2 + 4 * depth) continue;
 
-    string bidPrice, bidQuantity, offerPrice, offerQuantity;
-    Order bidOrder, askOrder;
-    for (int order = 0; order < service -> GetBookDepth(); order++)
+    string productId(fields[1], lengths[1]);
+    tick.productIndex = getProductIndex(productId);
+    tick.depth = depth;
+    for (int level = 0; level < depth; level++)
     {
-      string bidPrice = lineVec[4 * order + 2];
-      string bidQuantity = lineVec[4 * order + 3];
-      string offerPrice = lineVec[4 * order + 4];
-      string offerQuantity = lineVec[4 * order + 5];
-
-      Order bidOrder(convertPrice(bidPrice), stol(bidQuantity), BID);
-      Order askOrder(convertPrice(offerPrice), stol(offerQuantity), OFFER);
+      tick.bidPrices[level] = convertPrice(fields[4 * level + 2], lengths[4 * level + 2]);
+      tick.bidQuantities[level] = strtol(fields[4 * level + 3], nullptr, 10);
+      tick.offerPrices[level] = convertPrice(fields[4 * level + 4], lengths[4 * level + 4]);
+      tick.offerQuantities[level] = strtol(fields[4 * level + 5], nullptr, 10);
+    }
+    if (tickHandler) tickHandler -> OnBookTick(tick);
 
-      orderBook.GetBidStack().push_back(bidOrder);
-      orderBook.GetOfferStack().push_back(askOrder);
+    // the line is a full snapshot of the book: replace the previous levels
+    OrderBook<T>& orderBook = service -> GetData(productId);
+    orderBook.GetBidStack().clear();
+    orderBook.GetOfferStack().clear();
+    for (int level = 0; level < depth; level++)
+    {
+      orderBook.GetBidStack().push_back(Order(tick.bidPrices[level], tick.bidQuantities[level], BID));
+      orderBook.GetOfferStack().push_back(Order(tick.offerPrices[level], tick.offerQuantities[level], OFFER));
     }
 
     // aggregate the order book and match orders
     OrderBook<T> aggOrderBook = service -> AggregateDepth(productId);
     // flow data to the service
     service -> OnMessage(aggOrderBook);
+    if (tickHandler) tickHandler -> OnTickDone();
 
   }
 }
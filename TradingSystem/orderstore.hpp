@@ -0,0 +1,239 @@
+/**
+ * orderstore.hpp
+ * Compact order records and a slot-map store of live orders.
+ *
+ * @author Yicheng Sun
+ */
+
+#ifndef ORDER_STORE_HPP
+#define ORDER_STORE_HPP
+
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include <type_traits>
+#include "idgenerator.hpp"
+
+using namespace std;
+
+// treasury prices trade in 1/256ths
+const int PRICE_TICKS_PER_POINT = 256;
+
+// convert between a price and a whole number of ticks
+int64_t toPriceTicks(double _price) { return llround(_price * PRICE_TICKS_PER_POINT); }
+double fromPriceTicks(int64_t _ticks) { return (double) _ticks / PRICE_TICKS_PER_POINT; }
+
+// Lifecycle state of an order
+enum OrderState : uint8_t { ORDER_NEW, ORDER_ACKED, ORDER_PARTIALLY_FILLED, ORDER_FILLED, ORDER_CANCELLED, ORDER_REJECTED };
+
+/**
+ * Trivially copyable order: product index instead of the product, inline IDs and a tick price.
+ * Enum fields are stored as bytes to keep the record at 80 bytes.
+ */
+struct OrderRecord
+{
+  FixedId orderId;
+  FixedId parentOrderId;
+  int64_t priceTicks;
+  int64_t visibleQuantity;
+  int64_t hiddenQuantity;
+  int64_t filledQuantity;
+  int32_t productIndex;
+  uint8_t side; // PricingSide
+  uint8_t orderType; // OrderType
+  uint8_t market; // Market
+  OrderState state;
+  bool isChildOrder;
+
+  // Check if the order can no longer trade
+  bool IsTerminal() const { return state == ORDER_FILLED || state == ORDER_CANCELLED || state == ORDER_REJECTED; };
+};
+
+static_assert(is_trivially_copyable<OrderRecord>::value && sizeof(OrderRecord) == 80, "OrderRecord must be a trivially copyable 80 bytes");
+
+/**
+ * Handle on a stored order. The generation tells a live order from a later one
+ * reusing the same slot.
+ */
+struct OrderHandle
+{
+  uint32_t index;
+  uint32_t generation;
+
+  bool IsValid() const { return index != UINT32_MAX; };
+};
+
+const OrderHandle INVALID_ORDER_HANDLE = {UINT32_MAX, 0};
+
+
+/**
+ * Slot map of live orders with an open-addressing index on order ID.
+ * Slots sit in one contiguous array and freed slots are reused last-in first-out,
+ * so a steady flow of orders that reach a terminal state keeps touching the same few
+ * slots and index entries however many orders the day sees. The index uses linear
+ * probing with backward-shift deletion, so it never fills up with tombstones.
+ * Both arrays double when full; handles stay valid across growth.
+ */
+class OrderStore
+{
+
+public:
+  // ctor
+  OrderStore(size_t _capacity = 4096) : liveCount(0), freeHead(UINT32_MAX) { Grow(_capacity); };
+
+  // Insert an order, or overwrite the live order with the same ID, returns its handle
+  OrderHandle Insert(const OrderRecord& _record)
+  {
+    uint32_t hash = HashOf(_record.orderId);
+    size_t position = Probe(_record.orderId, hash);
+    if (index[position].slot != EMPTY) {
+      Slot& slot = slots[index[position].slot];
+      slot.record = _record;
+      return OrderHandle{index[position].slot, slot.generation};
+    }
+
+    if (freeHead == UINT32_MAX) {
+      Grow(slots.size() * 2);
+      position = Probe(_record.orderId, hash);
+    }
+    uint32_t s = freeHead;
+    Slot& slot = slots[s];
+    freeHead = slot.nextFree;
+    slot.record = _record;
+    slot.live = true;
+    index[position] = IndexEntry{s, hash};
+    liveCount++;
+    return OrderHandle{s, slot.generation};
+  };
+
+  // Get a live order, nullptr if the handle is stale
+  OrderRecord* Get(OrderHandle _handle)
+  {
+    if (!_handle.IsValid() || _handle.index >= slots.size()) return nullptr;
+    Slot& slot = slots[_handle.index];
+    return (slot.live && slot.generation == _handle.generation) ? &slot.record : nullptr;
+  };
+
+  // Find a live order by ID
+  OrderHandle Find(const FixedId& _orderId) const
+  {
+    size_t position = Probe(_orderId, HashOf(_orderId));
+    if (index[position].slot == EMPTY) return INVALID_ORDER_HANDLE;
+    return OrderHandle{index[position].slot, slots[index[position].slot].generation};
+  };
+
+  // Remove an order and recycle its slot, false if the handle is stale
+  bool Release(OrderHandle _handle)
+  {
+    OrderRecord* record = Get(_handle);
+    if (!record) return false;
+    EraseIndex(Probe(record -> orderId, HashOf(record -> orderId)));
+    Slot& slot = slots[_handle.index];
+    slot.live = false;
+    slot.generation++;
+    slot.nextFree = freeHead;
+    freeHead = _handle.index;
+    liveCount--;
+    return true;
+  };
+
+  // Call _func on every live order, in slot order
+  template<typename F>
+  void ForEach(F&& _func) const
+  {
+    for (auto& slot : slots) {
+      if (slot.live) _func(slot.record);
+    }
+  };
+
+  // Get the number of live orders
+  size_t GetLiveCount() const { return liveCount; };
+
+  // Get the number of slots
+  size_t GetCapacity() const { return slots.size(); };
+
+private:
+  static const uint32_t EMPTY = UINT32_MAX;
+
+  struct Slot
+  {
+    OrderRecord record;
+    uint32_t generation;
+    uint32_t nextFree;
+    bool live;
+  };
+
+  struct IndexEntry
+  {
+    uint32_t slot;
+    uint32_t hash;
+  };
+
+  static uint32_t HashOf(const FixedId& _id)
+  {
+    uint64_t hash = _id.Hash();
+    return (uint32_t) (hash ^ (hash >> 32));
+  };
+
+  // position of the ID in the index, or of the empty entry where it would go
+  size_t Probe(const FixedId& _id, uint32_t _hash) const
+  {
+    size_t position = _hash & mask;
+    while (index[position].slot != EMPTY) {
+      if (index[position].hash == _hash && slots[index[position].slot].record.orderId == _id) break;
+      position = (position + 1) & mask;
+    }
+    return position;
+  };
+
+  // remove an index entry, shifting back the entries of its probe run
+  void EraseIndex(size_t _position)
+  {
+    size_t hole = _position;
+    size_t next = _position;
+    while (true) {
+      next = (next + 1) & mask;
+      if (index[next].slot == EMPTY) break;
+      size_t home = index[next].hash & mask;
+      // the entry can stay if its home lies cyclically in (hole, next]
+      bool stays = hole <= next ? (hole < home && home <= next) : (hole < home || home <= next);
+      if (stays) continue;
+      index[hole] = index[next];
+      hole = next;
+    }
+    index[hole].slot = EMPTY;
+  };
+
+  // grow the slots to _capacity and rebuild the index at twice that size
+  void Grow(size_t _capacity)
+  {
+    size_t old = slots.size();
+    slots.resize(max<size_t>(_capacity, 1));
+    for (size_t s = slots.size(); s-- > old;) {
+      slots[s].generation = 0;
+      slots[s].live = false;
+      slots[s].nextFree = freeHead;
+      freeHead = (uint32_t) s;
+    }
+
+    size_t size = 1;
+    while (size < 2 * slots.size()) size <<= 1;
+    mask = size - 1;
+    index.assign(size, IndexEntry{EMPTY, 0});
+    for (size_t s = 0; s < old; ++s) {
+      if (!slots[s].live) continue;
+      uint32_t hash = HashOf(slots[s].record.orderId);
+      index[Probe(slots[s].record.orderId, hash)] = IndexEntry{(uint32_t) s, hash};
+    }
+  };
+
+  vector<Slot> slots;
+  vector<IndexEntry> index;
+  size_t mask;
+  size_t liveCount;
+  uint32_t freeHead;
+
+};
+
+#endif
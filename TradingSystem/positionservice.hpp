@@ -9,13 +9,77 @@
 
 #include <string>
 #include <map>
+#include <optional>
+#include <cstdint>
 #include "soa.hpp"
 #include "tradebookingservice.hpp"
+#include "checkpoint.hpp"
 
 using namespace std;
 
 /**
- * Position class in a particular book.
+ * Positions of every product in every book, held as a dense products x books matrix
+ * with running totals per product and per book, all updated on each trade.
+ */
+class PositionMatrix
+{
+
+public:
+  // ctor
+  PositionMatrix() : cells(), productTotals(), bookTotals(), usedBooks() {};
+
+  // Add a signed quantity to a product in a book
+  void Add(int _productIndex, int _bookId, long _quantity)
+  {
+    cells[_productIndex][_bookId] += _quantity;
+    productTotals[_productIndex] += _quantity;
+    bookTotals[_bookId] += _quantity;
+    usedBooks[_productIndex] |= 1u << _bookId;
+  };
+
+  // Get the position of a product in a book
+  long Get(int _productIndex, int _bookId) const { return cells[_productIndex][_bookId]; };
+
+  // Get the positions of a product in every book, indexed by book ID
+  const long* GetBookPositions(int _productIndex) const { return cells[_productIndex]; };
+
+  // Get the position of a product across books
+  long GetProductTotal(int _productIndex) const { return productTotals[_productIndex]; };
+
+  // Get the position of a book across products
+  long GetBookTotal(int _bookId) const { return bookTotals[_bookId]; };
+
+  // Check if a product has traded in a book
+  bool IsBookUsed(int _productIndex, int _bookId) const { return (usedBooks[_productIndex] >> _bookId) & 1u; };
+
+private:
+  long cells[NUM_PRODUCTS][MAX_BOOKS];
+  long productTotals[NUM_PRODUCTS];
+  long bookTotals[MAX_BOOKS];
+  uint32_t usedBooks[NUM_PRODUCTS];
+
+};
+
+
+/**
+ * Signed change of a product's position in a book, with the positions after it.
+ * A change coalesced over several books has book ID -1 and no book position.
+ * The last change of an epoch or batch is complete: the matrix holds no change of
+ * another product still to be published, so it can be checked against the matrix.
+ */
+struct PositionDelta
+{
+  int productIndex;
+  int bookId;
+  long quantity; // signed change
+  long productPosition; // across books, after the change
+  long bookPosition; // in the book, after the change
+  bool complete;
+};
+
+
+/**
+ * Position class in a particular book: a view of one product's row of the position matrix.
  * Type T is the product type.
  */
 template<typename T>
@@ -26,36 +90,24 @@ public:
 
   // ctor for a position
   Position() = default;
-  Position(const T& _productId) : product(_productId) {};
+  Position(const T& _productId, const PositionMatrix* _matrix) :
+    product(_productId), productIndex(getProductIndex(_productId.GetProductId())), matrix(_matrix) {};
 
   // Get the product
   const T& GetProduct() const { return product; };
 
+  // Get the dense product index
+  int GetProductIndex() const { return productIndex; };
+
   // Get the position quantity
-  long GetPosition(string& _book) { return bookpositions[_book]; };
+  long GetPosition(string& _book) { return GetPosition(internBook(_book)); };
+  long GetPosition(int _bookId) const { return matrix ? matrix -> Get(productIndex, _bookId) : 0; };
 
-  // Get the aggregate position
-  long GetAggregatePosition() {
-    long aggposition = 0;
-    for (auto it = bookpositions.begin(); it != bookpositions.end(); ++it)
-    {
-      aggposition += it->second;
-    }
-    return aggposition;
-  };
+  // Get the positions of every book, indexed by book ID
+  const long* GetBookPositions() const { return matrix -> GetBookPositions(productIndex); };
 
-  //  send position to risk service through listener
-  void AddPosition(string& _book, long _position) 
-  {
-    if (bookpositions.find(_book) == bookpositions.end())
-    {
-      bookpositions.insert(pair<string,long>(_book, _position));
-    }
-    else
-    {
-      bookpositions[_book] += _position;
-    }
-  }
+  // Get the aggregate position
+  long GetAggregatePosition() const { return matrix ? matrix -> GetProductTotal(productIndex) : 0; };
 
   // reload printer
   template<typename U>
@@ -65,9 +117,11 @@ public:
     string productId = product.GetProductId();
     vector<string> positions;
 
-    for (const auto& p : _position.bookpositions) {
-        positions.push_back(p.first);
-        positions.push_back(std::to_string(p.second));
+    // books in ID order, i.e. TRSY1, TRSY2, TRSY3, then books in order of first use
+    for (int b = 0; _position.matrix && b < MAX_BOOKS; ++b) {
+        if (!_position.matrix -> IsBookUsed(_position.productIndex, b)) continue;
+        positions.push_back(getBookName(b));
+        positions.push_back(std::to_string(_position.GetPosition(b)));
     }
 
     vector<string> components;
@@ -81,15 +135,18 @@ public:
 
 private:
   T product;
-  map<string,long> bookpositions;
+  int productIndex = 0;
+  const PositionMatrix* matrix = nullptr;
 
 };
 
 
 
-// forward declaration of listener
+// forward declaration of listeners
 template<typename T>
 class PositionServiceListener;
+template<typename T>
+class PositionBatchListener;
 
 /**
  * PositionService to manage positions across multiple books and securities.
@@ -105,11 +162,25 @@ public:
   PositionService() 
   {
     positionlistener = new PositionServiceListener<T>(this);
+    batchlistener = new PositionBatchListener<T>(this);
+    epochTrades = 0;
+    epochNanos = 0;
+    epochCount = 0;
+    epochStart = 0;
+    epochCoalesced = 0;
+    dirtyProducts = 0;
+    for (int i = 0; i < NUM_PRODUCTS; ++i) {
+      pendingDeltas[i] = 0;
+      pendingBooks[i] = 0;
+    }
   };
   ~PositionService() = default;
 
   // Get data on our service given a key
-  Position<T>& GetData(string _key) { return positions[_key]; };
+  Position<T>& GetData(string _key) { return GetPosition(getProductIndex(_key)); };
+
+  // Get the position matrix
+  const PositionMatrix& GetPositionMatrix() const { return matrix; };
 
   // The callback that a Connector should invoke for any new or updated data
   void OnMessage(Position<T>& _data) {};
@@ -120,38 +191,183 @@ public:
   // Get all listeners on the Service.
   const vector<ServiceListener<Position<T>>*>& GetListeners() const { return listeners; };
 
+  // Add a listener receiving the signed change of each trade rather than the whole position
+  void AddDeltaListener(ServiceListener<PositionDelta>* _listener) { deltaListeners.push_back(_listener); };
+
+  // Add a listener receiving the change of every trade in its book as it is booked, never coalesced into epochs
+  void AddTradeDeltaListener(ServiceListener<PositionDelta>* _listener) { tradeDeltaListeners.push_back(_listener); };
+
   // Get the listener of the service
   PositionServiceListener<T>* GetPositionListener() { return positionlistener; };
 
+  // Get the listener of trades booked in bulk
+  PositionBatchListener<T>* GetPositionBatchListener() { return batchlistener; };
+
   // Add a trade to the service
   void AddTrade(const Trade<T>& _trade) 
   {
-    T product = _trade.GetProduct();
-    string productId = product.GetProductId();
-    string book = _trade.GetBook();
+    int productIndex = getProductIndex(_trade.GetProduct().GetProductId());
     long quantity = (_trade.GetSide() == BUY) ? _trade.GetQuantity() : -_trade.GetQuantity();
-    if (positions.find(productId) == positions.end())
+    int bookId = _trade.GetBookId();
+    matrix.Add(productIndex, bookId, quantity);
+    PositionDelta delta{productIndex, bookId, quantity, matrix.GetProductTotal(productIndex), matrix.Get(productIndex, bookId), true};
+    PublishTrade(delta);
+
+    if (epochTrades == 0 && epochNanos == 0) {
+      Publish(delta);
+      return;
+    }
+
+    // epoch mode: the positions are current, listeners hear once per product when the epoch closes
+    long long now = epochNanos > 0 ? getSteadyNanos() : 0;
+    if (epochCount == 0) epochStart = now;
+    pendingDeltas[productIndex] += quantity;
+    pendingBooks[productIndex] |= 1u << bookId;
+    dirtyProducts |= 1u << productIndex;
+    epochCount++;
+    if ((epochTrades > 0 && epochCount >= epochTrades) || (epochNanos > 0 && now - epochStart >= epochNanos)) FlushEpoch();
+  };
+
+  // Add the net positions of a batch of trades, then publish one change per product traded
+  void AddTradeBatch(const TradeBatch& _batch)
+  {
+    // changes of the open epoch go first
+    FlushEpoch();
+    int lastProduct = -1;
+    for (int productIndex = 0; productIndex < NUM_PRODUCTS; ++productIndex) {
+      if (_batch.books[productIndex]) lastProduct = productIndex;
+    }
+    for (int productIndex = 0; productIndex <= lastProduct; ++productIndex) {
+      uint32_t books = _batch.books[productIndex];
+      if (books == 0) continue;
+      long quantity = 0;
+      for (uint32_t remaining = books; remaining; remaining &= remaining - 1) {
+        int bookId = __builtin_ctz(remaining);
+        matrix.Add(productIndex, bookId, _batch.positions[productIndex][bookId]);
+        quantity += _batch.positions[productIndex][bookId];
+        PositionDelta bookDelta{productIndex, bookId, _batch.positions[productIndex][bookId], matrix.GetProductTotal(productIndex), matrix.Get(productIndex, bookId), true};
+        PublishTrade(bookDelta);
+      }
+      int bookId = (books & (books - 1)) == 0 ? __builtin_ctz(books) : -1;
+      PositionDelta delta{productIndex, bookId, quantity, matrix.GetProductTotal(productIndex), bookId >= 0 ? matrix.Get(productIndex, bookId) : 0, productIndex == lastProduct};
+      Publish(delta);
+    }
+  };
+
+  // Coalesce updates over epochs of _trades trades or _nanos nanoseconds, whichever closes first
+  // 0 for both publishes every trade; closing on time is checked as trades arrive
+  void SetEpoch(long _trades, long long _nanos = 0)
+  {
+    FlushEpoch();
+    epochTrades = _trades;
+    epochNanos = _nanos;
+  };
+
+  // Close the current epoch: one update per product traded since the last one
+  void FlushEpoch()
+  {
+    if (epochCount == 0) return;
+    epochCoalesced += epochCount;
+    epochCount = 0;
+    while (dirtyProducts) {
+      int productIndex = __builtin_ctz(dirtyProducts);
+      dirtyProducts &= dirtyProducts - 1;
+      // a single book keeps its ID, several are reported as one change across books
+      uint32_t books = pendingBooks[productIndex];
+      int bookId = (books & (books - 1)) == 0 ? __builtin_ctz(books) : -1;
+      PositionDelta delta{productIndex, bookId, pendingDeltas[productIndex], matrix.GetProductTotal(productIndex), bookId >= 0 ? matrix.Get(productIndex, bookId) : 0, dirtyProducts == 0};
+      pendingDeltas[productIndex] = 0;
+      pendingBooks[productIndex] = 0;
+      Publish(delta);
+    }
+  };
+
+  // Get the number of trades coalesced into epochs so far
+  long GetCoalescedCount() const { return epochCoalesced; };
+
+  // Add the positions to a checkpoint, closing the current epoch first
+  void SaveCheckpoint(CheckpointWriter& _writer)
+  {
+    FlushEpoch();
+    // book IDs are given in order of first use, so the names go along to map them back
+    const vector<string>& books = getBookRegistry();
+    FixedId bookNames[MAX_BOOKS];
+    for (size_t b = 0; b < books.size(); ++b) bookNames[b] = FixedId(books[b]);
+    _writer.AddSection(CHECKPOINT_POSITIONS, &matrix, 1);
+    _writer.AddSection(CHECKPOINT_BOOK_NAMES, bookNames, books.size());
+  };
+
+  // Restore the positions from a checkpoint without flowing them to the listeners, false if it has none
+  bool RestoreCheckpoint(const CheckpointReader& _reader)
+  {
+    size_t count;
+    size_t bookCount;
+    const PositionMatrix* saved = _reader.GetSection<PositionMatrix>(CHECKPOINT_POSITIONS, count);
+    const FixedId* bookNames = _reader.GetSection<FixedId>(CHECKPOINT_BOOK_NAMES, bookCount);
+    if (!saved || count != 1 || !bookNames) return false;
+    if (bookCount > (size_t) MAX_BOOKS) {
+      logger(LogType::ERROR, "Position checkpoint holds " + to_string(bookCount) + " books, at most " + to_string(MAX_BOOKS) + " are supported");
+      return false;
+    }
+    PositionMatrix restored;
+    for (size_t b = 0; b < bookCount; ++b) {
+      int bookId = internBook(bookNames[b].ToString());
+      for (int i = 0; i < NUM_PRODUCTS; ++i) {
+        if (saved -> IsBookUsed(i, (int) b)) restored.Add(i, bookId, saved -> Get(i, (int) b));
+      }
+    }
+    matrix = restored;
+    return true;
+  };
+
+private:
+  // flow the change of one trade to the trade delta listeners
+  void PublishTrade(PositionDelta& _delta)
+  {
+    for (auto& listener: tradeDeltaListeners)
     {
-      Position<T> position(product);
-      position.AddPosition(book, quantity);
-      positions.insert(pair<string,Position<T>>(productId, position));
+      listener -> ProcessAdd(_delta);
     }
-    else
+  };
+
+  // flow a change to the delta listeners and the product's position to the other listeners
+  void Publish(PositionDelta& _delta)
+  {
+    for (auto& listener: deltaListeners)
     {
-      positions[productId].AddPosition(book, quantity);
+      listener -> ProcessAdd(_delta);
     }
 
+    Position<T>& position = GetPosition(_delta.productIndex);
     for (auto& listener: listeners)
     {
-      listener -> ProcessAdd(positions[productId]);
+      listener -> ProcessAdd(position);
     }
+  };
 
+  // view of a product's positions, created on first use
+  Position<T>& GetPosition(int _productIndex)
+  {
+    optional<Position<T>>& position = positions[_productIndex];
+    if (!position) position.emplace(getProductObject<T>(PRODUCT_CUSIPS[_productIndex]), &matrix);
+    return *position;
   };
 
-private:
-  map<string,Position<T>> positions;
+  PositionMatrix matrix;
+  optional<Position<T>> positions[NUM_PRODUCTS];
   vector<ServiceListener<Position<T>>*> listeners;
+  vector<ServiceListener<PositionDelta>*> deltaListeners;
+  vector<ServiceListener<PositionDelta>*> tradeDeltaListeners;
   PositionServiceListener<T>* positionlistener;
+  PositionBatchListener<T>* batchlistener;
+  long epochTrades;
+  long long epochNanos;
+  long epochCount; // trades in the current epoch
+  long long epochStart;
+  long epochCoalesced;
+  uint32_t dirtyProducts;
+  long pendingDeltas[NUM_PRODUCTS];
+  uint32_t pendingBooks[NUM_PRODUCTS];
 
 };
 
@@ -183,5 +399,58 @@ public:
 };
 
 
+/**
+ * PositionBatchListener to subscribe trades booked in bulk from tradebooking service
+ * Type T is the product type.
+ */
+template<typename T>
+class PositionBatchListener : public ServiceListener<TradeBatch>
+{
+private:
+  PositionService<T>* positionservice;
+
+public:
+  // ctor and dtor
+  PositionBatchListener(PositionService<T>* _positionservice) : positionservice(_positionservice) {};
+  ~PositionBatchListener() = default;
+
+  // Listener callback to process an add event to the Service
+  void ProcessAdd(TradeBatch& _data) { positionservice -> AddTradeBatch(_data); };
+
+  // Listener callback to process a remove event to the Service
+  void ProcessRemove(TradeBatch& _data) {};
+
+  // Listener callback to process an update event to the Service
+  void ProcessUpdate(TradeBatch& _data) {};
+
+};
+
+
+/**
+* Pre-Trade Risk Position Listener subscribing the change of every trade from Position Service to the pre-trade risk gate.
+* Trades reach the gate as they are booked, so a fill is in the positions before the gate releases its reservation.
+*/
+class PreTradeRiskPositionListener : public ServiceListener<PositionDelta>
+{
+
+public:
+  // ctor
+  PreTradeRiskPositionListener(PreTradeRiskGate* _gate) : gate(_gate) {};
+
+  // Listener callback to process an add event to the Service
+  void ProcessAdd(PositionDelta& _data) override { gate -> UpdateBookPosition(_data.productIndex, _data.bookId, _data.bookPosition, _data.productPosition); };
+
+  // Listener callback to process a remove event to the Service
+  void ProcessRemove(PositionDelta& _data) override {};
+
+  // Listener callback to process an update event to the Service
+  void ProcessUpdate(PositionDelta& _data) override {};
+
+private:
+  PreTradeRiskGate* gate;
+
+};
+
+
 
 #endif
@@ -0,0 +1,224 @@
+/**
+ * pretraderisk.hpp
+ * Pre-trade risk gate checking orders between algo execution and execution.
+ *
+ * @author Yicheng Sun
+ */
+
+#ifndef PRE_TRADE_RISK_HPP
+#define PRE_TRADE_RISK_HPP
+
+#include <string>
+#include <limits>
+#include <cmath>
+#include <cstdint>
+#include "soa.hpp"
+#include "marketdataservice.hpp"
+#include "exchangesimulator.hpp"
+#include "latencyhistogram.hpp"
+#include "functions.hpp"
+
+// Reasons for rejecting an order, combined as bits
+enum RiskRejectReason : uint32_t { RISK_ORDER_SIZE = 1, RISK_PRODUCT_POSITION = 2, RISK_BOOK_POSITION = 4, RISK_PV01 = 8, RISK_PRICE_BAND = 16 };
+
+const int RISK_REJECT_REASONS = 5;
+
+/**
+ * Limits of the pre-trade risk gate. Positions are in face value, PV01 in dollars.
+ * The defaults leave every limit open.
+ */
+struct RiskLimits
+{
+  long maxOrderQuantity = numeric_limits<long>::max();
+  long maxProductPosition = numeric_limits<long>::max();
+  long maxBookPosition = numeric_limits<long>::max();
+  double maxDollarPV01 = numeric_limits<double>::infinity();
+  double priceBand = numeric_limits<double>::infinity(); // max distance from the book mid
+};
+
+
+/**
+ * Pre-trade risk gate. Every input is kept as a precomputed counter: positions per
+ * product and per book come from Position Service, PV01 per product from Risk Service,
+ * mids from Market Data Service, and orders in flight are reserved on pass and released
+ * by their fills and cancels. The book limit holds for whichever book the order ends up
+ * in, using the headroom of the most loaded book.
+ * Check evaluates all limits without branching on the outcome, touches only fixed arrays
+ * and records its own latency.
+ */
+class PreTradeRiskGate
+{
+
+public:
+  // ctor
+  PreTradeRiskGate(const RiskLimits& _limits = RiskLimits()) : limits(_limits), pendingTotal(0), exposurePV01(0.0), checkedCount(0), rejectedCount(0)
+  {
+    for (int i = 0; i < NUM_PRODUCTS; ++i) {
+      positions[i] = 0;
+      pending[i] = 0;
+      pv01PerUnit[i] = 0.0;
+      mids[i] = numeric_limits<double>::quiet_NaN(); // fails the price band until the first book
+      for (int b = 0; b < MAX_BOOKS; ++b) bookPositions[b][i] = 0;
+    }
+    for (int r = 0; r < RISK_REJECT_REASONS; ++r) reasonCounts[r] = 0;
+    UpdateBookHeadroom();
+  };
+
+  // Set the limits
+  void SetLimits(const RiskLimits& _limits)
+  {
+    limits = _limits;
+    UpdateBookHeadroom();
+  };
+
+  // Get the limits
+  const RiskLimits& GetLimits() const { return limits; };
+
+  // Check an order, returns 0 if it passes or the RiskRejectReason bits it breaches
+  // A passing order is reserved against the limits until it is filled or cancelled
+  uint32_t Check(int _productIndex, PricingSide _side, long _quantity, double _price)
+  {
+    long long start = getSteadyNanos();
+    long signedQuantity = _side == BID ? _quantity : -_quantity;
+    long exposure = positions[_productIndex] + pending[_productIndex] + signedQuantity;
+    long bookExposure = pendingTotal + signedQuantity;
+    double pv01 = exposurePV01 + signedQuantity * pv01PerUnit[_productIndex];
+
+    uint32_t reasons = (uint32_t) (_quantity > limits.maxOrderQuantity) * RISK_ORDER_SIZE
+      | (uint32_t) (labs(exposure) > limits.maxProductPosition) * RISK_PRODUCT_POSITION
+      | (uint32_t) ((bookExposure > bookLongHeadroom) | (-bookExposure > bookShortHeadroom)) * RISK_BOOK_POSITION
+      | (uint32_t) (fabs(pv01) > limits.maxDollarPV01) * RISK_PV01
+      | (uint32_t) !(fabs(_price - mids[_productIndex]) <= limits.priceBand) * RISK_PRICE_BAND;
+
+    // reserve without branching: a rejected order reserves nothing
+    long reserved = signedQuantity * (long) (reasons == 0);
+    pending[_productIndex] += reserved;
+    pendingTotal += reserved;
+    exposurePV01 += reserved * pv01PerUnit[_productIndex];
+    checkedCount++;
+    rejectedCount += reasons != 0;
+    latency.Record(getSteadyNanos() - start);
+
+    if (reasons) CountReasons(reasons);
+    return reasons;
+  };
+
+  // Update the position of a product in one book and across books (position thread)
+  void UpdateBookPosition(int _productIndex, int _bookId, long _bookPosition, long _productPosition)
+  {
+    bookPositions[_bookId][_productIndex] = _bookPosition;
+    positions[_productIndex] = _productPosition;
+    UpdateBookHeadroom();
+    UpdateExposurePV01();
+  };
+
+  // Update the PV01 of a product, quoted per 100 face
+  void UpdatePV01(int _productIndex, double _pv01)
+  {
+    pv01PerUnit[_productIndex] = _pv01 / 100.0;
+    UpdateExposurePV01();
+  };
+
+  // Update the mid of a product
+  void UpdateBook(int _productIndex, double _bidPrice, double _offerPrice) { mids[_productIndex] = (_bidPrice + _offerPrice) / 2.0; };
+
+  // Release the reservation of an order as it fills or is cancelled
+  void OnReport(const ExchangeReport& _report)
+  {
+    long released = 0;
+    if (_report.type == REPORT_FILL) released = _report.quantity;
+    else if (_report.type == REPORT_CANCELLED || _report.type == REPORT_REJECTED) released = _report.leavesQuantity;
+    if (released == 0) return;
+    Release(_report.productIndex, _report.side, released);
+  };
+
+  // Release the reservation of quantity that was checked but never reached an exchange
+  void Release(int _productIndex, PricingSide _side, long _quantity)
+  {
+    long signedQuantity = _side == BID ? _quantity : -_quantity;
+    pending[_productIndex] -= signedQuantity;
+    pendingTotal -= signedQuantity;
+    exposurePV01 -= signedQuantity * pv01PerUnit[_productIndex];
+  };
+
+  // Get the check latency
+  const LatencyHistogram& GetLatency() const { return latency; };
+
+  // Get the number of orders checked and rejected
+  uint64_t GetCheckedCount() const { return checkedCount; };
+  uint64_t GetRejectedCount() const { return rejectedCount; };
+
+  // Get the number of rejects for a reason
+  uint64_t GetReasonCount(RiskRejectReason _reason) const { return reasonCounts[__builtin_ctz(_reason)]; };
+
+private:
+  // headroom left in the most loaded book on each side
+  void UpdateBookHeadroom()
+  {
+    long highest = 0;
+    long lowest = 0;
+    for (int b = 0; b < MAX_BOOKS; ++b) {
+      long total = 0;
+      for (int i = 0; i < NUM_PRODUCTS; ++i) total += bookPositions[b][i];
+      highest = max(highest, total);
+      lowest = min(lowest, total);
+    }
+    bookLongHeadroom = limits.maxBookPosition - highest;
+    bookShortHeadroom = limits.maxBookPosition + lowest;
+  };
+
+  // dollar PV01 of the positions and the orders in flight
+  void UpdateExposurePV01()
+  {
+    exposurePV01 = 0.0;
+    for (int i = 0; i < NUM_PRODUCTS; ++i) exposurePV01 += (positions[i] + pending[i]) * pv01PerUnit[i];
+  };
+
+  void CountReasons(uint32_t _reasons)
+  {
+    for (int r = 0; r < RISK_REJECT_REASONS; ++r) reasonCounts[r] += (_reasons >> r) & 1;
+  };
+
+  RiskLimits limits;
+  long positions[NUM_PRODUCTS];
+  long pending[NUM_PRODUCTS];
+  double pv01PerUnit[NUM_PRODUCTS];
+  double mids[NUM_PRODUCTS];
+  long bookPositions[MAX_BOOKS][NUM_PRODUCTS];
+  long bookLongHeadroom;
+  long bookShortHeadroom;
+  long pendingTotal;
+  double exposurePV01;
+  uint64_t checkedCount;
+  uint64_t rejectedCount;
+  uint64_t reasonCounts[RISK_REJECT_REASONS];
+  LatencyHistogram latency;
+
+};
+
+
+/**
+* Pre-Trade Risk Report Listener releasing reservations on exchange reports from Execution Service.
+*/
+class PreTradeRiskReportListener : public ServiceListener<ExchangeReport>
+{
+
+public:
+  // ctor
+  PreTradeRiskReportListener(PreTradeRiskGate* _gate) : gate(_gate) {};
+
+  // Listener callback to process an add event to the Service
+  void ProcessAdd(ExchangeReport& _data) override { gate -> OnReport(_data); };
+
+  // Listener callback to process a remove event to the Service
+  void ProcessRemove(ExchangeReport& _data) override {};
+
+  // Listener callback to process an update event to the Service
+  void ProcessUpdate(ExchangeReport& _data) override {};
+
+private:
+  PreTradeRiskGate* gate;
+
+};
+
+#endif
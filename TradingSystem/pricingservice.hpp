@@ -10,6 +10,9 @@
 #include <string>
 #include <map>
 #include "soa.hpp"
+#include "seqlock.hpp"
+#include "marketdataservice.hpp"
+#include "checkpoint.hpp"
 #include "functions.hpp"
 
 /**
@@ -24,12 +27,15 @@ public:
 
   // ctor for a price
   Price() = default;
-  Price(const T& _product, double _mid, double _bidOfferSpread):
-    product(_product), mid(_mid), bidOfferSpread(_bidOfferSpread) {};
+  Price(const T& _product, double _mid, double _bidOfferSpread, int _productIndex = -1):
+    product(_product), mid(_mid), bidOfferSpread(_bidOfferSpread), productIndex(_productIndex) {};
 
   // Get the product
   const T& GetProduct() const { return product; };
 
+  // Get the dense product index, carried from where the price was made so the quote path does not look it up
+  int GetProductIndex() const { return productIndex >= 0 ? productIndex : getProductIndex(product.GetProductId()); };
+
   // Get the mid price
   double GetMid() const { return mid; };
 
@@ -61,13 +67,44 @@ private:
   T product;
   double mid;
   double bidOfferSpread;
+  int productIndex = -1;
 
 };
 
 
-// forward declaration of connector
+/**
+ * Latest mid and bid/offer spread of a product, published to other threads
+ * through a per-product seqlock slot.
+ */
+struct PriceSnapshot
+{
+  double mid;
+  double bidOfferSpread;
+};
+
+/**
+ * Checkpointed pricing state of a product: the latest published, file feed and book prices.
+ */
+struct PricingRecord
+{
+  PriceSnapshot latest;
+  PriceSnapshot feed;
+  PriceSnapshot book;
+  bool latestValid;
+  bool feedValid;
+  bool bookValid;
+};
+
+
+// Source of the prices published by the pricing service
+enum PricingMode { FILE_FEED, COMPOSITE, BLENDED };
+
+
+// forward declaration of connector and composite pricing listener
 template<typename T>
 class PricingConnector;
+template<typename T>
+class CompositePricingListener;
 
 /**
  * Pricing Service managing mid prices and bid/offers.
@@ -82,6 +119,13 @@ public:
   // ctor and dtor
   PricingService() {
     connector = new PricingConnector<T>(this);
+    compositelistener = new CompositePricingListener<T>(this);
+    mode = FILE_FEED;
+    bookWeight = 1.0;
+    for (int i = 0; i < NUM_PRODUCTS; ++i) {
+      feedValid[i] = false;
+      bookValid[i] = false;
+    }
   };
   ~PricingService() = default;
 
@@ -90,13 +134,40 @@ public:
 
   // The callback that a Connector should invoke for any new or updated data
   void OnMessage(Price<T>& _data) override 
+  {
+    int index = _data.GetProductIndex();
+    feedPrices[index] = PriceSnapshot{_data.GetMid(), _data.GetBidOfferSpread()};
+    feedValid[index] = true;
+
+    if (mode == FILE_FEED) {
+      PublishPrice(_data);
+    } else if (mode == BLENDED && bookValid[index]) {
+      PublishBlendedPrice(_data.GetProduct(), index);
+    }
+  };
+
+  // called by composite pricing listener when the top of book of a product changed
+  void OnBookPrice(const T& _product, int _index, double _bestBid, double _bestOffer)
+  {
+    bookPrices[_index] = PriceSnapshot{(_bestBid + _bestOffer) / 2.0, _bestOffer - _bestBid};
+    bookValid[_index] = true;
+
+    if (mode == COMPOSITE) {
+      Price<T> price(_product, bookPrices[_index].mid, bookPrices[_index].bidOfferSpread, _index);
+      PublishPrice(price);
+    } else if (mode == BLENDED && feedValid[_index]) {
+      PublishBlendedPrice(_product, _index);
+    }
+  };
+
+  // Publish a price: store it, update the snapshot slot and flow to listeners
+  void PublishPrice(Price<T>& _data)
   {
     string _key = _data.GetProduct().GetProductId();
     // update prices
-    if (prices.find(_key) != prices.end()) {
-      prices.erase(_key);
-    }
-    prices.insert(pair<string, Price<Bond>> (_key, _data));
+    prices.insert_or_assign(_key, _data);
+    // publish the snapshot for concurrent readers, never blocks
+    priceSlots[_data.GetProductIndex()].Store(PriceSnapshot{_data.GetMid(), _data.GetBidOfferSpread()});
     // flow data to listeners
     for (auto& listener : listeners) {
         listener -> ProcessAdd(_data);
@@ -112,8 +183,80 @@ public:
   // Get the connector
   PricingConnector<T>* GetConnector() { return connector; };
 
+  // Get the listener deriving composite prices from market data order books
+  CompositePricingListener<T>* GetCompositePricingListener() { return compositelistener; };
+
+  // Set the pricing mode, _bookWeight is the weight of the book price when blending
+  void SetPricingMode(PricingMode _mode, double _bookWeight = 1.0)
+  {
+    mode = _mode;
+    bookWeight = _bookWeight;
+  };
+
+  // Get the pricing mode
+  PricingMode GetPricingMode() const { return mode; };
+
+  // Read the latest price of a product from any thread, false if never priced
+  bool GetLatestPrice(int _productIndex, PriceSnapshot& _snapshot) const
+  {
+    const SeqLock<PriceSnapshot>& slot = priceSlots[_productIndex];
+    if (slot.GetVersion() == 0) return false;
+    _snapshot = slot.Load();
+    return true;
+  };
+  bool GetLatestPrice(const string& _productId, PriceSnapshot& _snapshot) const { return GetLatestPrice(getProductIndex(_productId), _snapshot); };
+
+  // Get the number of prices published for a product
+  uint64_t GetPriceVersion(int _productIndex) const { return priceSlots[_productIndex].GetVersion(); };
+
+  // Add the prices to a checkpoint
+  void SaveCheckpoint(CheckpointWriter& _writer)
+  {
+    PricingRecord records[NUM_PRODUCTS];
+    for (int i = 0; i < NUM_PRODUCTS; ++i) {
+      records[i] = PricingRecord{PriceSnapshot{0.0, 0.0}, feedPrices[i], bookPrices[i], priceSlots[i].GetVersion() > 0, feedValid[i], bookValid[i]};
+      if (records[i].latestValid) records[i].latest = priceSlots[i].Load();
+    }
+    _writer.AddSection(CHECKPOINT_PRICES, records, NUM_PRODUCTS);
+  };
+
+  // Restore the prices from a checkpoint without flowing them to the listeners, false if it has none
+  bool RestoreCheckpoint(const CheckpointReader& _reader)
+  {
+    size_t count;
+    const PricingRecord* records = _reader.GetSection<PricingRecord>(CHECKPOINT_PRICES, count);
+    if (!records || count != NUM_PRODUCTS) return false;
+    for (int i = 0; i < NUM_PRODUCTS; ++i) {
+      feedPrices[i] = records[i].feed;
+      bookPrices[i] = records[i].book;
+      feedValid[i] = records[i].feedValid;
+      bookValid[i] = records[i].bookValid;
+      if (!records[i].latestValid) continue;
+      priceSlots[i].Store(records[i].latest);
+      prices.insert_or_assign(PRODUCT_CUSIPS[i], Price<T>(getProductObject<T>(PRODUCT_CUSIPS[i]), records[i].latest.mid, records[i].latest.bidOfferSpread, i));
+    }
+    return true;
+  };
+
 private:
+  // blend the latest book and file feed prices of a product and publish
+  void PublishBlendedPrice(const T& _product, int _index)
+  {
+    double mid = bookWeight * bookPrices[_index].mid + (1.0 - bookWeight) * feedPrices[_index].mid;
+    double spread = bookWeight * bookPrices[_index].bidOfferSpread + (1.0 - bookWeight) * feedPrices[_index].bidOfferSpread;
+    Price<T> price(_product, mid, spread, _index);
+    PublishPrice(price);
+  };
+
   map<string, Price<T>> prices;
+  SeqLock<PriceSnapshot> priceSlots[NUM_PRODUCTS];
+  PriceSnapshot feedPrices[NUM_PRODUCTS];
+  PriceSnapshot bookPrices[NUM_PRODUCTS];
+  bool feedValid[NUM_PRODUCTS];
+  bool bookValid[NUM_PRODUCTS];
+  PricingMode mode;
+  double bookWeight;
+  CompositePricingListener<T>* compositelistener;
   vector<ServiceListener<Price<T>>*> listeners;
   PricingConnector<T>* connector;
 
@@ -159,7 +302,7 @@ public:
       T product = getProductObject<T>(productId);
       
       // create Price object
-      Price<T> price(product, mid, spread);
+      Price<T> price(product, mid, spread, getProductIndex(productId));
 
       // flow data to pricing service
       service -> OnMessage(price);
@@ -171,4 +314,56 @@ private:
 };
 
 
+/**
+* Composite Pricing Listener subscribing order books from Market Data Service.
+* Only calls back into the pricing service when the best bid or offer price moved,
+* so it keeps up with full book rates.
+* Type T is the product type.
+*/
+template<typename T>
+class CompositePricingListener : public ServiceListener<OrderBook<T>>
+{
+
+public:
+  // ctor
+  CompositePricingListener(PricingService<T>* _service) : service(_service)
+  {
+    for (int i = 0; i < NUM_PRODUCTS; ++i) {
+      lastBid[i] = 0.0;
+      lastOffer[i] = 0.0;
+    }
+  };
+
+  // Listener callback to process an add event to the Service
+  void ProcessAdd(OrderBook<T>& _data) override
+  {
+    if (service -> GetPricingMode() == FILE_FEED) return;
+    if (_data.GetBidStack().empty() || _data.GetOfferStack().empty()) return;
+
+    BidOffer bidOffer = _data.GetBestBidOffer();
+    double bestBid = bidOffer.GetBidOrder().GetPrice();
+    double bestOffer = bidOffer.GetOfferOrder().GetPrice();
+    int index = getProductIndex(_data.GetProduct().GetProductId());
+
+    // recompute only on top of book change
+    if (bestBid == lastBid[index] && bestOffer == lastOffer[index]) return;
+    lastBid[index] = bestBid;
+    lastOffer[index] = bestOffer;
+    service -> OnBookPrice(_data.GetProduct(), index, bestBid, bestOffer);
+  };
+
+  // Listener callback to process a remove event to the Service
+  void ProcessRemove(OrderBook<T>& _data) override {};
+
+  // Listener callback to process an update event to the Service
+  void ProcessUpdate(OrderBook<T>& _data) override {};
+
+private:
+  PricingService<T>* service;
+  double lastBid[NUM_PRODUCTS];
+  double lastOffer[NUM_PRODUCTS];
+
+};
+
+
 #endif
@@ -7,8 +7,12 @@
 #ifndef RISK_SERVICE_HPP
 #define RISK_SERVICE_HPP
 
+#include <optional>
 #include "soa.hpp"
 #include "positionservice.hpp"
+#include "pricingservice.hpp"
+#include "bondanalytics.hpp"
+#include "checkpoint.hpp"
 #include "functions.hpp"
 
 /**
@@ -23,12 +27,15 @@ public:
 
   // ctor for a PV01 value
   PV01() = default;
-  PV01(const T& _product, double _pv01, long _quantity) : 
-    product(_product), pv01(_pv01), quantity(_quantity) {};
+  PV01(const T& _product, double _pv01, long _quantity, int _productIndex = -1) : 
+    product(_product), pv01(_pv01), quantity(_quantity), productIndex(_productIndex) {};
 
   // Get the product on this PV01 value
   const T& GetProduct() const { return product; };
 
+  // Get the dense product index of a product's PV01, -1 for a sector
+  int GetProductIndex() const { return productIndex; };
+
   // Get the PV01 value
   double GetPV01() const { return pv01; };
 
@@ -38,9 +45,11 @@ public:
   // Add quantity associated with this risk value
   void AddQuantity(long _quantity) { quantity += _quantity; };
 
-  // reload printer
-  template<typename U>
-  friend ostream& operator<<(ostream& os, const PV01<U>& pv01) 
+  // Add to the PV01 value
+  void AddPV01(double _pv01) { pv01 += _pv01; };
+
+  // reload printer, one per product type so PV01 of products and of sectors can coexist
+  friend ostream& operator<<(ostream& os, const PV01<T>& pv01) 
   {
     T product = pv01.GetProduct();
     string _product = product.GetProductId();
@@ -57,6 +66,7 @@ private:
   T product;
   double pv01;
   long quantity;
+  int productIndex = -1;
 
 };
 
@@ -88,12 +98,37 @@ private:
 };
 
 
+/**
+ * Checkpointed risk of a product.
+ */
+struct RiskRecord
+{
+  int productIndex;
+  double pv01;
+  long quantity;
+};
+
+
+// maximum number of bucketed sectors a risk service keeps
+const int MAX_SECTORS = 8;
+
+
 // forward declaration of RiskServiceListener
 template<typename T>
 class RiskServiceListener;
 
+// forward declaration of RiskPricingListener
+template<typename T>
+class RiskPricingListener;
+
 /**
  * Risk Service to vend out risk for a particular security and across a risk bucketed sector.
+ * Sectors are registered once (FrontEnd, Belly and LongEnd to start with) and their risk,
+ * the dollar PV01 and the net quantity of their products, is moved along with every
+ * change of a product's risk, so reading it is an array lookup. The PV01 of a product is
+ * quoted per 100 face, so its dollar PV01 is PV01 times quantity over 100.
+ * PV01 comes from the bond analytics at the live mid of each product and is republished,
+ * with the sectors moved by the change times the quantity, whenever the mid moves.
  * Keyed on product identifier.
  * Type T is the product type.
  */
@@ -105,11 +140,28 @@ public:
   RiskService() 
   {
     riskservicelistener = new RiskServiceListener<T>(this);
+    riskpricinglistener = new RiskPricingListener<T>(this);
+    reconcilePositions = nullptr;
+    reconcileInterval = 0;
+    deltaCount = 0;
+    reconcileDue = false;
+    reconcileCount = 0;
+    mismatchCount = 0;
+    sectorCount = 0;
+    for (int i = 0; i < NUM_PRODUCTS; ++i) productSectors[i] = 0;
+
+    // products by index: 2Y, 3Y, 5Y, 7Y, 10Y, 20Y, 30Y
+    const vector<pair<string, vector<int>>> sectors = {{"FrontEnd", {0, 1}}, {"Belly", {2, 3, 4}}, {"LongEnd", {5, 6}}};
+    for (auto& sector : sectors) {
+      vector<T> products;
+      for (int i : sector.second) products.push_back(getProductObject<T>(PRODUCT_CUSIPS[i]));
+      AddSector(BucketedSector<T>(products, sector.first));
+    }
   };
   ~RiskService() = default;
 
   // Get data on our service given a key
-  PV01<T>& GetData(string _key) { return pv01s[_key]; };
+  PV01<T>& GetData(string _key) { return GetRisk(getProductIndex(_key)); };
 
   // The callback that a Connector should invoke for any new or updated data
   void OnMessage(PV01<T>& _data) {};
@@ -123,62 +175,232 @@ public:
   // Get the special listener for risk service
   RiskServiceListener<T>* GetRiskServiceListener() { return riskservicelistener; };
 
-  // Add a position that the service will risk
-  void AddPosition(Position<T>& _position) 
+  // Get the special listener taking prices from pricing service
+  RiskPricingListener<T>* GetRiskPricingListener() { return riskpricinglistener; };
+
+  // Get the analytics the PV01 of the products come from
+  const BondAnalytics& GetAnalytics() const { return analytics; };
+
+  // Revalue a product at a new mid, republishing its risk if the PV01 changed
+  void UpdatePrice(int _productIndex, double _mid)
   {
-    T product = _position.GetProduct();
-    string productId = product.GetProductId();
-    long quantity = _position.GetAggregatePosition();
-    double pv01Val = getPV01(productId);
+    if (!analytics.UpdatePrice(_productIndex, _mid)) return;
+    PV01<T>& pv01 = GetRisk(_productIndex);
+    double change = analytics.GetPV01(_productIndex) - pv01.GetPV01();
+    if (change == 0.0) return;
+    pv01.AddPV01(change);
+    uint32_t sectors = MoveSectors(_productIndex, change * pv01.GetQuantity(), 0);
 
-    // create a PV01 object and publish it to the service
-    PV01<T> pv01(product, pv01Val, quantity);
-    if (pv01s.find(productId) != pv01s.end())
-    {
-      pv01s[productId].AddQuantity(quantity);
-    }
-    else
-    {
-      pv01s.insert(pair<string, PV01<T>>(productId, pv01));
+    // flow data to listener
+    for (auto& listener : listeners)
+      listener -> ProcessAdd(pv01);
+    PublishSectors(sectors);
+  };
+
+  // Value the products at the mids they were restored at, without flowing to the listeners
+  // _mids holds the mid of each product, 0 if it was never priced
+  void RestorePrices(const double* _mids)
+  {
+    double prices[NUM_PRODUCTS];
+    for (int i = 0; i < NUM_PRODUCTS; ++i) prices[i] = _mids[i] > 0.0 ? _mids[i] : analytics.GetPrice(i);
+    analytics.UpdatePrices(prices);
+    for (auto& pv01 : pv01s) {
+      if (pv01) pv01 -> AddPV01(analytics.GetPV01(getProductIndex(pv01 -> GetProduct().GetProductId())) - pv01 -> GetPV01());
     }
+    RebuildSectors();
+  };
+
+  // Apply the change of a position that the service risks
+  void AddPositionDelta(const PositionDelta& _delta)
+  {
+    PV01<T>& pv01 = GetRisk(_delta.productIndex);
+    pv01.AddQuantity(_delta.quantity);
+    uint32_t sectors = MoveSectors(_delta.productIndex, pv01.GetPV01() * _delta.quantity, _delta.quantity);
+
+    // recompute everything from the positions every reconcileInterval changes, once the matrix
+    // holds no change still to be published, i.e. not in the middle of an epoch or batch
+    if (reconcilePositions && ++deltaCount % reconcileInterval == 0) reconcileDue = true;
+    if (reconcileDue && _delta.complete) Reconcile();
 
     // flow data to listener
     for (auto& listener : listeners)
       listener -> ProcessAdd(pv01);
+    PublishSectors(sectors);
   };
 
-  // Get the bucketed risk for the bucket sector
-  const PV01<BucketedSector<T>>& GetBucketedRisk(const BucketedSector<T>& _sector) const
+  // Check the risked quantities against _positions every _interval changes, 0 to stop checking
+  void SetReconciliation(const PositionMatrix* _positions, long _interval = 1)
+  {
+    reconcilePositions = _interval > 0 ? _positions : nullptr;
+    reconcileInterval = _interval;
+  };
+
+  // Recompute every product's quantity from the positions book by book and compare
+  // A mismatch is logged and corrected; returns true if all quantities matched
+  bool Reconcile()
+  {
+    if (!reconcilePositions) return true;
+    bool matched = true;
+    for (int i = 0; i < NUM_PRODUCTS; ++i) {
+      long quantity = 0;
+      for (int b = 0; b < MAX_BOOKS; ++b) quantity += reconcilePositions -> Get(i, b);
+      long risked = pv01s[i] ? pv01s[i] -> GetQuantity() : 0;
+      if (quantity == risked) continue;
+      logger(LogType::ERROR, "Risk on " + PRODUCT_CUSIPS[i] + " is for " + to_string(risked) + " but the position is " + to_string(quantity));
+      GetRisk(i).AddQuantity(quantity - risked);
+      mismatchCount++;
+      matched = false;
+    }
+    // recompute the sectors as well, shedding any rounding the running sums picked up
+    RebuildSectors();
+    reconcileCount++;
+    reconcileDue = false;
+    return matched;
+  };
+
+  // Get the number of reconciliations run and of products found out of line
+  long GetReconcileCount() const { return reconcileCount; };
+  long GetMismatchCount() const { return mismatchCount; };
+
+  // Add the risk to a checkpoint
+  void SaveCheckpoint(CheckpointWriter& _writer)
   {
-    vector<T>& products = _sector.GetProducts();
-    double pv01BucketVal = 0.0;
-    long quantity = 0;
+    RiskRecord records[NUM_PRODUCTS];
+    size_t count = 0;
+    for (int i = 0; i < NUM_PRODUCTS; ++i) {
+      if (pv01s[i]) records[count++] = RiskRecord{i, pv01s[i] -> GetPV01(), pv01s[i] -> GetQuantity()};
+    }
+    _writer.AddSection(CHECKPOINT_RISK, records, count);
+  };
 
-    for (auto& product : products) {
-      string productId = product.GetProductId();
-      if (pv01s.find(productId) != pv01s.end())
-      {
-        pv01BucketVal += pv01s[productId].GetPV01() * pv01s[productId].GetQuantity();
-        quantity += pv01s[productId].GetQuantity();
+  // Restore the risk from a checkpoint without flowing it to the listeners, false if it has none
+  bool RestoreCheckpoint(const CheckpointReader& _reader)
+  {
+    size_t count;
+    const RiskRecord* records = _reader.GetSection<RiskRecord>(CHECKPOINT_RISK, count);
+    if (!records) return false;
+    for (size_t r = 0; r < count; ++r) {
+      if (!isProductIndex(records[r].productIndex)) {
+        logger(LogType::ERROR, "Risk checkpoint holds an unknown product index " + to_string(records[r].productIndex));
+        return false;
       }
     }
+    for (size_t r = 0; r < count; ++r) {
+      const string& productId = PRODUCT_CUSIPS[records[r].productIndex];
+      pv01s[records[r].productIndex].emplace(getProductObject<T>(productId), records[r].pv01, records[r].quantity, records[r].productIndex);
+    }
+    RebuildSectors();
+    return true;
+  };
 
-    return PV01<BucketedSector<T>>(_sector, pv01BucketVal, quantity);;
+  // Register a sector, returns its ID; its risk is kept up to date from then on
+  int AddSector(const BucketedSector<T>& _sector)
+  {
+    if (sectorCount == MAX_SECTORS) throw invalid_argument("risk service supports at most " + to_string(MAX_SECTORS) + " sectors");
+    if (GetSectorId(_sector.GetName()) >= 0) throw invalid_argument("sector already registered: " + _sector.GetName());
+    int sectorId = sectorCount++;
+    for (auto& product : _sector.GetProducts()) {
+      productSectors[getProductIndex(product.GetProductId())] |= 1u << sectorId;
+    }
+    sectorRisks[sectorId].emplace(_sector, 0.0, 0);
+    RebuildSectors();
+    return sectorId;
+  };
+
+  // Get the ID of a sector by name, -1 if not registered
+  int GetSectorId(const string& _name) const
+  {
+    for (int s = 0; s < sectorCount; ++s) {
+      if (sectorRisks[s] -> GetProduct().GetName() == _name) return s;
+    }
+    return -1;
+  };
+
+  // Get the number of sectors
+  int GetSectorCount() const { return sectorCount; };
+
+  // Add a listener receiving the risk of a sector whenever it changes
+  void AddBucketListener(ServiceListener<PV01<BucketedSector<T>>>* _listener) { bucketListeners.push_back(_listener); };
+
+  // Get the bucketed risk of a sector by ID
+  const PV01<BucketedSector<T>>& GetBucketedRisk(int _sectorId) const { return *sectorRisks[_sectorId]; };
+
+  // Get the bucketed risk for the bucket sector, which must be registered
+  const PV01<BucketedSector<T>>& GetBucketedRisk(const BucketedSector<T>& _sector) const
+  {
+    int sectorId = GetSectorId(_sector.GetName());
+    if (sectorId < 0) throw invalid_argument("sector not registered: " + _sector.GetName());
+    return *sectorRisks[sectorId];
   };
 
 private:
+  // risk of a product, created with no quantity on first use
+  PV01<T>& GetRisk(int _productIndex)
+  {
+    optional<PV01<T>>& pv01 = pv01s[_productIndex];
+    if (!pv01) pv01.emplace(getProductObject<T>(PRODUCT_CUSIPS[_productIndex]), analytics.GetPV01(_productIndex), 0, _productIndex);
+    return *pv01;
+  };
+
+  // move the risk of the sectors holding a product, returns them as a bitmask
+  // _pv01 is PV01 per 100 face times quantity, the sectors hold dollars
+  uint32_t MoveSectors(int _productIndex, double _pv01, long _quantity)
+  {
+    uint32_t sectors = productSectors[_productIndex];
+    for (uint32_t remaining = sectors; remaining; remaining &= remaining - 1) {
+      PV01<BucketedSector<T>>& risk = *sectorRisks[__builtin_ctz(remaining)];
+      risk.AddPV01(_pv01 / 100.0);
+      risk.AddQuantity(_quantity);
+    }
+    return sectors;
+  };
+
+  // flow the risk of the sectors in a bitmask to the bucket listeners
+  void PublishSectors(uint32_t _sectors)
+  {
+    for (; _sectors; _sectors &= _sectors - 1) {
+      PV01<BucketedSector<T>>& risk = *sectorRisks[__builtin_ctz(_sectors)];
+      for (auto& listener : bucketListeners)
+        listener -> ProcessAdd(risk);
+    }
+  };
+
+  // recompute the risk of every sector from the products
+  void RebuildSectors()
+  {
+    for (int s = 0; s < sectorCount; ++s) {
+      PV01<BucketedSector<T>>& risk = *sectorRisks[s];
+      risk = PV01<BucketedSector<T>>(risk.GetProduct(), 0.0, 0);
+    }
+    for (int i = 0; i < NUM_PRODUCTS; ++i) {
+      if (pv01s[i]) MoveSectors(i, pv01s[i] -> GetPV01() * pv01s[i] -> GetQuantity(), pv01s[i] -> GetQuantity());
+    }
+  };
+
   vector<ServiceListener<PV01<T>>*> listeners;
-  map<string, PV01<T>> pv01s;
+  vector<ServiceListener<PV01<BucketedSector<T>>>*> bucketListeners;
+  optional<PV01<T>> pv01s[NUM_PRODUCTS];
+  optional<PV01<BucketedSector<T>>> sectorRisks[MAX_SECTORS];
+  uint32_t productSectors[NUM_PRODUCTS]; // bitmask of the sectors holding each product
+  int sectorCount;
   RiskServiceListener<T>* riskservicelistener;
+  RiskPricingListener<T>* riskpricinglistener;
+  BondAnalytics analytics;
+  const PositionMatrix* reconcilePositions;
+  long reconcileInterval;
+  long deltaCount;
+  bool reconcileDue;
+  long reconcileCount;
+  long mismatchCount;
 };
 
 
 /**
-* Risk Service Listener subscribing data from Position Service to Risk Service.
+* Risk Service Listener subscribing position changes from Position Service to Risk Service.
 * Type T is the product type.
 */
 template<typename T>
-class RiskServiceListener : public ServiceListener<Position<T>>
+class RiskServiceListener : public ServiceListener<PositionDelta>
 {
 private:
   RiskService<T>* riskservice;
@@ -189,13 +411,67 @@ public:
   ~RiskServiceListener() = default;
 
   // Listener callback to process an add event to the Service
-  void ProcessAdd(Position<T>& _data) { riskservice -> AddPosition(_data); };
+  void ProcessAdd(PositionDelta& _data) { riskservice -> AddPositionDelta(_data); };
 
   // Listener callback to process a remove event to the Service
-  void ProcessRemove(Position<T>& _data) {};
+  void ProcessRemove(PositionDelta& _data) {};
 
   // Listener callback to process an update event to the Service
-  void ProcessUpdate(Position<T>& _data) {};
+  void ProcessUpdate(PositionDelta& _data) {};
+
+};
+
+
+/**
+* Risk Pricing Listener subscribing prices from Pricing Service to Risk Service.
+* Type T is the product type.
+*/
+template<typename T>
+class RiskPricingListener : public ServiceListener<Price<T>>
+{
+private:
+  RiskService<T>* riskservice;
+
+public:
+  // ctor and dtor
+  RiskPricingListener(RiskService<T>* _riskservice) : riskservice(_riskservice) {};
+  ~RiskPricingListener() = default;
+
+  // Listener callback to process an add event to the Service
+  void ProcessAdd(Price<T>& _data) { riskservice -> UpdatePrice(getProductIndex(_data.GetProduct().GetProductId()), _data.GetMid()); };
+
+  // Listener callback to process a remove event to the Service
+  void ProcessRemove(Price<T>& _data) {};
+
+  // Listener callback to process an update event to the Service
+  void ProcessUpdate(Price<T>& _data) {};
+
+};
+
+
+/**
+* Pre-Trade Risk PV01 Listener subscribing PV01 from Risk Service to the pre-trade risk gate.
+* Type T is the product type.
+*/
+template<typename T>
+class PreTradeRiskPV01Listener : public ServiceListener<PV01<T>>
+{
+
+public:
+  // ctor
+  PreTradeRiskPV01Listener(PreTradeRiskGate* _gate) : gate(_gate) {};
+
+  // Listener callback to process an add event to the Service
+  void ProcessAdd(PV01<T>& _data) override { gate -> UpdatePV01(getProductIndex(_data.GetProduct().GetProductId()), _data.GetPV01()); };
+
+  // Listener callback to process a remove event to the Service
+  void ProcessRemove(PV01<T>& _data) override {};
+
+  // Listener callback to process an update event to the Service
+  void ProcessUpdate(PV01<T>& _data) override {};
+
+private:
+  PreTradeRiskGate* gate;
 
 };
 
@@ -0,0 +1,278 @@
+/**
+ * scenarioengine.hpp
+ * Scenario risk of the bond positions under parallel shifts, twists and key-rate bumps.
+ *
+ * @author Yicheng Sun
+ */
+
+#ifndef SCENARIO_ENGINE_HPP
+#define SCENARIO_ENGINE_HPP
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <cstdio>
+#include <cstdint>
+#include <stdexcept>
+#include <algorithm>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include "soa.hpp"
+#include "positionservice.hpp"
+#include "riskservice.hpp"
+#include "latencyhistogram.hpp"
+#include "functions.hpp"
+
+using namespace std;
+
+// tenor in years of each product, by product index
+const double PRODUCT_TENORS[NUM_PRODUCTS] = {2, 3, 5, 7, 10, 20, 30};
+
+// P&L rows: one per book, then the total
+const int SCENARIO_ROWS = MAX_BOOKS + 1;
+
+// _out[s] -= sum over products p of _exposures[p] * _shocks[p * _stride + s], for s in [_begin, _end)
+void scenarioKernel(double* _out, const double* _shocks, size_t _stride, const double* _exposures, size_t _begin, size_t _end)
+{
+  for (int p = 0; p < NUM_PRODUCTS; ++p) {
+    if (_exposures[p] == 0.0) continue;
+    const double* row = _shocks + p * _stride;
+    for (size_t s = _begin; s < _end; ++s) _out[s] -= _exposures[p] * row[s];
+  }
+}
+
+#if defined(__x86_64__)
+// the same with AVX2, four scenarios at a time summed over all products in registers
+__attribute__((target("avx2,fma")))
+void scenarioKernelAvx2(double* _out, const double* _shocks, size_t _stride, const double* _exposures, size_t _begin, size_t _end)
+{
+  __m256d exposures[NUM_PRODUCTS];
+  for (int p = 0; p < NUM_PRODUCTS; ++p) exposures[p] = _mm256_set1_pd(_exposures[p]);
+  size_t s = _begin;
+  for (; s + 4 <= _end; s += 4) {
+    __m256d sum = _mm256_setzero_pd();
+    for (int p = 0; p < NUM_PRODUCTS; ++p) sum = _mm256_fmadd_pd(exposures[p], _mm256_loadu_pd(_shocks + p * _stride + s), sum);
+    _mm256_storeu_pd(_out + s, _mm256_sub_pd(_mm256_loadu_pd(_out + s), sum));
+  }
+  scenarioKernel(_out, _shocks, _stride, _exposures, s, _end);
+}
+#endif
+
+
+/**
+ * Scenario engine revaluing the positions under yield curve shocks with their PV01.
+ * A scenario is a shock in basis points per product; the shocks are kept product by
+ * product, each a contiguous row over the scenarios, and the dollar PV01 of every book is
+ * kept as one row per book, so the P&L of a book over all scenarios is a sum over products
+ * of a scalar times a row: the AVX2 kernel (if the CPU has it, a scalar loop otherwise) runs
+ * four scenarios per instruction, and large sets are split across threads by scenario.
+ * P&L is in dollars, minus quantity times PV01 per 100 face times the shock.
+ */
+class ScenarioEngine
+{
+
+public:
+  // ctor, _threads threads at most (0 for one per core), each given at least _minScenariosPerThread
+  ScenarioEngine(const PositionMatrix* _positions, int _threads = 0, size_t _minScenariosPerThread = 4096) :
+    positions(_positions), threads(_threads > 0 ? _threads : max(1u, thread::hardware_concurrency())),
+    minScenariosPerThread(max<size_t>(_minScenariosPerThread, 1)), stride(0), shocksDirty(false), worstScenario(-1)
+  {
+#if defined(__x86_64__)
+    useAvx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#else
+    useAvx2 = false;
+#endif
+    fill(pv01s, pv01s + NUM_PRODUCTS, 0.0);
+  };
+
+  // Add a scenario of one shock in basis points per product, returns its index
+  int AddScenario(const string& _name, const double* _shocks)
+  {
+    names.push_back(_name);
+    scenarioShocks.insert(scenarioShocks.end(), _shocks, _shocks + NUM_PRODUCTS);
+    shocksDirty = true;
+    return (int) names.size() - 1;
+  };
+
+  // Add a parallel shift of the curve
+  int AddParallelShift(double _bp)
+  {
+    double shocks[NUM_PRODUCTS];
+    fill(shocks, shocks + NUM_PRODUCTS, _bp);
+    return AddScenario("parallel " + FormatBp(_bp), shocks);
+  };
+
+  // Add a twist moving the 2Y by _shortBp and the 30Y by _longBp, linear in tenor in between
+  // e.g. a steepener has _shortBp < _longBp, a flattener the reverse
+  int AddTwist(double _shortBp, double _longBp)
+  {
+    double shocks[NUM_PRODUCTS];
+    double first = PRODUCT_TENORS[0];
+    double last = PRODUCT_TENORS[NUM_PRODUCTS - 1];
+    for (int p = 0; p < NUM_PRODUCTS; ++p) shocks[p] = _shortBp + (_longBp - _shortBp) * (PRODUCT_TENORS[p] - first) / (last - first);
+    return AddScenario("twist " + FormatBp(_shortBp) + "/" + FormatBp(_longBp), shocks);
+  };
+
+  // Add a key-rate bump at a product's tenor, fading linearly to zero at the neighbouring key tenors
+  // Every product sits on a key tenor, so only that product moves
+  int AddKeyRate(int _productIndex, double _bp)
+  {
+    if (_productIndex < 0 || _productIndex >= NUM_PRODUCTS) throw invalid_argument("no product " + to_string(_productIndex));
+    double shocks[NUM_PRODUCTS] = {};
+    shocks[_productIndex] = _bp;
+    return AddScenario("key rate " + PRODUCT_CUSIPS[_productIndex] + " " + FormatBp(_bp), shocks);
+  };
+
+  // Update the PV01 of a product, quoted per 100 face
+  void SetPV01(int _productIndex, double _pv01) { pv01s[_productIndex] = _pv01; };
+
+  // Revalue every book and the total under every scenario
+  void Run()
+  {
+    long long start = getSteadyNanos();
+    size_t count = names.size();
+    if (shocksDirty) LayOutShocks();
+
+    // dollar PV01 per product of each book and of the total
+    int rows = 0;
+    for (int b = 0; b < MAX_BOOKS; ++b) {
+      bool used = false;
+      for (int p = 0; p < NUM_PRODUCTS; ++p) {
+        exposures[b][p] = positions -> Get(p, b) * pv01s[p] / 100.0;
+        used |= positions -> IsBookUsed(p, b);
+      }
+      if (used) rows = b + 1;
+    }
+    for (int p = 0; p < NUM_PRODUCTS; ++p) exposures[MAX_BOOKS][p] = positions -> GetProductTotal(p) * pv01s[p] / 100.0;
+    bookCount = rows;
+
+    // split the scenarios across threads, keeping each chunk a multiple of 4
+    size_t chunks = min<size_t>(threads, max<size_t>(1, count / minScenariosPerThread));
+    size_t chunkSize = ((count + chunks - 1) / chunks + 3) & ~(size_t) 3;
+    vector<thread> workers;
+    for (size_t begin = chunkSize; begin < count; begin += chunkSize) {
+      workers.emplace_back(&ScenarioEngine::RunRange, this, begin, min(count, begin + chunkSize));
+    }
+    RunRange(0, min(count, chunkSize));
+    for (auto& worker : workers) worker.join();
+
+    worstScenario = -1;
+    const double* total = pnl.data() + MAX_BOOKS * stride;
+    for (size_t s = 0; s < count; ++s) {
+      if (worstScenario < 0 || total[s] < total[worstScenario]) worstScenario = (int) s;
+    }
+    latency.Record(getSteadyNanos() - start);
+  };
+
+  // Get the P&L of the positions under a scenario, as of the last run
+  double GetPnL(int _scenario) const { return pnl[MAX_BOOKS * stride + _scenario]; };
+
+  // Get the P&L of a book under a scenario, as of the last run
+  double GetBookPnL(int _bookId, int _scenario) const { return _bookId < bookCount ? pnl[_bookId * stride + _scenario] : 0.0; };
+
+  // Get the scenario with the largest loss in the last run, -1 if none
+  int GetWorstScenario() const { return worstScenario; };
+
+  // Get the name of a scenario
+  const string& GetScenarioName(int _scenario) const { return names[_scenario]; };
+
+  // Get the number of scenarios
+  int GetScenarioCount() const { return (int) names.size(); };
+
+  // Check if the AVX2 kernel is used
+  bool UsesAvx2() const { return useAvx2; };
+
+  // Get the time taken by each run
+  const LatencyHistogram& GetLatency() const { return latency; };
+
+private:
+  // e.g. +25bp
+  static string FormatBp(double _bp)
+  {
+    char text[32];
+    snprintf(text, sizeof(text), "%+gbp", _bp);
+    return text;
+  };
+
+  // move the shocks from scenario by scenario to rows of one product over all scenarios
+  void LayOutShocks()
+  {
+    size_t count = names.size();
+    stride = (count + 3) & ~(size_t) 3;
+    shocks.assign(NUM_PRODUCTS * stride, 0.0);
+    for (size_t s = 0; s < count; ++s) {
+      for (int p = 0; p < NUM_PRODUCTS; ++p) shocks[p * stride + s] = scenarioShocks[s * NUM_PRODUCTS + p];
+    }
+    pnl.assign(SCENARIO_ROWS * stride, 0.0);
+    shocksDirty = false;
+  };
+
+  // revalue the scenarios in [_begin, _end) for every book and the total
+  void RunRange(size_t _begin, size_t _end)
+  {
+    for (int r = 0; r < SCENARIO_ROWS; ++r) {
+      if (r >= bookCount && r != MAX_BOOKS) continue;
+      double* out = pnl.data() + r * stride;
+      fill(out + _begin, out + _end, 0.0);
+#if defined(__x86_64__)
+      if (useAvx2) {
+        scenarioKernelAvx2(out, shocks.data(), stride, exposures[r], _begin, _end);
+        continue;
+      }
+#endif
+      scenarioKernel(out, shocks.data(), stride, exposures[r], _begin, _end);
+    }
+  };
+
+  const PositionMatrix* positions;
+  int threads;
+  size_t minScenariosPerThread;
+  bool useAvx2;
+  double pv01s[NUM_PRODUCTS];
+  double exposures[SCENARIO_ROWS][NUM_PRODUCTS]; // dollar PV01 by book, then total
+  int bookCount = 0; // books revalued in the last run
+  vector<string> names;
+  vector<double> scenarioShocks; // scenario by scenario, as added
+  vector<double> shocks; // product by product, stride apart
+  size_t stride;
+  bool shocksDirty;
+  vector<double> pnl; // book by book then the total, stride apart
+  int worstScenario;
+  LatencyHistogram latency;
+
+};
+
+
+/**
+* Scenario Risk Listener subscribing PV01 from Risk Service to the scenario engine, rerunning
+* the scenarios on every change of a product's risk.
+* Type T is the product type.
+*/
+template<typename T>
+class ScenarioRiskListener : public ServiceListener<PV01<T>>
+{
+
+public:
+  // ctor
+  ScenarioRiskListener(ScenarioEngine* _engine) : engine(_engine) {};
+
+  // Listener callback to process an add event to the Service
+  void ProcessAdd(PV01<T>& _data) override
+  {
+    engine -> SetPV01(getProductIndex(_data.GetProduct().GetProductId()), _data.GetPV01());
+    engine -> Run();
+  };
+
+  // Listener callback to process a remove event to the Service
+  void ProcessRemove(PV01<T>& _data) override {};
+
+  // Listener callback to process an update event to the Service
+  void ProcessUpdate(PV01<T>& _data) override {};
+
+private:
+  ScenarioEngine* engine;
+
+};
+
+#endif
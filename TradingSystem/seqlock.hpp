@@ -0,0 +1,71 @@
+/**
+ * seqlock.hpp
+ * Single-writer sequence lock used to share small snapshots across threads.
+ *
+ * @author Yicheng Sun
+ */
+
+#ifndef SEQLOCK_HPP
+#define SEQLOCK_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+using namespace std;
+
+/**
+ * Sequence lock around a trivially copyable value.
+ * The single writer never blocks: it bumps the sequence to odd, copies the value
+ * and bumps the sequence back to even. Readers copy the value out and retry if
+ * the sequence was odd or moved during the copy.
+ * Type V is the snapshot type.
+ */
+template<typename V>
+class alignas(64) SeqLock
+{
+  static_assert(is_trivially_copyable<V>::value, "SeqLock value must be trivially copyable");
+
+public:
+  // ctor
+  SeqLock() : sequence(0), value() {};
+
+  // Publish a new value, must only be called from the writer thread
+  void Store(const V& _value)
+  {
+    uint64_t seq = sequence.load(memory_order_relaxed);
+    sequence.store(seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(&value, &_value, sizeof(V));
+    sequence.store(seq + 2, memory_order_release);
+  };
+
+  // Try to read a consistent value once, false if the read raced with a write
+  bool TryLoad(V& _value) const
+  {
+    uint64_t before = sequence.load(memory_order_acquire);
+    if (before & 1) return false;
+    memcpy(&_value, &value, sizeof(V));
+    atomic_thread_fence(memory_order_acquire);
+    return sequence.load(memory_order_relaxed) == before;
+  };
+
+  // Read a consistent value, retrying while the writer is mid-update
+  V Load() const
+  {
+    V _value;
+    while (!TryLoad(_value)) {}
+    return _value;
+  };
+
+  // Get the number of completed writes
+  uint64_t GetVersion() const { return sequence.load(memory_order_acquire) >> 1; };
+
+private:
+  atomic<uint64_t> sequence;
+  V value;
+
+};
+
+#endif
@@ -0,0 +1,401 @@
+/**
+ * slicingengine.hpp
+ * Parent/child order slicing engine (TWAP, VWAP, iceberg) for algo execution.
+ *
+ * @author Yicheng Sun
+ */
+
+#ifndef SLICING_ENGINE_HPP
+#define SLICING_ENGINE_HPP
+
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <functional>
+#include "timerwheel.hpp"
+#include "marketdataservice.hpp"
+#include "functions.hpp"
+
+using namespace std;
+
+// Slicing strategy of a parent order
+enum SliceStrategy { TWAP, VWAP, ICEBERG };
+
+/**
+ * Handle on a parent order. The generation guards against using a handle
+ * after its pooled slot has been recycled for another parent.
+ */
+struct ParentHandle
+{
+  int index;
+  uint32_t generation;
+
+  bool IsValid() const { return index >= 0; };
+};
+
+/**
+ * A child slice released to the market, pooled and linked to its parent.
+ */
+struct ChildSlice
+{
+  int parentIndex;
+  int productIndex;
+  PricingSide side;
+  long quantity;
+  long filledQuantity;
+  long cancelledQuantity; // left unfilled by the market, given back to the parent
+  double price;
+  long long releaseNanos;
+  int next; // next child of the same parent, or next free slot
+};
+
+/**
+ * Pooled state of a parent order.
+ */
+struct ParentOrder
+{
+  int productIndex;
+  PricingSide side;
+  SliceStrategy strategy;
+  long totalQuantity;
+  long releasedQuantity; // less any quantity the market left unfilled
+  long filledQuantity;
+  long openQuantity; // released and neither filled nor cancelled yet
+  long pendingQuantity; // due by schedule but not yet released
+  long displayQuantity; // iceberg clip size
+  double limitPrice; // 0 for no limit
+  long long startNanos;
+  long long intervalNanos;
+  int sliceCount;
+  int slicesDue;
+  uint32_t generation;
+  bool active;
+  bool waiting; // linked in its product's market data list
+  int prevWaiting;
+  int nextWaiting;
+  int firstChild;
+  int nextFree;
+};
+
+
+/**
+ * Slicing engine holding up to a fixed number of active parent orders in a pool.
+ * Parents are identified by their pool index, which is stable while they are active.
+ * TWAP and VWAP parents release slices on a timer wheel; iceberg parents release the
+ * next clip on the first top-of-book change after the previous clip is done. A slice
+ * that cannot go out (no book, limit not reachable) waits in its product's list and is
+ * retried on the next top-of-book change, so a tick only visits parents waiting on that product.
+ * Fills and cancels of the child slices are reported back: quantity the market left unfilled
+ * goes back to the parent to be released again, and a parent completes once filled in full.
+ * Child slices are kept in a pooled array and linked to their parent until it completes.
+ */
+class SlicingEngine
+{
+
+public:
+  // callback invoked for every child slice released
+  typedef function<void(int childIndex, const ChildSlice& child, const ParentOrder& parent)> ChildHandler;
+
+  // ctor
+  SlicingEngine(int _maxParents = 4096, int _initialChildren = 65536) : timers(_maxParents, 1024, 1000000)
+  {
+    parents.resize(_maxParents);
+    for (int i = 0; i < _maxParents; ++i) {
+      parents[i].active = false;
+      parents[i].generation = 0;
+      parents[i].nextFree = (i + 1 < _maxParents) ? i + 1 : -1;
+    }
+    freeParent = _maxParents > 0 ? 0 : -1;
+    children.reserve(_initialChildren);
+    freeChild = -1;
+    activeCount = 0;
+    completedCount = 0;
+    childCount = 0;
+    filledQuantity = 0;
+    for (int i = 0; i < NUM_PRODUCTS; ++i) {
+      waitingHead[i] = -1;
+      books[i] = TopOfBook{0.0, 0, 0.0, 0, false};
+    }
+    timers.Reset(getSteadyNanos());
+  };
+
+  // Set the handler receiving released child slices
+  void SetChildHandler(ChildHandler _handler) { handler = _handler; };
+
+  // Submit a parent order, returns an invalid handle if the pool is full
+  // _duration and _slices define the TWAP/VWAP schedule; _displayQuantity is the iceberg clip
+  ParentHandle Submit(int _productIndex, PricingSide _side, long _quantity, SliceStrategy _strategy, long long _durationNanos, int _slices, long _displayQuantity, double _limitPrice, long long _now)
+  {
+    if (freeParent < 0 || _quantity <= 0) return ParentHandle{-1, 0};
+    int index = freeParent;
+    ParentOrder& parent = parents[index];
+    freeParent = parent.nextFree;
+
+    parent.productIndex = _productIndex;
+    parent.side = _side;
+    parent.strategy = _strategy;
+    parent.totalQuantity = _quantity;
+    parent.releasedQuantity = 0;
+    parent.filledQuantity = 0;
+    parent.openQuantity = 0;
+    parent.pendingQuantity = 0;
+    parent.displayQuantity = max(_displayQuantity, 1L);
+    parent.limitPrice = _limitPrice;
+    parent.startNanos = _now;
+    parent.sliceCount = max(_slices, 1);
+    parent.intervalNanos = _durationNanos / parent.sliceCount;
+    parent.slicesDue = 0;
+    parent.active = true;
+    parent.waiting = false;
+    parent.firstChild = -1;
+    activeCount++;
+
+    // nothing is released inside Submit: the first TWAP/VWAP slice is due on the next poll,
+    // the first iceberg clip on the next top-of-book change
+    if (_strategy == ICEBERG) {
+      parent.pendingQuantity = min(parent.displayQuantity, _quantity);
+      Wait(index);
+    } else {
+      timers.Schedule(index, _now);
+    }
+    return ParentHandle{index, parent.generation};
+  };
+
+  // Cancel a parent order, its unreleased quantity is dropped
+  bool Cancel(ParentHandle _handle)
+  {
+    if (!IsLive(_handle)) return false;
+    Complete(_handle.index);
+    return true;
+  };
+
+  // Market data update of a product, retries only the parents waiting on it if its top of book changed
+  void OnMarketData(int _productIndex, double _bidPrice, long _bidQuantity, double _offerPrice, long _offerQuantity, long long _now)
+  {
+    TopOfBook& book = books[_productIndex];
+    if (book.valid && book.bidPrice == _bidPrice && book.bidQuantity == _bidQuantity && book.offerPrice == _offerPrice && book.offerQuantity == _offerQuantity) return;
+    book = TopOfBook{_bidPrice, _bidQuantity, _offerPrice, _offerQuantity, true};
+    int index = waitingHead[_productIndex];
+    while (index >= 0) {
+      int following = parents[index].nextWaiting;
+      ParentOrder& parent = parents[index];
+      // iceberg: the previous clip is filled or cancelled, refill the display
+      if (parent.strategy == ICEBERG && parent.pendingQuantity == 0 && parent.openQuantity == 0) {
+        parent.pendingQuantity = min(parent.displayQuantity, parent.totalQuantity - parent.releasedQuantity);
+      }
+      TryRelease(index, _now);
+      index = following;
+    }
+  };
+
+  // Advance the timer wheel and release the slices that came due
+  void Poll(long long _now)
+  {
+    timers.Advance(_now, [&](int _index) { OnSliceDue(_index, _now); });
+  };
+
+  // Report a fill on a child slice of a parent, returns true once the child is done
+  // A report for a parent no longer active is ignored
+  bool OnChildFill(ParentHandle _handle, int _childIndex, long _quantity)
+  {
+    if (!IsLive(_handle)) return true;
+    ChildSlice& child = children[_childIndex];
+    ParentOrder& parent = parents[_handle.index];
+    child.filledQuantity += _quantity;
+    parent.filledQuantity += _quantity;
+    parent.openQuantity -= _quantity;
+    filledQuantity += _quantity;
+    bool done = child.filledQuantity + child.cancelledQuantity >= child.quantity;
+    if (parent.filledQuantity >= parent.totalQuantity) {
+      completedCount++;
+      Complete(_handle.index);
+    }
+    return done;
+  };
+
+  // Report quantity of a child slice the market will not fill, returns true once the child is done
+  // The quantity goes back to the parent: TWAP/VWAP retry it on the next top-of-book change,
+  // iceberg in its next clip
+  bool OnChildCancel(ParentHandle _handle, int _childIndex, long _quantity)
+  {
+    if (!IsLive(_handle)) return true;
+    ChildSlice& child = children[_childIndex];
+    ParentOrder& parent = parents[_handle.index];
+    child.cancelledQuantity += _quantity;
+    parent.openQuantity -= _quantity;
+    parent.releasedQuantity -= _quantity;
+    if (parent.strategy != ICEBERG) parent.pendingQuantity += _quantity;
+    Wait(_handle.index);
+    return child.filledQuantity + child.cancelledQuantity >= child.quantity;
+  };
+
+  // Check if a handle still refers to an active parent
+  bool IsLive(ParentHandle _handle) const
+  {
+    return _handle.IsValid() && parents[_handle.index].active && parents[_handle.index].generation == _handle.generation;
+  };
+
+  // Get a parent order, nullptr if the handle is stale
+  const ParentOrder* GetParent(ParentHandle _handle) const { return IsLive(_handle) ? &parents[_handle.index] : nullptr; };
+
+  // Get a child slice
+  const ChildSlice& GetChild(int _childIndex) const { return children[_childIndex]; };
+
+  // Get the number of active parent orders
+  int GetActiveCount() const { return activeCount; };
+
+  // Get the maximum number of active parent orders
+  int GetCapacity() const { return (int) parents.size(); };
+
+  // Get the number of parents filled in full, child slices released and quantity filled so far
+  long GetCompletedCount() const { return completedCount; };
+  long GetChildCount() const { return childCount; };
+  long GetFilledQuantity() const { return filledQuantity; };
+
+private:
+  struct TopOfBook
+  {
+    double bidPrice;
+    long bidQuantity;
+    double offerPrice;
+    long offerQuantity;
+    bool valid;
+  };
+
+  // cumulative fraction of the parent quantity due after _slices slices
+  double CumulativeTarget(const ParentOrder& _parent, int _slices) const
+  {
+    int n = _parent.sliceCount;
+    if (_slices >= n) return 1.0;
+    if (_parent.strategy == TWAP || n == 1) return (double) _slices / n;
+
+    // VWAP: U-shaped intraday volume profile w_j = 1 + 0.5 * x_j^2, x_j from -1 to 1, summed in closed form
+    auto cumulative = [n](int k) {
+      double m = n - 1;
+      double sumSquares = 4.0 / (m * m) * (k - 1.0) * k * (2.0 * k - 1.0) / 6.0 - 4.0 / m * (k - 1.0) * k / 2.0 + k;
+      return k + 0.5 * sumSquares;
+    };
+    return cumulative(_slices) / cumulative(n);
+  };
+
+  // timer callback: the next scheduled slice of a TWAP/VWAP parent is due
+  void OnSliceDue(int _index, long long _now)
+  {
+    ParentOrder& parent = parents[_index];
+    parent.slicesDue++;
+    long target = (long) (parent.totalQuantity * CumulativeTarget(parent, parent.slicesDue) + 0.5);
+    parent.pendingQuantity = target - parent.releasedQuantity;
+    TryRelease(_index, _now);
+    if (!parent.active) return;
+
+    if (parent.slicesDue < parent.sliceCount) {
+      timers.Schedule(_index, parent.startNanos + parent.slicesDue * parent.intervalNanos);
+    }
+    if (parent.pendingQuantity > 0) Wait(_index);
+  };
+
+  // release as much of the pending quantity as the top of book allows
+  void TryRelease(int _index, long long _now)
+  {
+    ParentOrder& parent = parents[_index];
+    const TopOfBook& book = books[parent.productIndex];
+    if (parent.pendingQuantity <= 0 || !book.valid) return;
+
+    // child crosses the spread, within the limit
+    bool buy = parent.side == BID;
+    double price = buy ? book.offerPrice : book.bidPrice;
+    long touch = buy ? book.offerQuantity : book.bidQuantity;
+    if (parent.limitPrice > 0 && (buy ? price > parent.limitPrice : price < parent.limitPrice)) return;
+    long quantity = touch > 0 ? min(parent.pendingQuantity, touch) : parent.pendingQuantity;
+
+    int childIndex = AllocateChild();
+    ChildSlice& child = children[childIndex];
+    child = ChildSlice{_index, parent.productIndex, parent.side, quantity, 0, 0, price, _now, parent.firstChild};
+    parent.firstChild = childIndex;
+    parent.releasedQuantity += quantity;
+    parent.openQuantity += quantity;
+    parent.pendingQuantity -= quantity;
+    childCount++;
+
+    // the parent waits for its fills once everything is released; iceberg keeps waiting for its next clip
+    if (parent.releasedQuantity >= parent.totalQuantity || (parent.pendingQuantity == 0 && parent.strategy != ICEBERG)) {
+      Unwait(_index);
+    }
+
+    // last, as the handler may send the child and hear back from the market
+    if (handler) handler(childIndex, child, parent);
+  };
+
+  // link a parent into its product's market data list
+  void Wait(int _index)
+  {
+    ParentOrder& parent = parents[_index];
+    if (parent.waiting) return;
+    int& head = waitingHead[parent.productIndex];
+    parent.prevWaiting = -1;
+    parent.nextWaiting = head;
+    if (head >= 0) parents[head].prevWaiting = _index;
+    head = _index;
+    parent.waiting = true;
+  };
+
+  // unlink a parent from its product's market data list
+  void Unwait(int _index)
+  {
+    ParentOrder& parent = parents[_index];
+    if (!parent.waiting) return;
+    if (parent.prevWaiting >= 0) parents[parent.prevWaiting].nextWaiting = parent.nextWaiting;
+    else waitingHead[parent.productIndex] = parent.nextWaiting;
+    if (parent.nextWaiting >= 0) parents[parent.nextWaiting].prevWaiting = parent.prevWaiting;
+    parent.waiting = false;
+  };
+
+  // retire a parent and recycle its slot and children
+  void Complete(int _index)
+  {
+    ParentOrder& parent = parents[_index];
+    Unwait(_index);
+    timers.Cancel(_index);
+    int child = parent.firstChild;
+    while (child >= 0) {
+      int following = children[child].next;
+      children[child].next = freeChild;
+      freeChild = child;
+      child = following;
+    }
+    parent.firstChild = -1;
+    parent.active = false;
+    parent.generation++;
+    parent.nextFree = freeParent;
+    freeParent = _index;
+    activeCount--;
+  };
+
+  // take a child slot from the free list, growing the pool if needed
+  int AllocateChild()
+  {
+    if (freeChild >= 0) {
+      int index = freeChild;
+      freeChild = children[index].next;
+      return index;
+    }
+    children.push_back(ChildSlice());
+    return (int) children.size() - 1;
+  };
+
+  vector<ParentOrder> parents;
+  vector<ChildSlice> children;
+  int freeParent;
+  int freeChild;
+  int activeCount;
+  long completedCount;
+  long childCount;
+  long filledQuantity;
+  int waitingHead[NUM_PRODUCTS];
+  TopOfBook books[NUM_PRODUCTS];
+  TimerWheel timers;
+  ChildHandler handler;
+
+};
+
+#endif
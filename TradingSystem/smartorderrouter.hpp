@@ -0,0 +1,215 @@
+/**
+ * smartorderrouter.hpp
+ * Smart order router splitting orders across venues on precomputed consolidated depth.
+ *
+ * @author Yicheng Sun
+ */
+
+#ifndef SMART_ORDER_ROUTER_HPP
+#define SMART_ORDER_ROUTER_HPP
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <algorithm>
+#include "soa.hpp"
+#include "marketdataservice.hpp"
+#include "algoexecutionservice.hpp"
+#include "exchangesimulator.hpp"
+#include "latencyhistogram.hpp"
+#include "functions.hpp"
+
+const int ROUTER_MAX_VENUES = CME + 1;
+const int ROUTER_LADDER_LEVELS = ROUTER_MAX_VENUES * EXCHANGE_BOOK_DEPTH;
+
+/**
+ * Venue the router can send to. Market data carries no venue, so each venue is taken to
+ * show a share of every level of the book.
+ */
+struct VenueConfig
+{
+  Market market;
+  double depthShare; // share of each level's quantity shown on the venue
+  double fee; // per 100 face, in price points
+  long long latencyNanos; // one-way latency to the venue
+};
+
+/**
+ * Child order of a routed order.
+ */
+struct RouteSlice
+{
+  Market market;
+  double price; // worst price the child reaches on its venue
+  long quantity;
+};
+
+
+/**
+ * Smart order router. On every book update it splits each level across the venues by
+ * their depth share, publishes each venue's book to its exchange, and builds per product
+ * and side a consolidated ladder of all venue levels ordered by effective price: the price
+ * plus the venue fee plus latency at a cost per microsecond, since slower venues are more
+ * likely to have moved. Alongside the ladder it keeps the cumulative quantity and, for every
+ * rung, each venue's quantity and worst price above it.
+ * Routing an order then finds the rung where the cumulative quantity covers it and reads
+ * each venue's share off the precomputed rows, without walking any book. Quantity beyond
+ * the displayed depth goes to the venue with the best effective price.
+ */
+class SmartOrderRouter
+{
+
+public:
+  // ctor, _latencyCost in price points per microsecond of venue latency
+  SmartOrderRouter(double _latencyCost = 0.0) : latencyCost(_latencyCost), venueCount(0), routedCount(0)
+  {
+    for (int i = 0; i < NUM_PRODUCTS; ++i) {
+      for (int s = 0; s < 2; ++s) ladders[i][s].levels = 0;
+    }
+  };
+
+  // Add a venue, with the exchange receiving its share of the books if any
+  void AddVenue(const VenueConfig& _venue, ExchangeSimulator* _exchange = nullptr)
+  {
+    if (venueCount == ROUTER_MAX_VENUES) throw invalid_argument("router supports at most " + to_string(ROUTER_MAX_VENUES) + " venues");
+    if (_venue.depthShare < 0.0) throw invalid_argument("venue depth share must not be negative");
+    venues[venueCount] = _venue;
+    exchanges[venueCount] = _exchange;
+    routedQuantities[venueCount] = 0;
+    venueCount++;
+  };
+
+  // Publish a product's book to the venues and rebuild its ladders
+  void UpdateBook(int _productIndex, const BookSnapshot& _book)
+  {
+    for (int v = 0; v < venueCount; ++v) {
+      BookSnapshot venueBook = _book;
+      for (int l = 0; l < venueBook.bidLevels; ++l) venueBook.bidQuantities[l] = llround(_book.bidQuantities[l] * venues[v].depthShare);
+      for (int l = 0; l < venueBook.offerLevels; ++l) venueBook.offerQuantities[l] = llround(_book.offerQuantities[l] * venues[v].depthShare);
+      if (exchanges[v]) exchanges[v] -> UpdateBook(_productIndex, venueBook);
+    }
+    // buying takes the offers, selling the bids
+    BuildLadder(ladders[_productIndex][BID], _book.offerPrices, _book.offerQuantities, _book.offerLevels, true);
+    BuildLadder(ladders[_productIndex][OFFER], _book.bidPrices, _book.bidQuantities, _book.bidLevels, false);
+  };
+
+  // Split an order across the venues, returns the number of child orders written to _slices
+  // _slices must hold ROUTER_MAX_VENUES entries
+  int Route(int _productIndex, PricingSide _side, long _quantity, RouteSlice* _slices)
+  {
+    long long start = getSteadyNanos();
+    const Ladder& ladder = ladders[_productIndex][_side];
+    int count = 0;
+    if (ladder.levels == 0 || _quantity <= 0) {
+      latency.Record(getSteadyNanos() - start);
+      return 0;
+    }
+
+    // first rung whose cumulative quantity covers the order, or the last one
+    int rung = (int) (lower_bound(ladder.cumulative, ladder.cumulative + ladder.levels, _quantity) - ladder.cumulative);
+    rung = min(rung, ladder.levels - 1);
+    long before = rung > 0 ? ladder.cumulative[rung - 1] : 0;
+    long partial = min(_quantity, ladder.cumulative[rung]) - before;
+    long overflow = max(0L, _quantity - ladder.cumulative[rung]);
+
+    for (int v = 0; v < venueCount; ++v) {
+      long quantity = ladder.venueQuantities[rung][v] + (ladder.venues[rung] == v ? partial : 0) + (ladder.venues[0] == v ? overflow : 0);
+      if (quantity <= 0) continue;
+      double price = ladder.venues[rung] == v ? ladder.prices[rung] : ladder.venuePrices[rung][v];
+      _slices[count++] = RouteSlice{venues[v].market, price, quantity};
+      routedQuantities[v] += quantity;
+    }
+    routedCount++;
+    latency.Record(getSteadyNanos() - start);
+    return count;
+  };
+
+  // Get the number of venues
+  int GetVenueCount() const { return venueCount; };
+
+  // Get a venue
+  const VenueConfig& GetVenue(int _venue) const { return venues[_venue]; };
+
+  // Get the quantity routed to a venue
+  long GetRoutedQuantity(int _venue) const { return routedQuantities[_venue]; };
+
+  // Get the number of orders routed
+  uint64_t GetRoutedCount() const { return routedCount; };
+
+  // Get the routing latency
+  const LatencyHistogram& GetLatency() const { return latency; };
+
+private:
+  // consolidated levels of one product and side, best effective price first
+  struct Ladder
+  {
+    int levels;
+    uint8_t venues[ROUTER_LADDER_LEVELS];
+    double prices[ROUTER_LADDER_LEVELS];
+    long cumulative[ROUTER_LADDER_LEVELS]; // quantity up to and including the rung
+    long venueQuantities[ROUTER_LADDER_LEVELS][ROUTER_MAX_VENUES]; // per venue, above the rung
+    double venuePrices[ROUTER_LADDER_LEVELS][ROUTER_MAX_VENUES]; // worst price per venue above the rung, NaN if none
+  };
+
+  struct Rung
+  {
+    double effectivePrice;
+    double price;
+    long quantity;
+    int venue;
+  };
+
+  void BuildLadder(Ladder& _ladder, const double* _prices, const long* _quantities, int _levels, bool _buy)
+  {
+    Rung rungs[ROUTER_LADDER_LEVELS];
+    int count = 0;
+    for (int v = 0; v < venueCount; ++v) {
+      double cost = venues[v].fee + latencyCost * venues[v].latencyNanos / 1000.0;
+      for (int l = 0; l < _levels; ++l) {
+        long quantity = llround(_quantities[l] * venues[v].depthShare);
+        if (quantity <= 0) continue;
+        rungs[count++] = Rung{_buy ? _prices[l] + cost : _prices[l] - cost, _prices[l], quantity, v};
+      }
+    }
+    // at most 15 rungs: insertion sort, stable so earlier venues win ties
+    for (int i = 1; i < count; ++i) {
+      Rung rung = rungs[i];
+      int j = i - 1;
+      while (j >= 0 && (_buy ? rungs[j].effectivePrice > rung.effectivePrice : rungs[j].effectivePrice < rung.effectivePrice)) {
+        rungs[j + 1] = rungs[j];
+        j--;
+      }
+      rungs[j + 1] = rung;
+    }
+
+    long total = 0;
+    long venueQuantities[ROUTER_MAX_VENUES] = {};
+    double venuePrices[ROUTER_MAX_VENUES];
+    fill(venuePrices, venuePrices + ROUTER_MAX_VENUES, numeric_limits<double>::quiet_NaN());
+    for (int r = 0; r < count; ++r) {
+      copy(venueQuantities, venueQuantities + ROUTER_MAX_VENUES, _ladder.venueQuantities[r]);
+      copy(venuePrices, venuePrices + ROUTER_MAX_VENUES, _ladder.venuePrices[r]);
+      total += rungs[r].quantity;
+      _ladder.venues[r] = (uint8_t) rungs[r].venue;
+      _ladder.prices[r] = rungs[r].price;
+      _ladder.cumulative[r] = total;
+      venueQuantities[rungs[r].venue] += rungs[r].quantity;
+      venuePrices[rungs[r].venue] = rungs[r].price;
+    }
+    _ladder.levels = count;
+  };
+
+  VenueConfig venues[ROUTER_MAX_VENUES];
+  ExchangeSimulator* exchanges[ROUTER_MAX_VENUES];
+  long routedQuantities[ROUTER_MAX_VENUES];
+  double latencyCost;
+  int venueCount;
+  Ladder ladders[NUM_PRODUCTS][2]; // by product, then side of the order
+  uint64_t routedCount;
+  LatencyHistogram latency;
+
+};
+
+#endif
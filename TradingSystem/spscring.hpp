@@ -0,0 +1,95 @@
+/**
+ * spscring.hpp
+ * Bounded single-producer single-consumer ring of fixed-size records.
+ *
+ * @author Yicheng Sun
+ */
+
+#ifndef SPSC_RING_HPP
+#define SPSC_RING_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+using namespace std;
+
+/**
+ * Lock-free ring buffer with one producer thread and one consumer thread.
+ * Storage is preallocated; capacity is rounded up to a power of two.
+ * Each side caches the other side's index so a push or pop normally touches
+ * only its own cache line.
+ * Type R is the record type.
+ */
+template<typename R>
+class SpscRing
+{
+
+public:
+  // ctor
+  SpscRing(size_t _capacity) : head(0), cachedTail(0), tail(0), cachedHead(0)
+  {
+    size_t capacity = 1;
+    while (capacity < _capacity) capacity <<= 1;
+    buffer.resize(capacity);
+    mask = capacity - 1;
+  };
+
+  // Push a record from the producer thread, false if the ring is full
+  bool TryPush(const R& _record)
+  {
+    size_t h = head.load(memory_order_relaxed);
+    if (h - cachedTail > mask) {
+      cachedTail = tail.load(memory_order_acquire);
+      if (h - cachedTail > mask) return false;
+    }
+    buffer[h & mask] = _record;
+    head.store(h + 1, memory_order_release);
+    return true;
+  };
+
+  // Pop a record from the consumer thread, false if the ring is empty
+  bool TryPop(R& _record)
+  {
+    size_t t = tail.load(memory_order_relaxed);
+    if (t == cachedHead) {
+      cachedHead = head.load(memory_order_acquire);
+      if (t == cachedHead) return false;
+    }
+    _record = buffer[t & mask];
+    tail.store(t + 1, memory_order_release);
+    return true;
+  };
+
+  // Hand up to _max records to _func in place on the consumer thread, returns the number consumed
+  template<typename F>
+  size_t ConsumeBatch(F&& _func, size_t _max)
+  {
+    size_t t = tail.load(memory_order_relaxed);
+    cachedHead = head.load(memory_order_acquire);
+    size_t n = cachedHead - t;
+    if (n > _max) n = _max;
+    for (size_t i = 0; i < n; ++i) {
+      _func(buffer[(t + i) & mask]);
+    }
+    tail.store(t + n, memory_order_release);
+    return n;
+  };
+
+  // Check if the ring is empty (approximate when called concurrently)
+  bool Empty() const { return head.load(memory_order_acquire) == tail.load(memory_order_acquire); };
+
+  // Get the capacity of the ring
+  size_t GetCapacity() const { return mask + 1; };
+
+private:
+  vector<R> buffer;
+  size_t mask;
+  alignas(64) atomic<size_t> head; // written by the producer
+  size_t cachedTail; // producer's copy of tail
+  alignas(64) atomic<size_t> tail; // written by the consumer
+  size_t cachedHead; // consumer's copy of head
+
+};
+
+#endif
@@ -8,9 +8,47 @@
 #ifndef STREAMING_SERVICE_HPP
 #define STREAMING_SERVICE_HPP
 
+#include <cstdio>
 #include "soa.hpp"
+#include "asyncwriter.hpp"
 #include "algostreamingservice.hpp"
 
+// Fields of a two-way quote, used as bits of the change mask
+enum QuoteField { BID_PRICE = 1, BID_VISIBLE = 2, BID_HIDDEN = 4, OFFER_PRICE = 8, OFFER_VISIBLE = 16, OFFER_HIDDEN = 32, ALL_QUOTE_FIELDS = 63 };
+
+/**
+ * Delta update of a two-way quote against the last quote published for the product.
+ * Only the fields flagged in the change mask need to be sent downstream.
+ */
+struct PriceStreamUpdate
+{
+  int productIndex;
+  unsigned changeMask;
+  double bidPrice;
+  long bidVisibleQuantity;
+  long bidHiddenQuantity;
+  double offerPrice;
+  long offerVisibleQuantity;
+  long offerHiddenQuantity;
+};
+
+// format the changed fields of a quote update as a text line, returns the number of bytes written
+size_t FormatPriceStreamUpdate(const PriceStreamUpdate& _update, char* _buffer)
+{
+  const char* sep = " ";
+  char* p = _buffer;
+  p += sprintf(p, "Price Stream (Product %s):", PRODUCT_CUSIPS[_update.productIndex].c_str());
+  if (_update.changeMask & BID_PRICE) { p += sprintf(p, "%sBid Price: %.6f", sep, _update.bidPrice); sep = ", "; }
+  if (_update.changeMask & BID_VISIBLE) { p += sprintf(p, "%sBid VisibleQuantity: %ld", sep, _update.bidVisibleQuantity); sep = ", "; }
+  if (_update.changeMask & BID_HIDDEN) { p += sprintf(p, "%sBid HiddenQuantity: %ld", sep, _update.bidHiddenQuantity); sep = ", "; }
+  if (_update.changeMask & OFFER_PRICE) { p += sprintf(p, "%sAsk Price: %.6f", sep, _update.offerPrice); sep = ", "; }
+  if (_update.changeMask & OFFER_VISIBLE) { p += sprintf(p, "%sAsk VisibleQuantity: %ld", sep, _update.offerVisibleQuantity); sep = ", "; }
+  if (_update.changeMask & OFFER_HIDDEN) { p += sprintf(p, "%sAsk HiddenQuantity: %ld", sep, _update.offerHiddenQuantity); }
+  *p++ = '\n';
+  return p - _buffer;
+}
+
+
 // forward declaration of connector and streamingservice listener
 template<typename T>
 class StreamingServiceConnector;
@@ -31,6 +69,13 @@ public:
   StreamingService() 
   {
     streamingservicelistener = new StreamingServiceListener<T>(this);
+    connector = new StreamingServiceConnector<T>(this);
+    conflation = true;
+    publishedCount = 0;
+    suppressedCount = 0;
+    for (int i = 0; i < NUM_PRODUCTS; ++i) {
+      hasLastQuote[i] = false;
+    }
   };
   ~StreamingService() = default;
 
@@ -52,31 +97,84 @@ public:
   // Get the connector
   StreamingServiceConnector<T>* GetConnector() { return connector; };
 
-  // Publish two-way prices
-  void PublishPrice(const PriceStream<T>& priceStream) { connector -> Publish(priceStream); };
+  // Turn suppression of unchanged two-way quotes on or off
+  void SetConflation(bool _conflation) { conflation = _conflation; };
+
+  // Get the number of quotes published and suppressed
+  long GetPublishedCount() const { return publishedCount; };
+  long GetSuppressedCount() const { return suppressedCount; };
+
+  // Get the fraction of incoming quotes suppressed as unchanged
+  double GetSuppressionRatio() const
+  {
+    long total = publishedCount + suppressedCount;
+    return total == 0 ? 0.0 : (double) suppressedCount / total;
+  };
 
   // called by streaming service listener to subscribe data from algo streaming service
   void AddPriceStream(const AlgoStream<T>& _algoStream) {
     PriceStream<T> priceStream = _algoStream.GetPriceStream();
     string key = priceStream.GetProduct().GetProductId();
-    
-    // update the pricestream map, create if key not already exist
-    if (priceStreams.find(key) != priceStreams.end()) {
-        priceStreams.erase(key);
+
+    // diff against the last quote, drop it if nothing changed, or send it whole when not conflating
+    PriceStreamUpdate update = Diff(priceStream);
+    if (update.changeMask == 0) {
+      if (conflation) {
+        suppressedCount++;
+        return;
+      }
+      update.changeMask = ALL_QUOTE_FIELDS;
     }
-    priceStreams.insert(pair<string, PriceStream<T>>(key, priceStream));
+    publishedCount++;
+
+    // update the pricestream map, create if key not already exist
+    priceStreams.insert_or_assign(key, priceStream);
 
     // flow the data to listeners
     for (auto& listener : listeners) {
         listener -> ProcessAdd(priceStream);
     }
+
+    // publish only the changed fields
+    connector -> PublishUpdate(priceStream, update);
   };
 
 private:
+  // compute the change mask of a quote and remember it as the last quote
+  PriceStreamUpdate Diff(const PriceStream<T>& _priceStream)
+  {
+    const PriceStreamOrder& bid = _priceStream.GetBidOrder();
+    const PriceStreamOrder& offer = _priceStream.GetOfferOrder();
+    int index = _priceStream.GetProductIndex();
+    PriceStreamUpdate update{index, 0, bid.GetPrice(), bid.GetVisibleQuantity(), bid.GetHiddenQuantity(),
+      offer.GetPrice(), offer.GetVisibleQuantity(), offer.GetHiddenQuantity()};
+
+    const PriceStreamUpdate& last = lastQuotes[index];
+    if (!hasLastQuote[index]) {
+      update.changeMask = ALL_QUOTE_FIELDS;
+    } else {
+      update.changeMask = (update.bidPrice != last.bidPrice ? BID_PRICE : 0)
+        | (update.bidVisibleQuantity != last.bidVisibleQuantity ? BID_VISIBLE : 0)
+        | (update.bidHiddenQuantity != last.bidHiddenQuantity ? BID_HIDDEN : 0)
+        | (update.offerPrice != last.offerPrice ? OFFER_PRICE : 0)
+        | (update.offerVisibleQuantity != last.offerVisibleQuantity ? OFFER_VISIBLE : 0)
+        | (update.offerHiddenQuantity != last.offerHiddenQuantity ? OFFER_HIDDEN : 0);
+    }
+
+    lastQuotes[index] = update;
+    hasLastQuote[index] = true;
+    return update;
+  };
+
   map<string, PriceStream<T>> priceStreams;
   vector<ServiceListener<PriceStream<T>>*> listeners;
   StreamingServiceConnector<T>* connector;
   StreamingServiceListener<T>* streamingservicelistener;
+  PriceStreamUpdate lastQuotes[NUM_PRODUCTS];
+  bool hasLastQuote[NUM_PRODUCTS];
+  bool conflation;
+  long publishedCount;
+  long suppressedCount;
 };
 
 
@@ -92,11 +190,11 @@ private:
 
 public:
   // ctor and dtor
-  StreamingServiceConnector(StreamingService<T>* _service) : service(_service) {};
+  StreamingServiceConnector(StreamingService<T>* _service) : service(_service), publisher(nullptr) {};
   ~StreamingServiceConnector() = default;
 
   // Publish data to the Connector
-  void Publish(const PriceStream<T>& _data) {
+  void Publish(PriceStream<T>& _data) override {
     // Print the price stream data
     T product = _data.GetProduct();
     string productId = product.GetProductId();
@@ -109,6 +207,26 @@ public:
          << ", Ask Price: " << offer.GetPrice() << ", VisibleQuantity: " << offer.GetVisibleQuantity()
          << ", HiddenQuantity: " << offer.GetHiddenQuantity() << endl;
   }
+
+  // Publish only the fields flagged in the update's change mask
+  void PublishUpdate(const PriceStream<T>& _data, const PriceStreamUpdate& _update) {
+    // hand the update to the async publisher if one is attached, formatting happens on its thread
+    if (publisher) {
+      publisher -> Enqueue(_update);
+      return;
+    }
+    char buffer[512];
+    size_t length = FormatPriceStreamUpdate(_update, buffer);
+    cout.write(buffer, length);
+  }
+
+  // Route quotes through an async batched publisher instead of cout
+  void SetPublisher(AsyncRecordWriter<PriceStreamUpdate>* _publisher) { publisher = _publisher; };
+
+  void Subscribe(ifstream& _data) override {};
+
+private:
+  AsyncRecordWriter<PriceStreamUpdate>* publisher;
 };
 
 
@@ -126,10 +244,8 @@ public:
 
   // Listener callback to process an add event to the Service
   void ProcessAdd(AlgoStream<T>& _data) override {
+    // flow data to the service, which publishes changed quotes only
     streamingService -> AddPriceStream(_data);
-    PriceStream<T> priceStream = _data.GetPriceStream();
-    // flow data to the service
-    streamingService -> PublishPrice(priceStream);
   };
 
   // Listener callback to process a remove event to the Service
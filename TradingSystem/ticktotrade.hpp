@@ -0,0 +1,174 @@
+/**
+ * ticktotrade.hpp
+ * Fused fast path from a decoded market data line to an order sent to the exchange.
+ *
+ * @author Yicheng Sun
+ */
+
+#ifndef TICK_TO_TRADE_HPP
+#define TICK_TO_TRADE_HPP
+
+#include <vector>
+#include "soa.hpp"
+#include "marketdataservice.hpp"
+#include "algoexecutionservice.hpp"
+#include "executionservice.hpp"
+#include "exchangesimulator.hpp"
+#include "pretraderisk.hpp"
+#include "smartorderrouter.hpp"
+#include "orderstore.hpp"
+#include "latencyhistogram.hpp"
+#include "idgenerator.hpp"
+#include "functions.hpp"
+
+static_assert(BOOK_TICK_DEPTH <= EXCHANGE_BOOK_DEPTH, "exchange snapshots must hold every level of a tick");
+
+/**
+ * Tick to trade path, set as the tick handler of the market data connector.
+ * On each decoded line it publishes the levels to the exchanges and the risk gate,
+ * takes the algo decision on the top of book, checks the order against the gate and
+ * sends it, all in one call on plain arrays: no map, order book or ExecutionOrder is built.
+ * With a smart order router the books reach the exchanges through it and the order is
+ * split into child orders across the venues; without one every exchange gets the whole
+ * book and the order goes whole to its market.
+ * The order is stored in Execution Service before it goes out so its reports find it.
+ * Everything else, i.e. the latest algo execution and the execution order listeners such
+ * as persistence, is deferred until the service has published the book of the line.
+ * Tick to trade latency runs from reading the line to handing the order to the exchange.
+ * Type T is the product type.
+ */
+template<typename T>
+class TickToTradePath : public BookTickHandler
+{
+
+public:
+  // ctor
+  TickToTradePath(AlgoExecutionService<T>* _algoExecutionService, ExecutionService<T>* _executionService, PreTradeRiskGate* _gate = nullptr, Market _market = BROKERTEC) :
+    algoExecutionService(_algoExecutionService), executionService(_executionService), gate(_gate), router(nullptr), market(_market), sentCount(0)
+  {
+    deferred.reserve(16);
+  };
+
+  // Publish books and split orders through a smart order router
+  void SetRouter(SmartOrderRouter* _router) { router = _router; };
+
+  // Decide and send on a decoded line
+  void OnBookTick(const BookTick& _tick) override
+  {
+    int index = _tick.productIndex;
+    BookSnapshot book;
+    book.bidLevels = book.offerLevels = _tick.depth;
+    for (int l = 0; l < _tick.depth; ++l) {
+      book.bidPrices[l] = _tick.bidPrices[l];
+      book.bidQuantities[l] = _tick.bidQuantities[l];
+      book.offerPrices[l] = _tick.offerPrices[l];
+      book.offerQuantities[l] = _tick.offerQuantities[l];
+    }
+    if (router) router -> UpdateBook(index, book);
+    else executionService -> GetConnector() -> UpdateBook(index, book);
+    if (_tick.depth == 0) return;
+    if (gate) gate -> UpdateBook(index, _tick.bidPrices[0], _tick.offerPrices[0]);
+
+    AlgoDecision decision;
+    if (!algoExecutionService -> Decide(index, _tick.bidPrices[0], _tick.bidQuantities[0], _tick.offerPrices[0], _tick.offerQuantities[0], decision)) return;
+    if (gate && gate -> Check(index, decision.side, decision.quantity, decision.price) != 0) return;
+
+    OrderRecord record;
+    record.orderId = IdGenerator::Next("A");
+    record.parentOrderId = IdGenerator::Next("AP");
+    record.priceTicks = toPriceTicks(decision.price);
+    record.visibleQuantity = decision.quantity;
+    record.hiddenQuantity = 0;
+    record.filledQuantity = 0;
+    record.productIndex = index;
+    record.side = (uint8_t) decision.side;
+    record.orderType = (uint8_t) MARKET;
+    record.market = (uint8_t) market;
+    record.state = ORDER_NEW;
+    record.isChildOrder = false;
+
+    if (!router) {
+      if (!Send(record)) {
+        // nothing went out: give the quantity back to the gate
+        if (gate) gate -> Release(index, decision.side, decision.quantity);
+        return;
+      }
+      deferred.push_back(DeferredOrder{record, true, true});
+    }
+    else {
+      // the algo order itself is never sent, only its children
+      deferred.push_back(DeferredOrder{record, true, false});
+      RouteSlice slices[ROUTER_MAX_VENUES];
+      int count = router -> Route(index, decision.side, decision.quantity, slices);
+      OrderRecord child = record;
+      child.parentOrderId = record.orderId;
+      child.isChildOrder = true;
+      long sent = 0;
+      for (int c = 0; c < count; ++c) {
+        child.orderId = IdGenerator::Next("R");
+        child.priceTicks = toPriceTicks(slices[c].price);
+        child.visibleQuantity = slices[c].quantity;
+        child.market = (uint8_t) slices[c].market;
+        if (!Send(child)) continue;
+        deferred.push_back(DeferredOrder{child, false, true});
+        sent += slices[c].quantity;
+      }
+      // the router found too little depth, or a venue could not take its slice
+      if (gate && sent < decision.quantity) gate -> Release(index, decision.side, decision.quantity - sent);
+    }
+    latency.Record(getSteadyNanos() - _tick.receiveNanos);
+  };
+
+  // Catch up on the bookkeeping of the orders sent, then on the exchange reports
+  void OnTickDone() override
+  {
+    for (auto& order : deferred) {
+      ExecutionOrder<T> executionOrder = executionService -> ToExecutionOrder(order.record);
+      if (order.isAlgoOrder) algoExecutionService -> RecordExecution(AlgoExecution<T>(executionOrder, market));
+      if (order.isSent) executionService -> NotifyOrder(executionOrder);
+    }
+    deferred.clear();
+    executionService -> PollExchanges();
+  };
+
+  // Get the tick to trade latency
+  const LatencyHistogram& GetLatency() const { return latency; };
+
+  // Get the number of orders sent
+  uint64_t GetSentCount() const { return sentCount; };
+
+private:
+  // order whose bookkeeping waits until the book is published
+  struct DeferredOrder
+  {
+    OrderRecord record;
+    bool isAlgoOrder; // latest algo execution of its product
+    bool isSent; // went to an exchange
+  };
+
+  // store an order and send it to its market's exchange
+  bool Send(const OrderRecord& _record)
+  {
+    executionService -> TrackOrder(_record);
+    OrderRequest request{_record.orderId, _record.productIndex, (PricingSide) _record.side, (OrderType) _record.orderType,
+      fromPriceTicks(_record.priceTicks), _record.visibleQuantity, getSteadyNanos()};
+    if (!executionService -> GetConnector() -> SendRequest((Market) _record.market, request)) {
+      logger(LogType::ERROR, "Tick to trade path failed to send order " + _record.orderId.ToString() + " to market " + to_string(_record.market));
+      return false;
+    }
+    sentCount++;
+    return true;
+  };
+
+  AlgoExecutionService<T>* algoExecutionService;
+  ExecutionService<T>* executionService;
+  PreTradeRiskGate* gate;
+  SmartOrderRouter* router;
+  Market market;
+  vector<DeferredOrder> deferred;
+  LatencyHistogram latency;
+  uint64_t sentCount;
+
+};
+
+#endif
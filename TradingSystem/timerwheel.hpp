@@ -0,0 +1,112 @@
+/**
+ * timerwheel.hpp
+ * Hashed timer wheel for a fixed population of timers.
+ *
+ * @author Yicheng Sun
+ */
+
+#ifndef TIMER_WHEEL_HPP
+#define TIMER_WHEEL_HPP
+
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+using namespace std;
+
+/**
+ * Hashed timer wheel keyed on dense timer ids (0 ... maxTimers-1).
+ * Each slot holds an intrusive doubly linked list of timers, so schedule and
+ * cancel are O(1) and advancing the wheel only visits the slots of the elapsed
+ * ticks, independent of how many timers exist. Timers further out than one
+ * revolution stay in their slot until their tick comes round.
+ * Times are in nanoseconds on any monotonic clock.
+ */
+class TimerWheel
+{
+
+public:
+  // ctor, _slots is rounded up to a power of two
+  TimerWheel(size_t _maxTimers, size_t _slots = 512, int64_t _tickNanos = 1000000) : tickNanos(_tickNanos), currentTick(0)
+  {
+    size_t slots = 1;
+    while (slots < _slots) slots <<= 1;
+    mask = slots - 1;
+    heads.assign(slots, -1);
+    next.assign(_maxTimers, -1);
+    prev.assign(_maxTimers, -1);
+    expiryTick.assign(_maxTimers, -1);
+  };
+
+  // Set the current time without firing anything
+  void Reset(int64_t _nowNanos) { currentTick = _nowNanos / tickNanos; };
+
+  // Schedule (or reschedule) timer _id to fire at _expiryNanos
+  void Schedule(int _id, int64_t _expiryNanos)
+  {
+    if (IsScheduled(_id)) Cancel(_id);
+    // round up so a timer never fires early, and never into the current tick
+    int64_t tick = max((_expiryNanos + tickNanos - 1) / tickNanos, currentTick + 1);
+    expiryTick[_id] = tick;
+    int& head = heads[tick & mask];
+    prev[_id] = -1;
+    next[_id] = head;
+    if (head >= 0) prev[head] = _id;
+    head = _id;
+  };
+
+  // Cancel timer _id if it is scheduled
+  void Cancel(int _id)
+  {
+    if (!IsScheduled(_id)) return;
+    if (prev[_id] >= 0) next[prev[_id]] = next[_id];
+    else heads[expiryTick[_id] & mask] = next[_id];
+    if (next[_id] >= 0) prev[next[_id]] = prev[_id];
+    expiryTick[_id] = -1;
+  };
+
+  // Check if timer _id is scheduled
+  bool IsScheduled(int _id) const { return expiryTick[_id] >= 0; };
+
+  // Advance the wheel to _nowNanos and call _onExpire(id) for every timer due, returns the number fired
+  template<typename F>
+  size_t Advance(int64_t _nowNanos, F&& _onExpire)
+  {
+    int64_t target = _nowNanos / tickNanos;
+    if (target <= currentTick) return 0;
+
+    // after a long gap one revolution visits every slot
+    int64_t steps = min<int64_t>(target - currentTick, mask + 1);
+    size_t fired = 0;
+    for (int64_t s = 1; s <= steps; ++s) {
+      int id = heads[(currentTick + s) & mask];
+      while (id >= 0) {
+        int following = next[id];
+        if (expiryTick[id] <= target) {
+          Cancel(id);
+          fired++;
+          // the callback may reschedule the fired timer, but must not touch other timers
+          _onExpire(id);
+        }
+        id = following;
+      }
+    }
+    currentTick = target;
+    return fired;
+  };
+
+  // Get the tick length
+  int64_t GetTickNanos() const { return tickNanos; };
+
+private:
+  int64_t tickNanos;
+  int64_t currentTick;
+  size_t mask;
+  vector<int> heads;
+  vector<int> next;
+  vector<int> prev;
+  vector<int64_t> expiryTick;
+
+};
+
+#endif
@@ -9,8 +9,18 @@
 
 #include <string>
 #include <vector>
+#include <optional>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "soa.hpp"
 #include "executionservice.hpp"
+#include "idgenerator.hpp"
+#include "tradejournal.hpp"
+#include "tradeidfilter.hpp"
+#include "checkpoint.hpp"
 
 // Trade sides
 enum Side { BUY, SELL };
@@ -27,20 +37,25 @@ public:
 
   // ctor for a trade
   Trade() = default;
-  Trade(const T &_product, string _tradeId, double _price, string _book, long _quantity, Side _side) :
-    product(_product), tradeId(_tradeId), price(_price), book(_book), quantity(_quantity), side(_side) {};
+  Trade(const T &_product, const FixedId& _tradeId, double _price, string _book, long _quantity, Side _side) :
+    product(_product), tradeId(_tradeId), price(_price), bookId(internBook(_book)), quantity(_quantity), side(_side) {};
+  Trade(const T &_product, const FixedId& _tradeId, double _price, int _bookId, long _quantity, Side _side) :
+    product(_product), tradeId(_tradeId), price(_price), bookId(_bookId), quantity(_quantity), side(_side) {};
 
   // Get the product
   const T& GetProduct() const { return product; };
 
   // Get the trade ID
-  const string& GetTradeId() const { return tradeId; };
+  const FixedId& GetTradeId() const { return tradeId; };
 
   // Get the mid price
   double GetPrice() const { return price; };
 
   // Get the book
-  const string& GetBook() const { return book; };
+  const string& GetBook() const { return getBookName(bookId); };
+
+  // Get the interned ID of the book
+  int GetBookId() const { return bookId; };
 
   // Get the quantity
   long GetQuantity() const { return quantity; };
@@ -50,20 +65,34 @@ public:
 
 private:
   T product;
-  string tradeId;
+  FixedId tradeId;
   double price;
-  string book;
+  int bookId = -1;
   long quantity;
   Side side;
 
 };
 
 
+/**
+ * Trades booked in bulk: their records in file order, and their net signed quantity per
+ * product and book so listeners can apply the whole batch at once.
+ */
+struct TradeBatch
+{
+  vector<TradeRecord> records;
+  long positions[NUM_PRODUCTS][MAX_BOOKS]; // indexed by book ID
+  uint32_t books[NUM_PRODUCTS]; // bitmask of the books each product traded in
+};
+
+
 // forward declaration of connector and a tradebooking listener
 template<typename T>
 class TradeBookingConnector;
 template<typename T>
 class TradeBookingServiceListener;
+template<typename T>
+class TradeBookingFillListener;
 
 /**
  * Trade Booking Service to book trades to a particular book.
@@ -80,25 +109,30 @@ public:
   {
     connector = new TradeBookingConnector<T>(this);
     tradebookinglistener = new TradeBookingServiceListener<T>(this);
+    filllistener = new TradeBookingFillListener<T>(this);
+    journal = nullptr;
+    keepTrades = true;
+    tradeIds = nullptr;
   };
   ~TradeBookingService() = default;
 
-  // Get data from service
-  Trade<T>& GetData(string _key) { return trades[_key]; };
+  // Get data from service, from the journal if trades are not kept in memory
+  // A trade read from the journal is valid until the next call
+  Trade<T>& GetData(string _key)
+  {
+    if (keepTrades || !journal) return trades[_key];
+    const TradeRecord* record = _key.size() <= (size_t) FixedId::CAPACITY ? journal -> Find(FixedId(_key)) : nullptr;
+    tradeView = record ? ToTrade(*record) : Trade<T>();
+    return tradeView;
+  };
 
   // The callback that a Connector should invoke for any new or updated data
   void OnMessage(Trade<T>& _data)
   {
-    string _key = _data.GetTradeId();
-    // create _key if not already exist
-    if (trades.find(_key) != trades.end()) 
-    {
-      trades[_key] = _data;
-    }
-    else 
-    {
-      trades.insert(pair<string, Trade<T>>(_key, _data));
-    }
+    // a trade booked before is dropped before it reaches the listeners
+    if (tradeIds && !tradeIds -> Insert(_data.GetTradeId())) return;
+    if (journal) journal -> Append(ToRecord(_data));
+    if (keepTrades) trades.insert_or_assign(_data.GetTradeId().ToString(), _data);
       
     // flow data to the service
     for(auto& listener : listeners) 
@@ -107,9 +141,35 @@ public:
     }
   };
 
+  // Book a batch of trades loaded in bulk: journal and keep every trade, then flow the batch
+  // once to the batch listeners; the listeners of single trades do not hear of it
+  void OnBatch(TradeBatch& _batch)
+  {
+    size_t kept = 0;
+    for (auto& record : _batch.records) {
+      // drop trades booked before, and take them out of the batch positions
+      if (tradeIds && !tradeIds -> Insert(record.tradeId)) {
+        _batch.positions[record.productIndex][internBook(record.book.ToString())] -= record.side == BUY ? record.quantity : -record.quantity;
+        continue;
+      }
+      if (journal) journal -> Append(record);
+      if (keepTrades) trades.insert_or_assign(record.tradeId.ToString(), ToTrade(record));
+      _batch.records[kept++] = record;
+    }
+    _batch.records.resize(kept);
+
+    for (auto& listener : batchListeners)
+    {
+      listener -> ProcessAdd(_batch);
+    }
+  };
+
   // Add a listener to the Service for callbacks on add, remove, and update events for data to the Service.
   void AddListener(ServiceListener<Trade<T>>* _listener) { listeners.push_back(_listener); };
 
+  // Add a listener receiving trades booked in bulk, once per batch
+  void AddBatchListener(ServiceListener<TradeBatch>* _listener) { batchListeners.push_back(_listener); };
+
   // Get all listeners on the Service.
   const vector<ServiceListener<Trade<T>>*>& GetListeners() const { return listeners; };
 
@@ -119,11 +179,120 @@ public:
   // Get associated trade book listener
   TradeBookingServiceListener<T>* GetTradeBookingServiceListener() { return tradebookinglistener; };
 
+  // Get the listener booking exchange fills
+  TradeBookingFillListener<T>* GetTradeBookingFillListener() { return filllistener; };
+
+  // Book trades into a journal, and keep them in memory as well or not
+  void SetJournal(TradeJournal* _journal, bool _keepTrades = false)
+  {
+    journal = _journal;
+    keepTrades = _keepTrades || !_journal;
+  };
+
+  // Get the trade journal, nullptr if trades are only kept in memory
+  TradeJournal* GetJournal() { return journal; };
+
+  // Reject trades whose ID was booked before, checked against _tradeIds
+  // Set it before restoring a checkpoint, which fills it with the trades already booked
+  void SetTradeIdFilter(TradeIdFilter* _tradeIds) { tradeIds = _tradeIds; };
+
+  // Get the filter of booked trade IDs, nullptr if trades are not checked
+  TradeIdFilter* GetTradeIdFilter() { return tradeIds; };
+
+  // Add the trades kept in memory to a checkpoint, and the size and tail of the journal
+  // Journaled trades stay in the journal, which restores itself when opened
+  void SaveCheckpoint(CheckpointWriter& _writer)
+  {
+    vector<TradeRecord> records;
+    if (keepTrades) {
+      records.reserve(trades.size());
+      for (auto& item : trades) records.push_back(ToRecord(item.second));
+    }
+    uint64_t journalState[2] = {journal ? journal -> GetCount() : 0, journal ? journal -> GetTail() : 0};
+    _writer.AddSection(CHECKPOINT_TRADES, records.data(), records.size());
+    _writer.AddSection(CHECKPOINT_TRADE_JOURNAL, journalState, 2);
+  };
+
+  // Restore the trades from a checkpoint without flowing them to the listeners, false if it has none
+  // or the journal ends before it did when the checkpoint was written
+  // Trades journaled after the checkpoint are dropped, the positions and risk restored do not hold them
+  bool RestoreCheckpoint(const CheckpointReader& _reader)
+  {
+    size_t count;
+    size_t journalEntries;
+    const TradeRecord* records = _reader.GetSection<TradeRecord>(CHECKPOINT_TRADES, count);
+    const uint64_t* journalState = _reader.GetSection<uint64_t>(CHECKPOINT_TRADE_JOURNAL, journalEntries);
+    if (!records || !journalState || journalEntries != 2) return false;
+    for (size_t r = 0; r < count; ++r) {
+      if (!isProductIndex(records[r].productIndex)) {
+        logger(LogType::ERROR, "Trade checkpoint holds an unknown product index " + to_string(records[r].productIndex));
+        return false;
+      }
+    }
+    if (journal) {
+      uint64_t journalTail = journal -> GetTail();
+      if (journalTail > journalState[1]) {
+        logger(LogType::INFO, "Trade journal truncated to the checkpoint, dropping trades journaled after it.");
+      }
+      if (!journal -> Truncate(journalState[1]) || journal -> GetCount() != journalState[0]) {
+        logger(LogType::ERROR, "Trade journal holds " + to_string(journal -> GetCount()) + " trades up to the checkpoint, which expects " + to_string(journalState[0]));
+        return false;
+      }
+    }
+    if (keepTrades) {
+      for (size_t r = 0; r < count; ++r) trades.insert_or_assign(records[r].tradeId.ToString(), ToTrade(records[r]));
+    }
+    RebuildTradeIds(records, count);
+    return true;
+  };
+
+  // Rebuild a trade from its journal record
+  Trade<T> ToTrade(const TradeRecord& _record)
+  {
+    if (!isProductIndex(_record.productIndex)) throw invalid_argument("Unknown product index in trade record: " + to_string(_record.productIndex));
+    optional<T>& product = products[_record.productIndex];
+    if (!product) product = getProductObject<T>(PRODUCT_CUSIPS[_record.productIndex]);
+    return Trade<T>(*product, _record.tradeId, _record.price, _record.book.ToString(), _record.quantity, (Side) _record.side);
+  };
+
 private:
+  // fill the trade ID filter with the trades booked up to the checkpoint, so a replayed trade is still dropped
+  void RebuildTradeIds(const TradeRecord* _records, size_t _count)
+  {
+    if (!tradeIds) return;
+    tradeIds -> Clear();
+    auto add = [this](const TradeRecord& _record) {
+      if (!tradeIds -> Contains(_record.tradeId)) tradeIds -> Insert(_record.tradeId);
+    };
+    for (size_t r = 0; r < _count; ++r) add(_records[r]);
+    if (journal) journal -> ForEach(add);
+  };
+
+  // journal record of a trade
+  static TradeRecord ToRecord(const Trade<T>& _trade)
+  {
+    TradeRecord record{};
+    record.tradeId = _trade.GetTradeId();
+    record.book = FixedId(_trade.GetBook());
+    record.price = _trade.GetPrice();
+    record.quantity = _trade.GetQuantity();
+    record.timestampNanos = chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+    record.productIndex = getProductIndex(_trade.GetProduct().GetProductId());
+    record.side = (uint8_t) _trade.GetSide();
+    return record;
+  };
+
   map<string, Trade<T>> trades;
+  TradeJournal* journal;
+  bool keepTrades;
+  TradeIdFilter* tradeIds;
+  Trade<T> tradeView;
+  optional<T> products[NUM_PRODUCTS];
   vector<ServiceListener<Trade<T>>*> listeners;
+  vector<ServiceListener<TradeBatch>*> batchListeners;
   TradeBookingConnector<T>* connector;
   TradeBookingServiceListener<T>* tradebookinglistener;
+  TradeBookingFillListener<T>* filllistener;
 
 };
 
@@ -150,6 +319,7 @@ public:
   void Subscribe(ifstream& _data)
   {
     string _line;
+    size_t badLines = 0;
     while (getline(_data, _line))
     {
       vector<string> lineVec;
@@ -158,10 +328,16 @@ public:
       while (getline(ss, attribute, ',')) {
         lineVec.push_back(attribute);
       }
+      // trade IDs and books are fixed-size IDs, like in ParseChunk
+      if (lineVec.size() != 6 || lineVec[1].empty() || lineVec[1].size() > (size_t) FixedId::CAPACITY ||
+          lineVec[3].empty() || lineVec[3].size() > (size_t) FixedId::CAPACITY) {
+        badLines++;
+        continue;
+      }
 
       string productId = lineVec[0];
       T product = getProductObject<T>(productId);
-      string tradeId = lineVec[1];
+      FixedId tradeId(lineVec[1]);
       double price = convertPrice(lineVec[2]);
       string book = lineVec[3];
       long quantity = stol(lineVec[4]);
@@ -173,6 +349,146 @@ public:
       // flows data to tradebooking service
       service -> OnMessage(trade);
     }
+    if (badLines > 0) logger(LogType::ERROR, "Skipped " + to_string(badLines) + " malformed trade lines");
+  };
+
+  // Book a whole trades file at once, returns the number of trades booked
+  // The file is mapped and split into chunks parsed on _threads threads (0 for one per core);
+  // each chunk sums its own positions per product and book, and the sums are added up into
+  // one batch for the service
+  size_t BulkLoad(const string& _path, int _threads = 0)
+  {
+    int fd = open(_path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      logger(LogType::ERROR, "Cannot open trades file " + _path);
+      return 0;
+    }
+    struct stat info;
+    fstat(fd, &info);
+    size_t bytes = (size_t) info.st_size;
+    void* mapped = bytes > 0 ? mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (mapped == MAP_FAILED) return 0;
+    const char* data = (const char*) mapped;
+
+    // chunks of at least 64KB, cut after a line end
+    if (_threads <= 0) _threads = max(1u, thread::hardware_concurrency());
+    size_t chunkCount = min((size_t) _threads, max<size_t>(1, bytes >> 16));
+    vector<TradeChunk> chunks(chunkCount);
+    vector<thread> workers;
+    const char* begin = data;
+    for (size_t c = 0; c < chunkCount; ++c) {
+      const char* end = c + 1 == chunkCount ? data + bytes : data + bytes * (c + 1) / chunkCount;
+      while (end < data + bytes && end[-1] != '\n') ++end;
+      if (c + 1 == chunkCount) ParseChunk(begin, end, chunks[c]);
+      else workers.emplace_back(&TradeBookingConnector<T>::ParseChunk, begin, end, ref(chunks[c]));
+      begin = end;
+    }
+    for (auto& worker : workers) worker.join();
+    munmap(mapped, bytes);
+
+    // reduce the chunks, mapping their books to book IDs
+    TradeBatch batch{};
+    size_t badLines = 0;
+    for (auto& chunk : chunks) {
+      for (int b = 0; b < chunk.bookCount; ++b) {
+        int bookId = internBook(chunk.books[b].ToString());
+        for (int i = 0; i < NUM_PRODUCTS; ++i) {
+          if (!((chunk.usedBooks[i] >> b) & 1u)) continue;
+          batch.positions[i][bookId] += chunk.positions[i][b];
+          batch.books[i] |= 1u << bookId;
+        }
+      }
+      batch.records.insert(batch.records.end(), chunk.records.begin(), chunk.records.end());
+      badLines += chunk.badLines;
+    }
+    if (badLines > 0) logger(LogType::ERROR, "Skipped " + to_string(badLines) + " malformed lines of " + _path);
+
+    service -> OnBatch(batch);
+    return batch.records.size();
+  };
+
+private:
+  // trades parsed from one chunk of a file, with books numbered in order of appearance
+  struct TradeChunk
+  {
+    vector<TradeRecord> records;
+    FixedId books[MAX_BOOKS];
+    int bookCount = 0;
+    long positions[NUM_PRODUCTS][MAX_BOOKS] = {}; // indexed by chunk book number
+    uint32_t usedBooks[NUM_PRODUCTS] = {};
+    size_t badLines = 0;
+  };
+
+  // parse the lines product,trade ID,price,book,quantity,side in [_begin, _end) in place
+  static void ParseChunk(const char* _begin, const char* _end, TradeChunk& _chunk)
+  {
+    const int fieldCount = 6;
+    const char* fields[fieldCount];
+    size_t lengths[fieldCount];
+    int64_t now = chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+    _chunk.records.reserve((_end - _begin) / 48);
+
+    const char* line = _begin;
+    while (line < _end) {
+      const char* lineEnd = (const char*) memchr(line, '\n', _end - line);
+      if (!lineEnd) lineEnd = _end;
+      const char* next = lineEnd + 1;
+      if (lineEnd > line && lineEnd[-1] == '\r') --lineEnd;
+      if (lineEnd == line) {
+        line = next;
+        continue;
+      }
+
+      int count = 0;
+      const char* start = line;
+      while (count < fieldCount && start <= lineEnd) {
+        const char* comma = (const char*) memchr(start, ',', lineEnd - start);
+        if (!comma) comma = lineEnd;
+        fields[count] = start;
+        lengths[count++] = comma - start;
+        start = comma + 1;
+      }
+      int productIndex = -1;
+      for (int i = 0; count == fieldCount && i < NUM_PRODUCTS; ++i) {
+        if (PRODUCT_CUSIPS[i].size() == lengths[0] && memcmp(PRODUCT_CUSIPS[i].data(), fields[0], lengths[0]) == 0) productIndex = i;
+      }
+      if (productIndex < 0 || lengths[1] == 0 || lengths[1] > (size_t) FixedId::CAPACITY || lengths[3] == 0 || lengths[3] > (size_t) FixedId::CAPACITY) {
+        _chunk.badLines++;
+        line = next;
+        continue;
+      }
+
+      TradeRecord record{};
+      try {
+        record.price = convertPrice(fields[2], lengths[2]);
+      }
+      catch (const invalid_argument&) {
+        _chunk.badLines++;
+        line = next;
+        continue;
+      }
+      FixedId book(fields[3], lengths[3]);
+      int b = 0;
+      while (b < _chunk.bookCount && _chunk.books[b] != book) ++b;
+      if (b == MAX_BOOKS) {
+        _chunk.badLines++;
+        line = next;
+        continue;
+      }
+      if (b == _chunk.bookCount) _chunk.books[_chunk.bookCount++] = book;
+
+      record.tradeId = FixedId(fields[1], lengths[1]);
+      record.book = book;
+      record.quantity = strtol(fields[4], nullptr, 10);
+      record.timestampNanos = now;
+      record.productIndex = productIndex;
+      record.side = (uint8_t) (lengths[5] == 3 && memcmp(fields[5], "BUY", 3) == 0 ? BUY : SELL);
+      _chunk.records.push_back(record);
+      _chunk.positions[productIndex][b] += record.side == BUY ? record.quantity : -record.quantity;
+      _chunk.usedBooks[productIndex] |= 1u << b;
+      line = next;
+    }
   };
 };
 
@@ -194,7 +510,7 @@ public:
   void ProcessAdd(ExecutionOrder<T>& _data) override
   {
     T product = _data.GetProduct();
-    string orderId = _data.GetOrderId();
+    const FixedId& orderId = _data.GetOrderId();
     double price = _data.GetPrice();
     long quantity = _data.GetVisibleQuantity() + _data.GetHiddenQuantity();
     Side side = (_data.GetSide() == BID) ? BUY : SELL;
@@ -228,4 +544,51 @@ private:
 };
 
 
+/**
+ * Trade Booking Fill Listener booking the fills sent back by the exchanges through Execution Service.
+ * Each fill becomes a trade keyed on its execution ID; books are cycled as for executed orders.
+ * Type T is the product type.
+ */
+template<typename T>
+class TradeBookingFillListener : public ServiceListener<ExchangeReport>
+{
+
+public:
+  // ctor and dtor
+  TradeBookingFillListener(TradeBookingService<T>* _service) : service(_service), count(0)
+  {
+    for (int b = 0; b < 3; ++b) bookIds[b] = internBook("TRSY" + to_string(b + 1));
+  };
+  ~TradeBookingFillListener() = default;
+
+  // Listener callback to process an add event to the Service
+  void ProcessAdd(ExchangeReport& _data) override
+  {
+    if (_data.type != REPORT_FILL) return;
+    optional<T>& product = products[_data.productIndex];
+    if (!product) product = getProductObject<T>(PRODUCT_CUSIPS[_data.productIndex]);
+    Side side = (_data.side == BID) ? BUY : SELL;
+
+    // cycle through the 3 books TRSY1 ... TRSY3
+    count++;
+    Trade<T> trade(*product, _data.execId, _data.price, bookIds[count % 3], _data.quantity, side);
+    // flow data to the trade booking service
+    service -> OnMessage(trade);
+  };
+
+  // Listener callback to process a remove event to the Service
+  void ProcessRemove(ExchangeReport& _data) override {};
+
+  // Listener callback to process an update event to the Service
+  void ProcessUpdate(ExchangeReport& _data) override {};
+
+private:
+  int bookIds[3];
+  TradeBookingService<T>* service;
+  long count;
+  optional<T> products[NUM_PRODUCTS];
+
+};
+
+
 #endif
@@ -0,0 +1,158 @@
+/**
+ * tradeidfilter.hpp
+ * Set of 64-bit trade ID fingerprints to reject trades booked twice.
+ *
+ * @author Yicheng Sun
+ */
+
+#ifndef TRADE_ID_FILTER_HPP
+#define TRADE_ID_FILTER_HPP
+
+#include <vector>
+#include <cstdint>
+#include <stdexcept>
+#include <algorithm>
+#include "idgenerator.hpp"
+
+using namespace std;
+
+/**
+ * Set of the trade IDs booked so far, keeping only a 64-bit fingerprint of each in an
+ * open-addressing table at most half full, i.e. 16 bytes per trade of the day. Two IDs with
+ * the same fingerprint would be taken for one, which for a day of a million trades happens
+ * with odds well under 1 in 10^7.
+ * An optional bloom filter of 8 bits per expected ID, 3 hashes, sits in front: an ID it has
+ * never seen is new without looking at the table, which helps Contains when most IDs asked
+ * about are new and the table has outgrown the cache.
+ * The table doubles past the expected count and is never trimmed, as forgetting an ID would
+ * let its trade be booked again: memory is unbounded within a day, 16 bytes per trade, and
+ * Clear starts a new day. Not thread-safe.
+ */
+class TradeIdFilter
+{
+
+public:
+  // ctor, _expectedIds sizes the table and the bloom filter
+  TradeIdFilter(size_t _expectedIds = 1 << 16, bool _useBloom = false) : count(0), duplicateCount(0)
+  {
+    if (_expectedIds == 0) throw invalid_argument("trade ID filter must expect at least one ID");
+    size_t size = 1;
+    while (size < 2 * _expectedIds) size <<= 1;
+    table.assign(size, EMPTY);
+    mask = size - 1;
+    if (_useBloom) {
+      bloom.assign(max<size_t>(size / 16, 1), 0); // 8 bits per expected ID
+      bloomMask = bloom.size() * 64 - 1;
+    }
+  };
+
+  // Add an ID, returns false if it was already there
+  bool Insert(const FixedId& _id)
+  {
+    uint64_t fingerprint = Fingerprint(_id);
+    size_t position = Probe(fingerprint);
+    if (table[position] == fingerprint) {
+      duplicateCount++;
+      return false;
+    }
+    if (2 * (count + 1) > table.size()) {
+      Rehash(table.size() * 2);
+      position = Probe(fingerprint);
+    }
+    table[position] = fingerprint;
+    count++;
+    if (!bloom.empty()) BloomAdd(fingerprint);
+    return true;
+  };
+
+  // Check if an ID was added
+  bool Contains(const FixedId& _id) const
+  {
+    uint64_t fingerprint = Fingerprint(_id);
+    if (!bloom.empty() && !BloomTest(fingerprint)) return false;
+    return table[Probe(fingerprint)] == fingerprint;
+  };
+
+  // Forget every ID, keeping the memory
+  void Clear()
+  {
+    fill(table.begin(), table.end(), EMPTY);
+    fill(bloom.begin(), bloom.end(), 0);
+    count = 0;
+    duplicateCount = 0;
+  };
+
+  // Get the number of IDs added
+  size_t GetCount() const { return count; };
+
+  // Get the number of duplicates rejected by Insert
+  size_t GetDuplicateCount() const { return duplicateCount; };
+
+  // Get the bytes held by the table and the bloom filter
+  size_t GetMemoryBytes() const { return table.size() * sizeof(uint64_t) + bloom.size() * sizeof(uint64_t); };
+
+private:
+  static constexpr uint64_t EMPTY = 0;
+
+  // FNV-1a of the ID through a murmur finalizer, so the low bits index well; never EMPTY
+  static uint64_t Fingerprint(const FixedId& _id)
+  {
+    uint64_t hash = _id.Hash();
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDULL;
+    hash ^= hash >> 33;
+    hash *= 0xC4CEB9FE1A85EC53ULL;
+    hash ^= hash >> 33;
+    return hash == EMPTY ? 1 : hash;
+  };
+
+  // position of the fingerprint, or of the empty entry where it would go
+  size_t Probe(uint64_t _fingerprint) const
+  {
+    size_t position = _fingerprint & mask;
+    while (table[position] != EMPTY && table[position] != _fingerprint) position = (position + 1) & mask;
+    return position;
+  };
+
+  void Rehash(size_t _size)
+  {
+    vector<uint64_t> old(_size, EMPTY);
+    old.swap(table);
+    mask = _size - 1;
+    for (uint64_t fingerprint : old) {
+      if (fingerprint != EMPTY) table[Probe(fingerprint)] = fingerprint;
+    }
+  };
+
+  // bloom bits from the upper half of the fingerprint by double hashing; the table uses the low bits
+  void BloomAdd(uint64_t _fingerprint)
+  {
+    uint64_t h1 = _fingerprint >> 32;
+    uint64_t h2 = (_fingerprint >> 16) | 1;
+    for (int k = 0; k < 3; ++k) {
+      uint64_t bit = (h1 + k * h2) & bloomMask;
+      bloom[bit >> 6] |= 1ULL << (bit & 63);
+    }
+  };
+
+  bool BloomTest(uint64_t _fingerprint) const
+  {
+    uint64_t h1 = _fingerprint >> 32;
+    uint64_t h2 = (_fingerprint >> 16) | 1;
+    for (int k = 0; k < 3; ++k) {
+      uint64_t bit = (h1 + k * h2) & bloomMask;
+      if (!((bloom[bit >> 6] >> (bit & 63)) & 1)) return false;
+    }
+    return true;
+  };
+
+  vector<uint64_t> table;
+  size_t mask;
+  vector<uint64_t> bloom;
+  uint64_t bloomMask;
+  size_t count;
+  size_t duplicateCount;
+
+};
+
+#endif
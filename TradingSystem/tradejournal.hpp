@@ -0,0 +1,309 @@
+/**
+ * tradejournal.hpp
+ * Memory-mapped, segmented, append-only journal of booked trades with a trade ID index.
+ *
+ * @author Yicheng Sun
+ */
+
+#ifndef TRADE_JOURNAL_HPP
+#define TRADE_JOURNAL_HPP
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <type_traits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "idgenerator.hpp"
+#include "functions.hpp"
+
+using namespace std;
+
+const uint32_t TRADE_JOURNAL_MAGIC = 0x54524A4E; // "TRJN"
+const uint32_t TRADE_JOURNAL_VERSION = 1;
+
+/**
+ * Trade as stored in the journal, 64 bytes. A record with an empty trade ID marks the
+ * end of the written part of a segment.
+ */
+struct TradeRecord
+{
+  FixedId tradeId;
+  FixedId book;
+  double price;
+  int64_t quantity;
+  int64_t timestampNanos; // system clock, when booked
+  int32_t productIndex;
+  uint8_t side; // Side
+  uint8_t reserved[3];
+};
+
+static_assert(is_trivially_copyable<TradeRecord>::value && sizeof(TradeRecord) == 64, "TradeRecord must be a trivially copyable 64 bytes");
+
+
+/**
+ * Trade journal over a directory of fixed-size segment files (trades.000000, trades.000001, ...).
+ * Each segment starts with a header record and is mapped shared in full, so booking a trade
+ * is one copy into the mapping plus an insert into an open-addressing index on trade ID;
+ * the kernel writes pages back on its own, or on Sync. A trade booked again under the same
+ * ID is appended and the index moves to the newest record.
+ * Opening a directory that already holds segments maps them and rebuilds the index, so the
+ * history survives a restart. Single writer, not thread-safe.
+ */
+class TradeJournal
+{
+
+public:
+  // ctor and dtor
+  TradeJournal(size_t _segmentRecords = 1 << 16) : segmentRecords(_segmentRecords), count(0), tail(0)
+  {
+    if (_segmentRecords < 2) throw invalid_argument("trade journal segments need at least one record after the header");
+    ResetIndex(1024);
+  };
+  ~TradeJournal() { Close(); };
+
+  // Open the journal in _directory, creating it if needed and replaying existing segments
+  bool Open(const string& _directory)
+  {
+    Close();
+    directory = _directory;
+    if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) {
+      logger(LogType::ERROR, "Trade journal failed to create " + directory + ": " + strerror(errno));
+      return false;
+    }
+    ResetIndex(1024);
+    count = 0;
+    for (size_t s = 0; ; ++s) {
+      struct stat info;
+      if (stat(SegmentPath(s).c_str(), &info) != 0) break;
+      if (!MapSegment(s, false)) return false;
+      // replay up to the first empty record
+      TradeRecord* records = Records(s);
+      for (tail = 1; tail < segmentRecords && !records[tail].tradeId.Empty(); ++tail) IndexRecord(records[tail], Location(s, tail));
+    }
+    if (segments.empty() && !MapSegment(0, true)) return false;
+    return true;
+  };
+
+  // Unmap every segment
+  void Close()
+  {
+    for (auto& segment : segments) {
+      munmap(segment, SegmentBytes());
+    }
+    segments.clear();
+    tail = 0;
+  };
+
+  // Append a trade, returns its record in the journal or nullptr if no segment could be mapped
+  const TradeRecord* Append(const TradeRecord& _record)
+  {
+    if (segments.empty()) return nullptr;
+    if (tail == segmentRecords) {
+      if (!MapSegment(segments.size(), true)) return nullptr;
+    }
+    size_t s = segments.size() - 1;
+    TradeRecord* record = Records(s) + tail;
+    memcpy(record, &_record, sizeof(TradeRecord));
+    IndexRecord(*record, Location(s, tail));
+    tail++;
+    return record;
+  };
+
+  // Find the latest trade with an ID, nullptr if none
+  const TradeRecord* Find(const FixedId& _tradeId) const
+  {
+    size_t position = Probe(_tradeId, HashOf(_tradeId));
+    return index[position].location == EMPTY ? nullptr : At(index[position].location);
+  };
+
+  // Call _func on every record in booking order, including trades booked again
+  template<typename F>
+  void ForEach(F&& _func) const
+  {
+    for (size_t s = 0; s < segments.size(); ++s) {
+      size_t end = s + 1 == segments.size() ? tail : segmentRecords;
+      for (size_t r = 1; r < end; ++r) _func(Records(s)[r]);
+    }
+  };
+
+  // Flush the mappings to disk
+  void Sync()
+  {
+    for (auto& segment : segments) {
+      msync(segment, SegmentBytes(), MS_SYNC);
+    }
+  };
+
+  // Drop every record from _tail on, e.g. trades booked after a checkpoint, false if the journal ends before _tail
+  bool Truncate(uint64_t _tail)
+  {
+    size_t segment = _tail >> 32;
+    size_t record = _tail & 0xFFFFFFFF;
+    if (segments.empty() || _tail > GetTail() || record < 1 || record > segmentRecords) return false;
+    size_t end = segment + 1 == segments.size() ? tail : segmentRecords;
+    fill(Records(segment) + record, Records(segment) + end, TradeRecord{});
+    while (segments.size() > segment + 1) {
+      munmap(segments.back(), SegmentBytes());
+      segments.pop_back();
+      unlink(SegmentPath(segments.size()).c_str());
+    }
+    tail = record;
+    // replay what is left
+    ResetIndex(1024);
+    count = 0;
+    for (size_t s = 0; s < segments.size(); ++s) {
+      size_t last = s + 1 == segments.size() ? tail : segmentRecords;
+      for (size_t r = 1; r < last; ++r) IndexRecord(Records(s)[r], Location(s, r));
+    }
+    return true;
+  };
+
+  // Get the position of the next record, segment << 32 | record
+  uint64_t GetTail() const { return segments.empty() ? 0 : Location(segments.size() - 1, tail); };
+
+  // Get the number of distinct trade IDs
+  size_t GetCount() const { return count; };
+
+  // Get the number of segments
+  size_t GetSegmentCount() const { return segments.size(); };
+
+private:
+  static const uint64_t EMPTY = UINT64_MAX;
+
+  // first record of a segment
+  struct SegmentHeader
+  {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t recordBytes;
+    uint32_t reserved;
+    uint64_t segmentRecords;
+    char padding[40];
+  };
+
+  static_assert(sizeof(SegmentHeader) == sizeof(TradeRecord), "the segment header takes one record");
+
+  struct IndexEntry
+  {
+    uint64_t location; // segment << 32 | record
+    uint32_t hash;
+  };
+
+  static uint32_t HashOf(const FixedId& _id)
+  {
+    uint64_t hash = _id.Hash();
+    return (uint32_t) (hash ^ (hash >> 32));
+  };
+
+  static uint64_t Location(size_t _segment, size_t _record) { return ((uint64_t) _segment << 32) | _record; };
+
+  size_t SegmentBytes() const { return segmentRecords * sizeof(TradeRecord); };
+
+  string SegmentPath(size_t _segment) const
+  {
+    char name[32];
+    snprintf(name, sizeof(name), "/trades.%06zu", _segment);
+    return directory + name;
+  };
+
+  TradeRecord* Records(size_t _segment) const { return (TradeRecord*) segments[_segment]; };
+
+  const TradeRecord* At(uint64_t _location) const { return Records(_location >> 32) + (_location & 0xFFFFFFFF); };
+
+  // map segment _segment, sizing and stamping its header if it is new
+  bool MapSegment(size_t _segment, bool _create)
+  {
+    string path = SegmentPath(_segment);
+    int fd = open(path.c_str(), _create ? O_RDWR | O_CREAT | O_EXCL : O_RDWR, 0644);
+    if (fd < 0 || (_create && ftruncate(fd, SegmentBytes()) != 0)) {
+      logger(LogType::ERROR, "Trade journal failed to open " + path + ": " + strerror(errno));
+      if (fd >= 0) close(fd);
+      return false;
+    }
+    struct stat info;
+    fstat(fd, &info);
+    if ((size_t) info.st_size != SegmentBytes()) {
+      logger(LogType::ERROR, "Trade journal segment " + path + " does not hold " + to_string(segmentRecords) + " records");
+      close(fd);
+      return false;
+    }
+    // fault a new segment in up front rather than page by page while booking
+    void* base = mmap(nullptr, SegmentBytes(), PROT_READ | PROT_WRITE, MAP_SHARED | (_create ? MAP_POPULATE : 0), fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+      logger(LogType::ERROR, "Trade journal failed to map " + path + ": " + strerror(errno));
+      return false;
+    }
+
+    SegmentHeader* header = (SegmentHeader*) base;
+    if (_create) {
+      *header = SegmentHeader{TRADE_JOURNAL_MAGIC, TRADE_JOURNAL_VERSION, (uint32_t) sizeof(TradeRecord), 0, segmentRecords, {}};
+    }
+    else if (header -> magic != TRADE_JOURNAL_MAGIC || header -> version != TRADE_JOURNAL_VERSION || header -> recordBytes != sizeof(TradeRecord)) {
+      logger(LogType::ERROR, "Trade journal segment " + path + " is not a version " + to_string(TRADE_JOURNAL_VERSION) + " journal");
+      munmap(base, SegmentBytes());
+      return false;
+    }
+    segments.push_back((char*) base);
+    tail = 1;
+    return true;
+  };
+
+  // point the index at a record, replacing an older record of the same trade
+  void IndexRecord(const TradeRecord& _record, uint64_t _location)
+  {
+    if (2 * (count + 1) > index.size()) Rehash(index.size() * 2);
+    uint32_t hash = HashOf(_record.tradeId);
+    size_t position = Probe(_record.tradeId, hash);
+    if (index[position].location == EMPTY) count++;
+    index[position] = IndexEntry{_location, hash};
+  };
+
+  // position of the ID in the index, or of the empty entry where it would go
+  size_t Probe(const FixedId& _id, uint32_t _hash) const
+  {
+    size_t position = _hash & mask;
+    while (index[position].location != EMPTY) {
+      if (index[position].hash == _hash && At(index[position].location) -> tradeId == _id) break;
+      position = (position + 1) & mask;
+    }
+    return position;
+  };
+
+  void ResetIndex(size_t _size)
+  {
+    index.assign(_size, IndexEntry{EMPTY, 0});
+    mask = _size - 1;
+  };
+
+  void Rehash(size_t _size)
+  {
+    vector<IndexEntry> old;
+    old.swap(index);
+    ResetIndex(_size);
+    for (auto& entry : old) {
+      if (entry.location == EMPTY) continue;
+      size_t position = entry.hash & mask;
+      while (index[position].location != EMPTY) position = (position + 1) & mask;
+      index[position] = entry;
+    }
+  };
+
+  string directory;
+  size_t segmentRecords;
+  vector<char*> segments;
+  vector<IndexEntry> index;
+  size_t mask;
+  size_t count;
+  size_t tail; // next free record of the last segment
+
+};
+
+#endif